@@ -1,6 +1,7 @@
 /*
- *  For maximum performance, set to 0 the *_POLL_TIMEOUT constants in the
- *  config.hpp file and compile the program with SINGLE_IO_THREAD=1.
+ *  For maximum performance, make the progress engine always busy-poll
+ *  (MTCL_PROGRESS=-1 in the environment, or Manager::setProgressPolicy)
+ *  and compile the program with SINGLE_IO_THREAD=1.
  *
  *  $> TPROTOCOL="MPI UCX" make SINGLE_IO_THREAD=1 cleanall p2p-perf
  *
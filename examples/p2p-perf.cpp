@@ -1,6 +1,7 @@
 /*
- *  For maximum performance, set to 0 the *_POLL_TIMEOUT constants in the
- *  config.hpp file and compile the program with SINGLE_IO_THREAD=1.
+ *  For maximum performance, make the progress engine always busy-poll
+ *  (MTCL_PROGRESS=-1 in the environment, or Manager::setProgressPolicy)
+ *  and compile the program with SINGLE_IO_THREAD=1.
  *
  *  $> TPROTOCOL="MPI UCX" make SINGLE_IO_THREAD=1 cleanall p2p-perf
  *
@@ -14,6 +15,16 @@
  *  or 
  *  $>  mpirun --report-bindings --bind-to-core .....
  *
+ *  TCP and URING (TCP over io_uring) can be compared on the same host with:
+ *
+ *  $> TPROTOCOL=URING make cleanall p2p-perf
+ *  $> ./p2p-perf 0 "TCP:localhost:13000" & ./p2p-perf 1 "TCP:localhost:13000"
+ *  $> ./p2p-perf 0 "URING:localhost:13000" & ./p2p-perf 1 "URING:localhost:13000"
+ *
+ *  and with Unix domain sockets:
+ *
+ *  $> ./p2p-perf 0 "UDS:/tmp/p2p-perf.sock" & ./p2p-perf 1 "UDS:/tmp/p2p-perf.sock"
+ *
  */
 
 #include <cassert>
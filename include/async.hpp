@@ -0,0 +1,466 @@
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+/*
+ * C++20 coroutine front-end.
+ *
+ * A Task is a lazily started coroutine. Root tasks are spawned on an
+ * Executor (SingleThreadExecutor or ThreadPoolExecutor), which resumes them
+ * when the awaited operation completes. Completions are detected by the IO
+ * thread, that never runs user code: it only reschedules the coroutine.
+ *
+ *   Task<void> serve(AsyncHandle h) {
+ *       char buf[64];
+ *       ssize_t r;
+ *       while((r = co_await h.receive(buf, sizeof(buf))) > 0)
+ *           co_await h.send(buf, r);
+ *       h.close();
+ *   }
+ *   Task<void> acceptor(Executor& ex) {
+ *       while(true) {
+ *           auto h = co_await Manager::next();
+ *           if (h.isNewConnection()) ex.spawn(serve(AsyncHandle(std::move(h))));
+ *       }
+ *   }
+ *
+ * Included by manager.hpp when compiling with coroutine support, it cannot
+ * be used if SINGLE_IO_THREAD is defined.
+ */
+
+#if !defined(__cpp_impl_coroutine)
+#error "async.hpp requires C++20 coroutines (e.g., -std=c++20)"
+#endif
+#if defined(SINGLE_IO_THREAD)
+#error "async.hpp requires the IO thread, SINGLE_IO_THREAD is not supported"
+#endif
+
+#include <coroutine>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "manager.hpp"
+
+template<typename T> class Task;
+
+/**
+ * @brief Queue of coroutines ready to be resumed, shared by the threads
+ * calling run. run returns when all the spawned tasks have completed.
+ */
+class Executor {
+    template<typename T> friend class Task;
+    friend struct TaskPromiseBase;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::coroutine_handle<>> ready;
+    size_t ntasks = 0;
+
+    void taskDone() {
+        std::unique_lock lk(mtx);
+        if (--ntasks == 0) cv.notify_all();
+    }
+
+protected:
+    void loop() {
+        while(true) {
+            std::coroutine_handle<> h;
+            {
+                std::unique_lock lk(mtx);
+                cv.wait(lk, [&]{ return !ready.empty() || ntasks == 0; });
+                if (ready.empty()) return;
+                h = ready.front();
+                ready.pop_front();
+            }
+            h.resume();
+        }
+    }
+
+public:
+    Executor() {}
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    virtual ~Executor() {}
+
+    /**
+     * @brief Enqueues \b h to be resumed by one of the executor's threads.
+     * It can be called by any thread.
+     */
+    void schedule(std::coroutine_handle<> h) {
+        std::unique_lock lk(mtx);
+        ready.push_back(h);
+        cv.notify_one();
+    }
+
+    /**
+     * @brief Starts \b t as a root task of this executor. The task frame is
+     * destroyed when it completes.
+     */
+    inline void spawn(Task<void>&& t);
+
+    /**
+     * @brief Runs the spawned tasks until all of them have completed.
+     */
+    virtual void run() = 0;
+};
+
+/**
+ * @brief All the coroutines are resumed by the thread calling run.
+ */
+class SingleThreadExecutor : public Executor {
+public:
+    void run() { loop(); }
+};
+
+/**
+ * @brief The coroutines are resumed by a pool of \b nthreads threads, the one
+ * calling run included. Coroutines may be resumed on a different thread after
+ * each suspension.
+ */
+class ThreadPoolExecutor : public Executor {
+    const unsigned nthreads;
+public:
+    ThreadPoolExecutor(unsigned nthreads=std::thread::hardware_concurrency()) :
+        nthreads(nthreads ? nthreads : 1) {}
+
+    void run() {
+        std::vector<std::thread> pool;
+        for(unsigned i=1; i<nthreads; ++i)
+            pool.emplace_back([this]() { loop(); });
+        loop();
+        for(auto& t : pool) t.join();
+    }
+};
+
+
+struct TaskPromiseBase {
+    Executor* executor = nullptr;
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+    bool detached = false;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            auto& p = h.promise();
+            if (p.continuation) return p.continuation;
+            if (p.detached) {
+                if (p.exception)
+                    MTCL_ERROR("[Executor]:\t", "unhandled exception in a spawned task\n");
+                Executor* ex = p.executor;
+                h.destroy();
+                ex->taskDone();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+    template<typename U>
+    void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+    T result() {
+        if (exception) std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+    void return_void() {}
+    void result() {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+/**
+ * @brief Lazily started coroutine returning a value of type \b T. It starts
+ * when awaited, on the executor of the awaiting coroutine, or when spawned on
+ * an Executor.
+ */
+template<typename T=void>
+class Task {
+    friend class Executor;
+public:
+    struct promise_type : TaskPromise<T> {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    Task(Task&& o) : h(o.h) { o.h = nullptr; }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (h) h.destroy(); }
+
+    struct Awaiter {
+        std::coroutine_handle<promise_type> h;
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> parent) noexcept {
+            h.promise().executor     = parent.promise().executor;
+            h.promise().continuation = parent;
+            return h;
+        }
+        T await_resume() { return h.promise().result(); }
+    };
+    Awaiter operator co_await() && noexcept { return Awaiter{h}; }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+inline void Executor::spawn(Task<void>&& t) {
+    auto h = t.h;
+    t.h = nullptr;
+    h.promise().executor = this;
+    h.promise().detached = true;
+    {
+        std::unique_lock lk(mtx);
+        ++ntasks;
+    }
+    schedule(h);
+}
+
+
+/**
+ * @brief Awaiter returned by Manager::next, it resumes the coroutine with the
+ * next ready handle.
+ */
+class NextAwaiter {
+    HandleUser result;
+public:
+    bool await_ready() noexcept { return false; }
+    template<typename P>
+    bool await_suspend(std::coroutine_handle<P> h) {
+        Executor* ex = h.promise().executor;
+        // called by the IO thread, it must not touch the frame after schedule
+        return !Manager::waitReady(result, [this, ex, h](HandleUser&& el) {
+            result = std::move(el);
+            ex->schedule(h);
+        });
+    }
+    HandleUser await_resume() { return std::move(result); }
+};
+
+inline NextAwaiter Manager::next() { return NextAwaiter{}; }
+
+
+/**
+ * @brief Awaits the future \b f (e.g., the one returned by
+ * Manager::connectAsync) without blocking the executor: the IO thread polls
+ * it (see Manager::runOnIO) and reschedules the coroutine when it is ready.
+ */
+template<typename T>
+struct FutureAwaiter {
+    std::future<T> f;
+    bool await_ready() {
+        return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+    template<typename P>
+    void await_suspend(std::coroutine_handle<P> h) {
+        Executor* ex = h.promise().executor;
+        // it must not touch the frame after schedule
+        Manager::runOnIO([this, ex, h]() {
+            if (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return false;
+            ex->schedule(h);
+            return true;
+        });
+    }
+    T await_resume() { return f.get(); }
+};
+
+template<typename T>
+FutureAwaiter<T> operator co_await(std::future<T>&& f) { return FutureAwaiter<T>{std::move(f)}; }
+
+
+/**
+ * @brief Point-to-point handle used from coroutines. The messages are read by
+ * the IO thread (see Manager::onMessage) and either delivered to the coroutine
+ * waiting in receive, which is then rescheduled on its executor, or buffered
+ * until the next receive. The IO thread owns the handle: close and the
+ * release of the handle are run by it (see Manager::runOnIO), only the sends
+ * are performed by the coroutine.
+ */
+class AsyncHandle {
+    struct state_t {
+        std::mutex mtx;
+        std::deque<std::vector<char>> mailbox;
+        bool eos = false;
+        // pending receive, if any
+        std::coroutine_handle<> waiter;
+        Executor* executor = nullptr;
+        void*   buff = nullptr;
+        size_t  size = 0;
+        ssize_t result = 0;
+        int     err = 0;
+    };
+
+    // copies the message into the receive buffer, the lock must be held
+    static ssize_t deliver(const void* msg, size_t sz, void* buff, size_t size, int& err) {
+        if (sz > size) {
+            MTCL_ERROR("[AsyncHandle]:\t", "receive ENOMEM, message discarded\n");
+            err = ENOMEM;
+            return -1;
+        }
+        memcpy(buff, msg, sz);
+        return sz;
+    }
+
+    // shared with the tasks run by the IO thread, that drops it last
+    std::shared_ptr<HandleUser> h;
+    std::shared_ptr<state_t> st;
+    bool closed = false;
+
+    // hands our reference of the handle over to the IO thread
+    void release() {
+        if (!h) return;
+        Manager::runOnIO([h = std::move(h)]() { return true; });
+    }
+
+public:
+    class ReceiveAwaiter {
+        friend class AsyncHandle;
+        state_t* st;
+        void*    buff;
+        size_t   size;
+        ssize_t  result = 0;
+        int      err = 0;
+        ReceiveAwaiter(state_t* st, void* buff, size_t size) : st(st), buff(buff), size(size) {}
+    public:
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        bool await_suspend(std::coroutine_handle<P> h) {
+            std::unique_lock lk(st->mtx);
+            if (!st->mailbox.empty()) {
+                auto& msg = st->mailbox.front();
+                result = deliver(msg.data(), msg.size(), buff, size, err);
+                st->mailbox.pop_front();
+                return false;
+            }
+            if (st->eos) return false;
+            st->waiter   = h;
+            st->executor = h.promise().executor;
+            st->buff     = buff;
+            st->size     = size;
+            return true;
+        }
+        ssize_t await_resume() {
+            std::unique_lock lk(st->mtx);
+            if (st->waiter) {   // it has been resumed by the IO thread
+                result = st->result;
+                err    = st->err;
+                st->waiter = nullptr;
+            }
+            if (result < 0) errno = err;
+            return result;
+        }
+    };
+
+    class SendAwaiter {
+        friend class AsyncHandle;
+        ssize_t result;
+        SendAwaiter(ssize_t r) : result(r) {}
+    public:
+        bool await_ready() noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) noexcept {}
+        ssize_t await_resume() noexcept { return result; }
+    };
+
+    AsyncHandle() {}
+
+    /**
+     * @brief Takes the ownership of \b hu (e.g., as returned by
+     * Manager::next or by connect) and gives its reading side to the IO thread.
+     */
+    explicit AsyncHandle(HandleUser&& hu) :
+        h(std::make_shared<HandleUser>(std::move(hu))), st(std::make_shared<state_t>()) {
+        std::weak_ptr<state_t> wst = st;
+        if (Manager::onMessage(*h, [wst](HandleUser&, const void* buff, size_t sz) {
+                auto st = wst.lock();
+                if (!st) return;
+                std::unique_lock lk(st->mtx);
+                if (sz == 0) st->eos = true;
+                if (st->executor) {
+                    if (sz) st->result = deliver(buff, sz, st->buff, st->size, st->err);
+                    else    st->result = 0;
+                    Executor* ex = st->executor;
+                    st->executor = nullptr;
+                    ex->schedule(st->waiter);
+                    return;
+                }
+                if (sz) st->mailbox.emplace_back((const char*)buff, (const char*)buff + sz);
+            }) == -1) {
+            MTCL_ERROR("[AsyncHandle]:\t", "invalid handle, errno=%d\n", errno);
+            st->eos = true;
+            return;
+        }
+        h->yield();
+    }
+
+    AsyncHandle(AsyncHandle&& o) : h(std::move(o.h)), st(std::move(o.st)), closed(o.closed) {}
+    AsyncHandle& operator=(AsyncHandle&& o) {
+        if (this != &o) {
+            release();
+            h      = std::move(o.h);
+            st     = std::move(o.st);
+            closed = o.closed;
+        }
+        return *this;
+    }
+    ~AsyncHandle() { release(); }
+
+    /**
+     * @brief Receives the next message into \b buff.
+     *
+     * @return (once awaited) the size of the message, \c 0 if the peer
+     * closed the connection, \c -1 with errno set to ENOMEM if the message is
+     * larger than \b size (the message is discarded).
+     */
+    ReceiveAwaiter receive(void* buff, size_t size) { return ReceiveAwaiter(st.get(), buff, size); }
+
+    /**
+     * @brief Sends \b size bytes of \b buff. The send is performed by the
+     * calling thread, as HandleUser::send does, the awaiter is always ready.
+     * It fails with EBADF after close.
+     */
+    SendAwaiter send(const void* buff, size_t size) {
+        if (!h || closed) {
+            errno = EBADF;
+            return SendAwaiter(-1);
+        }
+        return SendAwaiter(h->send(buff, size));
+    }
+
+    /**
+     * @brief Closes the writing side, the EOS is sent by the IO thread after
+     * the messages already sent. The EOS of the peer can still be received.
+     */
+    void close() {
+        if (!h || closed) return;
+        closed = true;
+        Manager::runOnIO([h = h]() {
+            h->close();
+            return true;
+        });
+    }
+    bool isValid() { return h && h->isValid(); }
+};
+
+#endif
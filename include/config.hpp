@@ -5,24 +5,78 @@
 // -------------- some configuration parameters ----------------
 
 // all timeouts are in microseconds unless otherwise stated
-const unsigned IO_THREAD_POLL_TIMEOUT  = 10; 
+
+// ------ Progress engine ------
+// defaults of the adaptive polling policy (see progress.hpp), they can be
+// changed at run time with MTCL_PROGRESS="spin:yield:poll"
+const unsigned PROGRESS_SPIN_TIME      = 50;    // busy-polling after the last event
+const unsigned PROGRESS_YIELD_TIME     = 200;   // then yielding the CPU, then blocking
+// the blocked IO thread waits on the protocols' poll fds, this is the polling
+// interval used when some protocol cannot provide one (e.g., MPI, MQTT)
+const unsigned PROGRESS_POLL_TIME      = 10;
+
+const unsigned CACHE_LINE_SIZE         = 64;    // bytes
+
+// ------ Manager ------
+// ready handles waiting for getNext (multi-thread build), it must be larger
+// than the number of handles that can be ready at the same time, otherwise
+// producers wait for a free slot
+const unsigned READY_QUEUE_CAPACITY    = 16384;
+const unsigned READY_QUEUE_SPIN        = 128;   // getNext retries before sleeping
+
+// ------ Tracing ------
+// events kept per thread if compiled with MTCL_ENABLE_TRACE (see trace.hpp)
+const unsigned TRACE_BUFFER_EVENTS     = 65536;
+
+// ------ Send coalescing ------
+// default deadline of the coalesced sends of TCP and UCX handles, see
+// HandleUser::setCoalescing
+const long COALESCING_DEADLINE         = 50;    // -1 means no deadline
 
 // ------ TCP ------
 const unsigned TCP_BACKLOG             = 128;
-const unsigned TCP_POLL_TIMEOUT        = 10; 
+const unsigned TCP_MAX_EVENTS          = 1024; // events handled per update
+// per-connection read-ahead buffer, probe and small receives are served from
+// it with fewer syscalls (it is never smaller than the size header)
+const unsigned TCP_READAHEAD_SIZE      = 65536; // bytes
+// payloads of at least this size are sent with MSG_ZEROCOPY, send and isend
+// complete when the kernel has released the pages (0 disables it)
+const unsigned TCP_ZEROCOPY_THRESHOLD  = (1<<20); // bytes
+// pipe used by receiveToFile to splice the payload from the socket to the
+// file, and chunk size of sendFile/receiveToFile when they copy the data
+const unsigned TCP_SPLICE_SIZE         = (1<<20); // bytes
 const unsigned UNREACHABLE_ADDR_TIMOUT = 100;  // milliseconds   
+const unsigned CONNECT_ATTEMPT_DELAY   = 250;  // milliseconds between parallel connection attempts (RFC 8305)
+
+// ------ STCP (TCP striped over several sockets) ------
+const unsigned STCP_RAILS              = 4;     // sockets per connection
+const unsigned STCP_THRESHOLD          = (1<<20); // payloads split across the sockets (bytes)
+const unsigned STCP_HELLO_TIMEOUT      = 1000;  // milliseconds to get the Hello and all the sockets of a connection
+
+// ------ URING (TCP over io_uring, compiled with ENABLE_URING) ------
+const unsigned URING_ENTRIES           = 256;   // submission queue size
+const unsigned URING_BUFFERS           = 64;    // receive buffers provided to the kernel
+const unsigned URING_BUFFER_SIZE       = 65536; // bytes
+const unsigned URING_SEND_BATCH        = 256;   // isends of a handle written by one sendmsg
+const unsigned URING_RBUF_MAX          = (1<<22); // bytes buffered by a handle before its receive is paused
 
 // ------ SHM ------
-const unsigned SHM_SMALL_MSG_SIZE      = (1<<22);
+const unsigned SHM_SMALL_MSG_SIZE      = (1<<22);  // default ring of a connection (see "?size=")
+const unsigned SHM_LISTEN_BUFFER_SIZE  = (1<<16);  // ring of the connection requests
+const unsigned long SHM_MAX_SEGMENT_SIZE = (1UL<<30);
+const unsigned SHM_HUGEPAGE_SIZE       = (1<<21);
 const unsigned SHM_MAX_CONCURRENT_CONN = 1024;
+// busy-wait iterations of a blocked send/receive before sleeping on a futex
+const unsigned SHM_SPIN_ITERS          = 4096;
+// a blocked probe of a TCP connection upgraded to shared memory checks the
+// socket at least this often, a peer that dies does not send the EOS
+const unsigned SHM_UPGRADE_HANGUP_CHECK = 100; // milliseconds
 
 // ------ MPI ------
-const unsigned MPI_POLL_TIMEOUT        = 10; 
 const unsigned MPI_CONNECTION_TAG      = 0;
 const unsigned MPI_DISCONNECT_TAG      = 1;
 
 // ------ MPIP2P ------
-const unsigned MPIP2P_POLL_TIMEOUT     = 10; 
 const char MPIP2P_STOP_PROCESS[]       = "stop_accept";
 
 // ------- MQTT -----
@@ -38,7 +92,6 @@ const std::string MQTT_SERVER_ADDRESS{ "tcp://localhost:1883" };
 
 // ------- UCX ------
 const unsigned UCX_BACKLOG             = 128;
-const unsigned UCX_POLL_TIMEOUT        = 10; 
 
 // -------- COLLECTIVES ------
 const int CCONNECTION_RETRY            = 10;
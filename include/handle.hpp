@@ -3,10 +3,23 @@
 
 #include <iostream>
 #include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
 
 #include "protocolInterface.hpp"
+#include "request.hpp"
 #include "utils.hpp"
 
+class HandleUser;
+
+/**
+ * @brief Handler invoked by the progress engine for each message received on
+ * a handle in reactor mode (see Manager::onMessage). \b size equal to 0 means
+ * that the peer closed the connection.
+ */
+using MessageHandler = std::function<void(HandleUser&, const void* buff, size_t size)>;
+
 enum HandleType {
     BROADCAST,
     FANIN,
@@ -27,12 +40,109 @@ protected:
     std::pair<bool, size_t> probed{false,0};  
 	std::atomic<bool> closed_rd = false, closed_wr = false;
     std::atomic<int> counter = 0;
+    std::atomic<bool> destroyed = false;
     HandleType type = P2P;
 
+    MTCL_STATS(HandleCounters  counters;)
+    MTCL_STATS(HandleCounters* protoCounters = nullptr;) // of the parent protocol, if any
+
+    // the count* methods update the counters of the handle and of its protocol
+    void countSend(ssize_t r, uint64_t ns) {
+        MTCL_STATS(for(HandleCounters* c : {&counters, protoCounters}) if (c) {
+            if (r > 0) { c->msgs_sent.add(1); c->bytes_sent.add(r); }
+            c->send_blocked_ns.add(ns);
+        })
+    }
+    void countRecv(ssize_t r, uint64_t ns) {
+        MTCL_STATS(for(HandleCounters* c : {&counters, protoCounters}) if (c) {
+            if (r > 0) { c->msgs_recv.add(1); c->bytes_recv.add(r); }
+            c->recv_blocked_ns.add(ns);
+        })
+    }
+    void countProbe(bool would_block, uint64_t ns) {
+        MTCL_STATS(for(HandleCounters* c : {&counters, protoCounters}) if (c) {
+            c->probes.add(1);
+            if (would_block) c->would_block.add(1);
+            c->recv_blocked_ns.add(ns);
+        })
+    }
+    void countYield() {
+        MTCL_STATS(for(HandleCounters* c : {&counters, protoCounters}) if (c) c->yields.add(1);)
+    }
 
     virtual void incrementReferenceCounter() = 0;
     virtual void decrementReferenceCounter() = 0;
 
+	// generic irecv, it polls the handle with a non-blocking probe
+	class ProbeRecvRequest : public RequestImpl {
+		CommunicationHandle* h;
+		void*  buff;
+		size_t size;
+		bool   done = false;
+
+		bool complete(ssize_t r, int e=0) {
+			result = r; err = e; done = true;
+			return true;
+		}
+	public:
+		ProbeRecvRequest(CommunicationHandle* h, void* buff, size_t size) :
+			h(h), buff(buff), size(size) {}
+
+		bool test() {
+			if (done) return true;
+			size_t sz;
+			ssize_t r = h->probe(sz, false);
+			if (r < 0) {
+				if (errno == EWOULDBLOCK || errno == EAGAIN) return false;
+				if (errno != ECONNRESET) return complete(-1, errno);
+				r = 0;
+			}
+			if (r == 0) {
+				h->close(true, true);
+				return complete(0);
+			}
+			if (sz == 0) { // EOS received
+				h->close(false, true);
+				return complete(0);
+			}
+			if (sz > size) { // the message can be received later with a larger buffer
+				h->probed = {true, sz};
+				return complete(-1, ENOMEM);
+			}
+			r = h->receive(buff, sz);
+			return complete(r, r < 0 ? errno : 0);
+		}
+	};
+
+	// counts the result of a non-blocking operation when it completes
+	class CountedRequest : public RequestImpl {
+		CommunicationHandle* h;
+		std::shared_ptr<RequestImpl> req;
+		const bool isSend;
+		bool counted = false;
+
+		void complete() {
+			if (counted) return;
+			counted = true;
+			result = req->result; err = req->err;
+			if (isSend) h->countSend(result, 0);
+			else        h->countRecv(result, 0);
+		}
+	public:
+		CountedRequest(CommunicationHandle* h, std::shared_ptr<RequestImpl> req, bool isSend) :
+			h(h), req(std::move(req)), isSend(isSend) {}
+
+		bool test() {
+			if (!req->test()) return false;
+			complete();
+			return true;
+		}
+		void wait() {
+			req->wait();
+			complete();
+		}
+	};
+
 public:
 
     /**
@@ -75,6 +185,182 @@ public:
      */
     virtual ssize_t receive(void* buff, size_t size) = 0;
 
+    /**
+     * @brief Scatter-gather version of send, the \b iovcnt buffers described
+     * by \b iov are sent as a single message. The default implementation
+     * copies them into a temporary buffer, transports override it to send
+     * them without copies.
+     * 
+     * @return number of bytes sent or \c -1 if an error occurred (errno is set)
+     */
+    virtual ssize_t sendv(const struct iovec* iov, int iovcnt) {
+        if (iovcnt == 1) return send(iov[0].iov_base, iov[0].iov_len);
+        std::vector<char> buff(iov_length(iov, iovcnt));
+        iov_gather(buff.data(), iov, iovcnt);
+        return send(buff.data(), buff.size());
+    }
+
+    /**
+     * @brief Scatter-gather version of receive, the payload of the message
+     * (whose header has already been read by probe) is received in the
+     * \b iovcnt buffers described by \b iov, filling all of them.
+     * 
+     * @return as for receive
+     */
+    virtual ssize_t receivev(const struct iovec* iov, int iovcnt) {
+        if (iovcnt == 1) return receive(iov[0].iov_base, iov[0].iov_len);
+        std::vector<char> buff(iov_length(iov, iovcnt));
+        ssize_t r = receive(buff.data(), buff.size());
+        if (r > 0) iov_scatter(buff.data(), iov, iovcnt);
+        return r;
+    }
+
+    /**
+     * @brief Sends \b len bytes of the file \b fd starting at offset \b off
+     * as a single message. The default implementation maps the file and
+     * sends the mapping, the files that cannot be mapped (e.g., pipes) are
+     * first copied into a staging_file.
+     *
+     * @return as for send
+     */
+    virtual ssize_t sendFile(int fd, off_t off, size_t len) {
+        file_mapping m(fd, off, len, false);
+        if (m.data) return send(m.data, len);
+        staging_file tmp(len);
+        if (!tmp.data) return -1;
+        off_t pos = lseek(fd, 0, SEEK_CUR) == -1 ? -1 : off;
+        if (read_all(fd, tmp.data, len, pos) == -1) return -1;
+        return send(tmp.data, len);
+    }
+
+    /**
+     * @brief Receives the payload of the message (whose header has already
+     * been read by probe, \b size bytes) into the file \b fd, at its current
+     * offset that is moved forward. The default implementation receives into
+     * a shared mapping of the file, that must be opened for reading and
+     * writing, otherwise into a staging_file then written to \b fd. If the
+     * file has been extended for the mapping and the receive fails, it is
+     * truncated back to its size.
+     *
+     * @return as for receive
+     */
+    virtual ssize_t receiveToFile(int fd, size_t size) {
+        off_t off = lseek(fd, 0, SEEK_CUR);
+        struct stat st;
+        if (off != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            bool extended = (size_t)st.st_size < off + size;
+            if (!extended || ftruncate(fd, off + size) == 0) {
+                file_mapping m(fd, off, size, true);
+                if (m.data) {
+                    ssize_t r = receive(m.data, size);
+                    if (r > 0) lseek(fd, off + r, SEEK_SET);
+                    else if (extended) {
+                        int e = errno;
+                        if (ftruncate(fd, st.st_size) == -1)
+                            MTCL_PRINT(100, "[internal]:\t", "Handle::receiveToFile ftruncate errno=%d\n", errno);
+                        errno = e;
+                    }
+                    return r;
+                }
+                if (extended && ftruncate(fd, st.st_size) == -1)
+                    MTCL_PRINT(100, "[internal]:\t", "Handle::receiveToFile ftruncate errno=%d\n", errno);
+            }
+        }
+        if (size == 0) {
+            char c;
+            return receive(&c, 0);
+        }
+        staging_file tmp(size);
+        if (!tmp.data) return -1;
+        ssize_t r = receive(tmp.data, size);
+        if (r > 0 && write_all(fd, tmp.data, r) == -1) return -1;
+        return r;
+    }
+
+    /**
+     * @brief Non-blocking version of send. The default implementation
+     * performs a blocking send and returns a completed request.
+     *
+     * @return the request state, see Request
+     */
+    virtual std::shared_ptr<RequestImpl> isend(const void* buff, size_t size) {
+        ssize_t r = send(buff, size);
+        return std::make_shared<CompletedRequest>(r, r < 0 ? errno : 0);
+    }
+
+    /**
+     * @brief Non-blocking reception of the next message in \b buff. The
+     * default implementation polls the handle with a non-blocking probe.
+     *
+     * @return the request state, see Request
+     */
+    virtual std::shared_ptr<RequestImpl> irecv(void* buff, size_t size) {
+        return std::make_shared<ProbeRecvRequest>(this, buff, size);
+    }
+
+    /**
+     * @brief Enables (\b size > 0) or disables (\b size equal to 0) the
+     * coalescing of the sends, see HandleUser::setCoalescing. The default
+     * implementation does not support it.
+     *
+     * @return \c 0 on success, \c -1 otherwise (errno is set)
+     */
+    virtual int setCoalescing(size_t size, long deadline_us) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /**
+     * @brief Writes the coalesced sends not written yet, if any.
+     *
+     * @return \c 0 on success, \c -1 otherwise (errno is set)
+     */
+    virtual int flush() { return 0; }
+
+    /**
+     * @brief Returns where the payload of the next message (\b size bytes)
+     * has to be written, inside the memory of the transport. The message is
+     * sent by commit. The default implementation does not support it.
+     *
+     * @return the buffer, \c nullptr otherwise (errno is set)
+     */
+    virtual void* acquireSendBuffer(size_t size) {
+        errno = ENOTSUP;
+        return nullptr;
+    }
+
+    /**
+     * @brief Sends the message returned by acquireSendBuffer.
+     *
+     * @return as for send
+     */
+    virtual ssize_t commit() {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /**
+     * @brief Points \b buff to the next message, read in place from the
+     * memory of the transport until release. The default implementation
+     * does not support it.
+     *
+     * @return as for receive
+     */
+    virtual ssize_t receiveView(const void*& buff) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /**
+     * @brief Releases the message returned by receiveView.
+     *
+     * @return \c 0 on success, \c -1 otherwise (errno is set)
+     */
+    virtual int release() {
+        errno = ENOTSUP;
+        return -1;
+    }
+
     virtual void yield() = 0;
     virtual void close(bool close_wr=true, bool close_rd=true) = 0;
 
@@ -101,22 +387,28 @@ class Handle : public CommunicationHandle {
     friend class Manager;
     friend class ConnType;
 
-    ConnType* parent;
+    std::shared_ptr<MessageHandler> handler; // reactor mode if set
 	
     void incrementReferenceCounter(){
         counter++;
     }
 
+    // in reactor mode the IO thread and the user share the handle, the one
+    // that drops the last reference of a closed handle deletes it
     void decrementReferenceCounter(){
-        counter--;
-        if (counter == 0 && closed_wr && closed_rd){
-            delete this;
-        }
+        if (counter.fetch_sub(1) == 1 && closed_wr && closed_rd)
+            destroy();
     }
 protected:	
+    ConnType* parent;
+
 	// if first=true second is the size contained in the header
     virtual ssize_t sendEOS() = 0;
 
+    // the last reference and close may race to delete the handle
+    void destroy() {
+        if (!destroyed.exchange(true)) delete this;
+    }
 
 public:
     Handle() {}
@@ -129,25 +421,22 @@ public:
     virtual bool peek() = 0;
 
     void yield() {
-        if (!closed_rd)
+        if (!closed_rd) {
+            countYield();
             parent->notify_yield(this);
+        }
     }
 
     void close(bool close_wr=true, bool close_rd=true){
-		if (close_wr && !closed_wr){
+		if (close_wr && !closed_wr.exchange(true))
             this->sendEOS();
-            closed_wr = true;
-        }
 
-        if (close_rd && !closed_rd){
-            closed_rd = true;
-        }
+        if (close_rd) closed_rd = true;
         
         parent->notify_close(this, closed_wr, closed_rd);
 
-        if (counter == 0 && closed_rd && closed_wr) {
-            delete this;
-        }
+        if (counter == 0 && closed_rd && closed_wr)
+            destroy();
         
         /*if (!closed) {
 			parent->notify_close(this, close_wr, close_rd);
@@ -158,7 +447,9 @@ public:
 		}*/
     }
     
-    Handle(ConnType* parent) : parent(parent) {}	
+    Handle(ConnType* parent) : parent(parent) {
+        MTCL_STATS(protoCounters = &parent->counters;)
+    }
     virtual ~Handle() {};
 };
 
@@ -5,6 +5,7 @@
 #include "collectives/collectiveContext.hpp"
 #endif
 #include "handle.hpp"
+#include "trace.hpp"
 #include "errno.h"
 
 class HandleUser {
@@ -13,6 +14,11 @@ class HandleUser {
     CommunicationHandle* realHandle;
     bool isReadable    = false;
     bool newConnection = true;
+    MTCL_STATS(uint64_t readySince = 0;) // when it entered the ready queue
+
+    const char* traceCategory() {
+        return realHandle->getType() == P2P ? "p2p" : "collective";
+    }
 public:
     HandleUser() : HandleUser(nullptr, false, false) {}
     HandleUser(CommunicationHandle* h, bool r, bool n): realHandle(h),
@@ -27,6 +33,7 @@ public:
 			realHandle    = o.realHandle;
 			isReadable    = o.isReadable;
 			newConnection = o.newConnection;
+			MTCL_STATS(readySince = o.readySince;)
 			o.realHandle  = nullptr;
 			o.isReadable  = false;
 			o.newConnection=false;
@@ -36,6 +43,7 @@ public:
 	
     HandleUser(HandleUser&& h) :
 		realHandle(h.realHandle), isReadable(h.isReadable), newConnection(h.newConnection) {
+        MTCL_STATS(readySince = h.readySince;)
         h.realHandle = nullptr;
 		h.isReadable = h.newConnection = false;
     }
@@ -74,7 +82,11 @@ public:
             errno = EBADF; // the "communicator" is not valid or closed
             return -1;
         }
-        return realHandle->send(buff, size);
+        MTCL_TRACE("Handle::send", traceCategory(), size);
+        StatsTimer t;
+        ssize_t r = realHandle->send(buff, size);
+        realHandle->countSend(r, t.elapsed());
+        return r;
     }
 
 	ssize_t probe(size_t& size, const bool blocking=true) {
@@ -96,7 +108,11 @@ public:
 
 		// reading the header to get the size of the message
 		ssize_t r;
-		if ((r=realHandle->probe(size, blocking))<=0) {
+		MTCL_TRACE("Handle::probe", traceCategory());
+		StatsTimer t;
+		r = realHandle->probe(size, blocking);
+		realHandle->countProbe(r == -1 && (errno==EWOULDBLOCK || errno==EAGAIN), blocking ? t.elapsed() : 0);
+		if (r<=0) {
 			switch(r) {
 			case 0: {
 				isReadable=false;
@@ -154,11 +170,323 @@ public:
 			return -1;
 		}	   
 		realHandle->probed={false,0};
-		return realHandle->receive(buff, std::min(sz,size));
+		MTCL_TRACE("Handle::receive", traceCategory(), sz);
+		StatsTimer t;
+		ssize_t r = realHandle->receive(buff, std::min(sz,size));
+		realHandle->countRecv(r, t.elapsed());
+		return r;
+    }
+
+    /**
+     * @brief Sends the \b iovcnt buffers described by \b iov as a single
+     * message, without copying them into a contiguous buffer if the transport
+     * supports it. The receiver can get it either with receive or with the
+     * scatter version of receive.
+     */
+    ssize_t send(const struct iovec* iov, int iovcnt) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::send EBADF (2)\n");
+            errno = EBADF; // the "communicator" is not valid or closed
+            return -1;
+        }
+        if (iovcnt <= 0 || !iov) {
+            errno = EINVAL;
+            return -1;
+        }
+        MTCL_TRACE("Handle::sendv", traceCategory(), iov_length(iov, iovcnt));
+        StatsTimer t;
+        ssize_t r = realHandle->sendv(iov, iovcnt);
+        realHandle->countSend(r, t.elapsed());
+        return r;
+    }
+
+    /**
+     * @brief Receives the next message into the \b iovcnt buffers described
+     * by \b iov, filled in order. The message must fit in the buffers
+     * (ENOMEM otherwise, as for receive).
+     * 
+     * @return the size of the message, \c 0 if the connection has been
+     * closed, \c -1 on error (errno is set).
+     */
+    ssize_t receive(const struct iovec* iov, int iovcnt) {
+        if (iovcnt <= 0 || !iov) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!realHandle) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::receive EBADF\n");
+            errno = EBADF;
+            return -1;
+        }
+        size_t sz;
+        if (!realHandle->probed.first) {
+			ssize_t r;
+			if ((r=this->probe(sz, true))<=0) {
+				return r;
+			}
+        } else {
+			newConnection = false;
+			if (!isReadable){
+				MTCL_PRINT(100, "[internal]:\t", "HandleUser::receive handle not readable\n");
+				return 0;
+			}
+			if (realHandle->closed_rd) return 0;
+        }
+        sz = realHandle->probed.second;
+        if (sz > iov_length(iov, iovcnt)) {
+			MTCL_ERROR("[internal]:\t", "HandleUser::receive ENOMEM, receiving less data\n");
+			errno=ENOMEM;
+			return -1;
+        }
+		realHandle->probed={false,0};
+		MTCL_TRACE("Handle::receivev", traceCategory(), sz);
+		StatsTimer t;
+		ssize_t r;
+		if (sz == iov_length(iov, iovcnt)) {
+			r = realHandle->receivev(iov, iovcnt);
+		} else {
+			std::vector<struct iovec> v;
+			iov_trim(v, iov, iovcnt, sz);
+			r = realHandle->receivev(v.data(), v.size());
+		}
+		realHandle->countRecv(r, t.elapsed());
+		return r;
+    }
+
+    /**
+     * @brief Sends \b len bytes of the file \b fd, starting at offset \b off,
+     * as a single message, without reading them into a user buffer. The
+     * file offset is not changed. The receiver can get the message either
+     * with receive or with receiveToFile. TCP handles use sendfile, the
+     * other transports send a mapping of the file.
+     *
+     * @return number of bytes sent or \c -1 if an error occurred (errno is
+     * set, EINVAL if the file is shorter than \b off + \b len)
+     */
+    ssize_t sendFile(int fd, off_t off, size_t len) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::sendFile EBADF\n");
+            errno = EBADF;
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) return -1;
+        if (len == 0 || off < 0 || (S_ISREG(st.st_mode) &&
+									 (len > (size_t)st.st_size || (size_t)off > (size_t)st.st_size - len))) {
+            errno = EINVAL;
+            return -1;
+        }
+        MTCL_TRACE("Handle::sendFile", traceCategory(), len);
+        StatsTimer t;
+        ssize_t r = realHandle->sendFile(fd, off, len);
+        realHandle->countSend(r, t.elapsed());
+        return r;
+    }
+
+    /**
+     * @brief Receives the next message into the file \b fd, written at its
+     * current offset that is moved forward. The message must not be larger
+     * than \b len bytes (ENOMEM otherwise, as for receive). TCP handles
+     * splice the data from the socket to the file.
+     *
+     * @return the size of the message, \c 0 if the connection has been
+     * closed, \c -1 on error (errno is set).
+     */
+    ssize_t receiveToFile(int fd, size_t len) {
+        if (!realHandle) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::receiveToFile EBADF\n");
+            errno = EBADF;
+            return -1;
+        }
+        size_t sz;
+        if (!realHandle->probed.first) {
+			ssize_t r;
+			if ((r=this->probe(sz, true))<=0) {
+				return r;
+			}
+        } else {
+			newConnection = false;
+			if (!isReadable){
+				MTCL_PRINT(100, "[internal]:\t", "HandleUser::receiveToFile handle not readable\n");
+				return 0;
+			}
+			if (realHandle->closed_rd) return 0;
+        }
+        sz = realHandle->probed.second;
+        if (sz > len) {
+			MTCL_ERROR("[internal]:\t", "HandleUser::receiveToFile ENOMEM, receiving less data\n");
+			errno=ENOMEM;
+			return -1;
+        }
+		realHandle->probed={false,0};
+		MTCL_TRACE("Handle::receiveToFile", traceCategory(), sz);
+		StatsTimer t;
+		ssize_t r = realHandle->receiveToFile(fd, sz);
+		realHandle->countRecv(r, t.elapsed());
+		return r;
+    }
+
+    /**
+     * @brief Non-blocking send, \b buff must not be modified until the
+     * returned request has completed.
+     */
+    Request isend(const void* buff, size_t size) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::isend EBADF\n");
+            return Request(-1, EBADF);
+        }
+        auto req = realHandle->isend(buff, size);
+        MTCL_STATS(req = std::make_shared<CommunicationHandle::CountedRequest>(realHandle, std::move(req), true);)
+        return Request(std::move(req));
+    }
+
+    /**
+     * @brief Non-blocking receive of the next message into \b buff, which
+     * must not be accessed until the returned request has completed. The
+     * result of the request is as for receive.
+     */
+    Request irecv(void* buff, size_t size) {
+        if (!realHandle) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::irecv EBADF\n");
+            return Request(-1, EBADF);
+        }
+		if (realHandle->probed.first) { // header already received by probe
+			ssize_t r = receive(buff, size);
+			return Request(r, r < 0 ? errno : 0);
+		}
+        newConnection = false;
+        if (!isReadable) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::irecv handle not readable\n");
+			return Request(0, 0);
+        }
+		if (realHandle->closed_rd) return Request(0, 0);
+        auto req = realHandle->irecv(buff, size);
+        MTCL_STATS(req = std::make_shared<CommunicationHandle::CountedRequest>(realHandle, std::move(req), false);)
+        return Request(std::move(req));
+    }
+
+    /**
+     * @brief Enables the coalescing of the sends of this handle (TCP and UCX
+     * only). The messages are copied with their headers into a buffer of
+     * \b size bytes, written with a single call when it is full, by flush,
+     * before a blocking probe or receive on this handle, or when its oldest
+     * message is older than \b deadline_us microseconds (\c -1 means no
+     * deadline). Messages that do not fit in the buffer are written at once
+     * together with the buffered ones. The wire format does not change, the
+     * receiver is not aware of it. \b size equal to 0 disables it.
+     *
+     * @return \c 0 on success, \c -1 otherwise (errno is set, ENOTSUP if
+     * the transport does not support it)
+     */
+    int setCoalescing(size_t size, long deadline_us=COALESCING_DEADLINE) {
+        if (!realHandle || realHandle->closed_wr) {
+            errno = EBADF;
+            return -1;
+        }
+        return realHandle->setCoalescing(size, deadline_us);
+    }
+
+    /**
+     * @brief Writes the coalesced sends of this handle not written yet.
+     *
+     * @return \c 0 on success, \c -1 otherwise (errno is set)
+     */
+    int flush() {
+        if (!realHandle || realHandle->closed_wr) return 0;
+        MTCL_TRACE("Handle::flush", traceCategory());
+        return realHandle->flush();
+    }
+
+    /**
+     * @brief Returns a buffer of \b size bytes, inside the shared segment
+     * of SHM handles, where the payload of the next message has to be
+     * built. The message is sent by commit, the same thread cannot send
+     * anything else on this handle until then. The maximum size depends on
+     * the transport (EMSGSIZE if larger).
+     *
+     * @return the buffer, \c nullptr otherwise (errno is set, ENOTSUP if the
+     * transport does not support it)
+     */
+    void* acquireSendBuffer(size_t size) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::acquireSendBuffer EBADF\n");
+            errno = EBADF;
+            return nullptr;
+        }
+        return realHandle->acquireSendBuffer(size);
+    }
+
+    /**
+     * @brief Sends the message built in the buffer returned by
+     * acquireSendBuffer.
+     *
+     * @return number of bytes sent or \c -1 if an error occurred (errno is set)
+     */
+    ssize_t commit() {
+        if (!realHandle) {
+            errno = EBADF;
+            return -1;
+        }
+        MTCL_TRACE("Handle::commit", traceCategory());
+        StatsTimer t;
+        ssize_t r = realHandle->commit();
+        realHandle->countSend(r, t.elapsed());
+        return r;
+    }
+
+    /**
+     * @brief Receives the next message without copying it, \b buff points
+     * to its payload inside the shared segment of SHM handles until release
+     * is called by the same thread. The messages that the transport cannot
+     * expose in place (EMSGSIZE) have to be received with receive.
+     *
+     * @return the size of the message, \c 0 if the connection has been
+     * closed, \c -1 on error (errno is set, ENOTSUP if the transport does not
+     * support it)
+     */
+    ssize_t receiveView(const void*& buff) {
+        if (!realHandle) {
+			MTCL_PRINT(100, "[internal]:\t", "HandleUser::receiveView EBADF\n");
+            errno = EBADF;
+            return -1;
+        }
+        newConnection = false;
+        if (!isReadable || realHandle->closed_rd) return 0;
+		MTCL_TRACE("Handle::receiveView", traceCategory());
+		StatsTimer t;
+		ssize_t r = realHandle->receiveView(buff);
+		if (r < 0) return r;
+		realHandle->probed={false,0};
+		if (r == 0) { // EOS received
+			isReadable=false;
+			realHandle->close(false, true);
+			return 0;
+		}
+		realHandle->countRecv(r, t.elapsed());
+		return r;
+    }
+
+    /**
+     * @brief Releases the message returned by receiveView, \b buff cannot be
+     * accessed anymore.
+     *
+     * @return \c 0 on success, \c -1 otherwise (errno is set)
+     */
+    int release() {
+        if (!realHandle) {
+            errno = EBADF;
+            return -1;
+        }
+        return realHandle->release();
     }
 
     ssize_t sendrecv(const void* sendbuff, size_t sendsize, void* recvbuff, size_t recvsize) {
 		realHandle->probed={false,0};
+        MTCL_TRACE("Handle::sendrecv", traceCategory(), sendsize);
         return realHandle->sendrecv(sendbuff, sendsize, recvbuff, recvsize);
     }
 
@@ -175,6 +503,16 @@ public:
 		return {realHandle->closed_rd, realHandle->closed_wr};
 	}
 
+    /**
+     * @brief Snapshot of the counters of the handle (all zeros if
+     * MTCL_DISABLE_STATS is defined).
+     */
+    HandleStats stats() {
+        HandleStats s;
+        MTCL_STATS(if (realHandle) s = realHandle->counters.snapshot();)
+        return s;
+    }
+
     HandleType getType() {
         if(realHandle)
             return realHandle->getType();
@@ -3,6 +3,8 @@
 
 #include <csignal>
 #include <cstdlib>
+#include <deque>
+#include <future>
 #include <map>
 #include <set>
 #include <vector>
@@ -14,8 +16,13 @@
 
 #include "handle.hpp"
 #include "handleUser.hpp"
+#include "mpmcQueue.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
 #include "protocolInterface.hpp"
 #include "protocols/tcp.hpp"
+#include "protocols/uds.hpp"
+#include "protocols/tcp_striped.hpp"
 #include "protocols/shm.hpp"
 
 #ifdef ENABLE_CONFIGFILE
@@ -42,17 +49,32 @@
 #include "protocols/ucx.hpp"
 #endif
 
+#ifdef ENABLE_URING
+#include "protocols/tcp_uring.hpp"
+#endif
+
 int  mtcl_verbose = -1;
 
+#if defined(__cpp_impl_coroutine) && !defined(SINGLE_IO_THREAD)
+class NextAwaiter;
+#endif
+
 /**
  * Main class for the library
 */
 class Manager {
     friend class ConnType;
     friend class CollectiveContext;
+#if defined(__cpp_impl_coroutine) && !defined(SINGLE_IO_THREAD)
+    friend class NextAwaiter;
+#endif
    
     inline static std::map<std::string, std::shared_ptr<ConnType>> protocolsMap;    
+#if defined(SINGLE_IO_THREAD)
 	inline static std::queue<HandleUser> handleReady;
+#else
+	inline static MPMCQueue<HandleUser> handleReady{READY_QUEUE_CAPACITY};
+#endif
     inline static std::map<std::string, std::vector<Handle*>> groupsReady;
     inline static std::map<CollectiveContext*, bool> contexts;
     inline static std::set<std::string> listening_endps;
@@ -67,21 +89,89 @@ class Manager {
 #endif
 
     REMOVE_CODE_IF(inline static std::thread t1);
-    inline static bool end;
+    inline static std::atomic<bool> end;
     inline static bool initialized = false;
 
-    inline static std::mutex mutex;
+    inline static ProgressPolicy progress;
+    inline static std::atomic<bool> shmUpgrade{false}; // see setShmUpgrade
+    inline static std::atomic<size_t> nevents{0}; // handles made ready, reset at each progress round
+    MTCL_STATS(inline static StatsCounter loop_iterations, ready_picked, ready_wait_ns;)
+    inline static int waitset = -1;  // epoll descriptor with the protocols' poll fds
+    inline static int wakefd  = -1;  // eventfd used to wake up the IO thread
+
+    inline static std::vector<Handle*> reactorReady; // handles with a MessageHandler to be served
+    REMOVE_CODE_IF(inline static std::mutex reactor_mutex);
+
+    // work submitted to the progress engine (see runOnIO)
+    inline static std::vector<std::function<bool()>> ioTasks;
+    REMOVE_CODE_IF(inline static std::mutex io_mutex);
+
+#if !defined(SINGLE_IO_THREAD)
+    // callbacks waiting for the next ready handle (see waitReady)
+    inline static std::deque<std::function<void(HandleUser&&)>> readyWaiters;
+    inline static std::atomic<size_t> nreadyWaiters{0};
+    inline static std::mutex waiters_mutex;
+#endif
+
+    // connection attempts still running after connectFirst returned
+    inline static std::vector<std::future<Handle*>> strayConnects;
+    inline static std::mutex connects_mutex;
+
     inline static std::mutex group_mutex;
     inline static std::mutex ctx_mutex;
-    inline static std::condition_variable condv;
     inline static std::condition_variable group_cond;
 
 private:
     Manager() {}
 
+	// flag of the handshake int: the connecting side offers shared-memory
+	// buffers, the token follows and the accepting side replies
+	static constexpr int HANDSHAKE_SHM_UPGRADE = 2;
+
+	// accepting side of the same-host upgrade (see setShmUpgrade), it
+	// replies even if the upgrade is disabled or not possible
+	static int acceptShmUpgrade(Handle* h) {
+		size_t size;
+		if (h->probe(size, true) <= 0 || size == 0 || size > 1024) {
+			MTCL_ERROR("[Manager]:\t", "addinQ handshake error in probe, shm token, errno=%d\n", errno);
+			return -1;
+		}
+		std::string token(size, '\0');
+		if (h->receive(token.data(), size) <= 0) {
+			MTCL_ERROR("[Manager]:\t", "addinQ handshake error in receiving the shm token, errno=%d\n", errno);
+			return -1;
+		}
+		HandleTCP* th = shmUpgrade ? dynamic_cast<HandleTCP*>(h) : nullptr;
+		int accepted = th && th->shmAccept(token) == 0;
+		if (h->send(&accepted, sizeof(int)) == -1) {
+			MTCL_ERROR("[Manager]:\t", "addinQ handshake error in sending the shm reply, errno=%d\n", errno);
+			if (th) th->shmCommit(false);
+			return -1;
+		}
+		if (th) th->shmCommit(accepted);
+		MTCL_PRINT(100, "[Manager]:\t", "addinQ shared-memory upgrade %s\n", accepted ? "accepted" : "refused");
+		return 0;
+	}
+
+	// connecting side, the handle is upgraded if the peer accepts
+	static int offerShmUpgrade(HandleTCP* th, const std::string& token) {
+		int accepted = 0;
+		size_t size;
+		if (th->send(token.c_str(), token.length()) == -1 ||
+			th->probe(size, true) <= 0 || size != sizeof(int) ||
+			th->receive(&accepted, sizeof(int)) <= 0) {
+			th->shmCommit(false);
+			return -1;
+		}
+		th->shmCommit(accepted);
+		MTCL_PRINT(100, "[Manager]:\t", "shared-memory upgrade %s\n", accepted ? "accepted" : "refused");
+		return 0;
+	}
+
 	// initial handshake for a connection, it could be a p2p connection or a connection
 	// part of a collective handle
 	static inline int connectionHandshake(char *& teamID, Handle *h) {
+		MTCL_TRACE("Manager::connectionHandshake", "manager");
 		// new connection, read handle type (p2p=0, collective=1)
 		size_t size;
 		if (h->probe(size, true) <=0) {
@@ -89,12 +179,24 @@ private:
 			teamID=nullptr;
 			return -1;
 		}
+		if (size == 0) { // closed before the handshake (e.g., a parallel connect that lost the race)
+			MTCL_PRINT(100, "[Manager]:\t", "addinQ connection closed before the handshake\n");
+			teamID=nullptr;
+			return -1;
+		}
 		int collective = 0;		
 		if (h->receive(&collective, sizeof(int)) <=0) {
 			MTCL_ERROR("[Manager]:\t", "addinQ handshake error in receiving collective flag, errno=%d\n", errno);
 			teamID=nullptr;
 			return -1;
 		}
+		if (collective & HANDSHAKE_SHM_UPGRADE) {
+			collective &= ~HANDSHAKE_SHM_UPGRADE;
+			if (acceptShmUpgrade(h) == -1) {
+				teamID=nullptr;
+				return -1;
+			}
+		}
         
 		// If collective, the handle sends further data with string teamID.
 		// The teamID uniquely associate a single context to all handles of the same collective
@@ -129,6 +231,8 @@ private:
 	
 #if defined(SINGLE_IO_THREAD)
 	static inline void addinQ(bool b, Handle* h) {
+		MTCL_TRACE("Manager::addinQ", "manager");
+		nevents.fetch_add(1, std::memory_order_relaxed);
         if(b) { // we have to see if it is part of a collective
 			char *teamID=nullptr;
 			if (connectionHandshake(teamID, h)==-1) return;
@@ -142,11 +246,61 @@ private:
                 return;
             }
         }
+		if (!b && h->handler) {
+			reactorReady.push_back(h);
+			return;
+		}
 		
-		handleReady.push(HandleUser(h, true, b));
+		pushReady(HandleUser(h, true, b));
+	}
+
+	static inline void pushReady(HandleUser&& h) {
+		MTCL_STATS(h.readySince = stats_clock();)
+		handleReady.push(std::move(h));
+	}
+
+	static inline HandleUser popReady() {
+		auto el = std::move(handleReady.front());
+		handleReady.pop();
+		picked(el);
+		return el;
 	}
 #else	
+	// hands the ready handle to a waiting callback, if any, otherwise it is
+	// enqueued for getNext
+	static inline void pushReady(HandleUser&& h) {
+		MTCL_STATS(h.readySince = stats_clock();)
+		handleReady.push(std::move(h));
+		if (nreadyWaiters.load() == 0) return;
+		std::unique_lock lk(waiters_mutex);
+		HandleUser el;
+		while(!readyWaiters.empty() && handleReady.try_pop(el)) {
+			picked(el);
+			auto cb = std::move(readyWaiters.front());
+			readyWaiters.pop_front();
+			--nreadyWaiters;
+			cb(std::move(el));
+		}
+	}
+
+	// Non-blocking version of getNext: if no handle is ready, \b cb is
+	// registered and called by the IO thread with the next ready handle.
+	// Returns true if \b h has been filled in immediately.
+	static bool waitReady(HandleUser& h, std::function<void(HandleUser&&)> cb) {
+		std::unique_lock lk(waiters_mutex);
+		++nreadyWaiters; // seq_cst, pairs with the fence in handleReady.push
+		if (handleReady.try_pop(h)) {
+			picked(h);
+			--nreadyWaiters;
+			return true;
+		}
+		readyWaiters.push_back(std::move(cb));
+		return false;
+	}
+
     static inline void addinQ(const bool b, Handle* h) {
+        MTCL_TRACE("Manager::addinQ", "manager");
+        nevents.fetch_add(1, std::memory_order_relaxed);
 
         if(b) { // For each new connection... is the handle coming from a collective?
 			char *teamID = nullptr;
@@ -163,12 +317,94 @@ private:
                 return;
             }
         }
+        if (!b && h->handler) {
+            // the handle is served by the IO thread after the protocols' update
+            {
+                std::unique_lock lk(reactor_mutex);
+                reactorReady.push_back(h);
+            }
+            if (std::this_thread::get_id() != t1.get_id()) wakeup();
+            return;
+        }
 
-        std::unique_lock lk(mutex);
-        handleReady.push(HandleUser(h, true, b));
-		condv.notify_one();
+        pushReady(HandleUser(h, true, b));
     }
 #endif
+
+	// accounts the time spent by \b h in the ready queue
+	static inline void picked(HandleUser& h) {
+		MTCL_STATS(
+		if (h.readySince) {
+			ready_picked.add(1);
+			ready_wait_ns.add(stats_clock() - h.readySince);
+			h.readySince = 0;
+		})
+	}
+
+	// Reads one message from each handle in reactor mode and invokes its
+	// handler. It is called by the progress engine outside the protocols'
+	// update, so that the handler can freely use the handle (send, close).
+	// Runs the tasks submitted with runOnIO, the ones not done are kept
+	// (after the ones submitted meanwhile) for the next round.
+	static void runIOTasks() {
+		std::vector<std::function<bool()>> tasks;
+		{
+			REMOVE_CODE_IF(std::unique_lock lk(io_mutex));
+			if (ioTasks.empty()) return;
+			tasks.swap(ioTasks);
+		}
+		std::vector<std::function<bool()>> notdone;
+		for(auto& t : tasks)
+			if (!t()) notdone.push_back(std::move(t));
+		tasks.clear(); // the captures are released by the progress engine
+		if (notdone.empty()) return;
+		REMOVE_CODE_IF(std::unique_lock lk(io_mutex));
+		for(auto& t : ioTasks) notdone.push_back(std::move(t));
+		ioTasks.swap(notdone);
+	}
+
+	static void dispatchReactor() {
+		std::vector<Handle*> ready;
+		{
+			REMOVE_CODE_IF(std::unique_lock lk(reactor_mutex));
+			if (reactorReady.empty()) return;
+			ready.swap(reactorReady);
+		}
+		thread_local std::vector<char> buffer;
+		for(Handle* h : ready) {
+			auto fn = h->handler;         // the handler may be changed by itself
+			HandleUser hu(h, false, false);
+			if (!fn) { // handler removed meanwhile, back to the ready queue
+				pushReady(HandleUser(h, true, false));
+				continue;
+			}
+			size_t sz = 0;
+			ssize_t r = h->probe(sz, true);
+			const bool would_block = r < 0 && (errno==EWOULDBLOCK || errno==EAGAIN);
+			h->countProbe(would_block, 0);
+			if (would_block) {
+				h->yield();
+				continue;
+			}
+			if (r > 0 && sz > 0) {
+				if (buffer.size() < sz) buffer.resize(sz);
+				r = h->receive(buffer.data(), sz);
+				h->countRecv(r, 0);
+			}
+			if (r <= 0 || sz == 0) {
+				if (r < 0 && errno != ECONNRESET)
+					MTCL_ERROR("[Manager]:\t", "dispatchReactor error on handle %s, errno=%d\n", h->getName().c_str(), errno);
+				// EOS or connection reset, the write side is left to the handler
+				h->close(r <= 0, true);
+				MTCL_TRACE("MessageHandler", "reactor", 0);
+				(*fn)(hu, nullptr, 0);
+				continue;
+			}
+			MTCL_TRACE("MessageHandler", "reactor", sz);
+			(*fn)(hu, buffer.data(), sz);
+			h->yield(); // no-op if the handler closed the handle
+		}
+	}
 	
     static bool poll(CollectiveContext* realHandle) {
 		if (realHandle->probed.first) { // previously probed
@@ -178,14 +414,97 @@ private:
         return realHandle->peek();
     }
 
+	static void createWaitset() {
+#if defined(__linux__)
+		if ((waitset = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			MTCL_PRINT(100, "[Manager]:\t", "createWaitset epoll_create1 errno=%d, polling\n", errno);
+			return;
+		}
+		if ((wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+			MTCL_PRINT(100, "[Manager]:\t", "createWaitset eventfd errno=%d, polling\n", errno);
+			close(waitset);
+			waitset = -1;
+			return;
+		}
+		struct epoll_event ev;
+		ev.events  = EPOLLIN;
+		ev.data.fd = wakefd;
+		epoll_ctl(waitset, EPOLL_CTL_ADD, wakefd, &ev);
+		for(auto& [prot, conn] : protocolsMap) {
+			int fd = conn->getPollFd();
+			if (fd == -1) {
+				MTCL_PRINT(100, "[Manager]:\t", "protocol %s does not provide a poll fd, it will be polled\n", prot.c_str());
+				continue;
+			}
+			ev.data.fd = fd;
+			if (epoll_ctl(waitset, EPOLL_CTL_ADD, fd, &ev) == -1)
+				MTCL_PRINT(100, "[Manager]:\t", "createWaitset epoll_ctl protocol %s errno=%d\n", prot.c_str(), errno);
+		}
+#endif
+	}
+
+	static void destroyWaitset() {
+		if (waitset != -1) { close(waitset); waitset = -1; }
+		if (wakefd  != -1) { close(wakefd);  wakefd  = -1; }
+	}
+
+	// wakes up the IO thread if it is blocked in waitEvents
+	static inline void wakeup() {
+#if defined(__linux__)
+		if (wakefd != -1) eventfd_write(wakefd, 1);
+#endif
+	}
+
+	// Blocks the caller until at least one protocol has something to do or
+	// the timeout expires. If some protocol (or collective context) can only
+	// be polled, the wait lasts at most the polling interval of the progress
+	// policy.
+	static inline void waitEvents(std::chrono::microseconds timeout) {
+		bool block = (waitset != -1);
+		for(auto& [prot, conn] : protocolsMap) {
+			if (!conn->arm()) block = false;
+		}
+		if (block) {
+			REMOVE_CODE_IF(std::unique_lock lk(ctx_mutex));
+			for(auto& [ctx, toManage] : contexts)
+				if (toManage) { block = false; break; }
+		}
+		if (block) {
+			// the tasks still there are polling something
+			REMOVE_CODE_IF(std::unique_lock lk(io_mutex));
+			if (!ioTasks.empty()) block = false;
+		}
+		long us = timeout.count();
+		const long poll_us = progress.pollInterval();
+		if (!block && (us < 0 || us > poll_us))
+			us = poll_us;
+#if defined(__linux__)
+		if (waitset != -1) {
+			struct epoll_event events[16];
+			int n = epoll_wait_us(waitset, events, 16, us);
+			for(int i=0; i<n; ++i)
+				if (events[i].data.fd == wakefd) {
+					eventfd_t v;
+					eventfd_read(wakefd, &v);
+				}
+			return;
+		}
+#endif
+		if (us > 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(us));
+	}
+
 	// IO thread function
     static void getReadyBackend() {
+        MTCL_TRACE_THREAD("IO thread");
         while(!end){
+            MTCL_STATS(loop_iterations.add(1);)
             for(auto& [prot, conn] : protocolsMap) {
+                MTCL_TRACE("ConnType::update", prot.c_str());
                 conn->update();
             }			
-			if constexpr (IO_THREAD_POLL_TIMEOUT)
-				std::this_thread::sleep_for(std::chrono::microseconds(IO_THREAD_POLL_TIMEOUT));
+            dispatchReactor();
+            runIOTasks();
 
             {
                 std::unique_lock lk(ctx_mutex);
@@ -194,15 +513,24 @@ private:
                         bool res = poll(ctx);
                         if(res) {
                             toManage = false;
-                            std::unique_lock readylk(mutex);
-                            handleReady.push(HandleUser(ctx, true, false));
-                            condv.notify_one();
+                            pushReady(HandleUser(ctx, true, false));
                         }
                     }
                 }
             }
+			if (!end) idle(std::chrono::microseconds(-1));
         }
     }
+
+	// what the progress engine does after a round, according to the policy
+	static inline void idle(std::chrono::microseconds timeout) {
+		bool active = nevents.exchange(0, std::memory_order_relaxed) > 0;
+		switch(progress.next(active)) {
+		case ProgressPolicy::SPIN:  cpu_relax(); break;
+		case ProgressPolicy::YIELD: std::this_thread::yield(); break;
+		case ProgressPolicy::BLOCK: waitEvents(timeout); break;
+		}
+	}
 #ifdef ENABLE_CONFIGFILE
     template <bool B, typename T>
     static std::vector<std::string> JSONArray2VectorString(const rapidjson::GenericArray<B, T>& arr){
@@ -259,10 +587,14 @@ private:
 
 
     static void releaseTeam(CollectiveContext* ctx) {
-        std::unique_lock lk(ctx_mutex);
-        auto it = contexts.find(ctx);
-        if (it != contexts.end())
-            it->second = true;
+        {
+            std::unique_lock lk(ctx_mutex);
+            auto it = contexts.find(ctx);
+            if (it != contexts.end())
+                it->second = true;
+        }
+        // the IO thread has to switch to polling for this context
+        wakeup();
     }
 
 
@@ -296,10 +628,17 @@ public:
 				}
 		}
 		
+		if (progress.setFromEnv() == -1)
+			MTCL_ERROR("[Manager]:\t", "invalid MTCL_PROGRESS value, it should be spin[:yield[:poll]] (microseconds)\n");
+		if (const char* up = std::getenv("MTCL_SHM_UPGRADE"))
+			shmUpgrade = std::string(up) == "1";
+
         Manager::appName = appName;
 
 		// default transports protocol
         registerType<ConnTcp>("TCP");
+        registerType<ConnUDS>("UDS");
+        registerType<ConnTcpStriped>("STCP");
 
 		registerType<ConnSHM>("SHM");
 
@@ -319,6 +658,10 @@ public:
         registerType<ConnUCX>("UCX");
 #endif
 
+#ifdef ENABLE_URING
+        registerType<ConnTcpUring>("URING");
+#endif
+
 #ifdef ENABLE_CONFIGFILE
         if (!configFile1.empty()) if (parseConfig(configFile1)<0) return -1;
         if (!configFile2.empty()) if (parseConfig(configFile2)<0) return -1;
@@ -341,6 +684,7 @@ public:
 				MTCL_PRINT(100, "[Manager]:\t", "ERROR initializing protocol %s\n", el.first.c_str());
 			}
         }
+        createWaitset();
 #ifdef ENABLE_CONFIGFILE
         // Automatically listen from endpoints listed in config file
         for(auto& le : std::get<2>(components[Manager::appName])){
@@ -364,8 +708,11 @@ public:
 	 * method of each registered protocols.
 	 */
     static void finalize(bool blockflag=false) {
+		reapConnects(true);
 		end = true;
+        wakeup();
         REMOVE_CODE_IF(t1.join());
+        runIOTasks(); // e.g., the handles released meanwhile
 
         //while(!handleReady.empty()) handleReady.pop();
 
@@ -379,7 +726,45 @@ public:
         for (auto [_,v]: protocolsMap) {
             v->end(blockflag);
         }
+        destroyWaitset();
+
+        if (MTCL_TRACE_DUMP(appName) == -1)
+            MTCL_ERROR("[Manager]:\t", "cannot write the trace file, errno=%d\n", errno);
+    }
+
+    /**
+     * \brief Set the adaptive polling policy of the progress engine.
+     * 
+     * After the last event the engine busy-polls for \b spin_us microseconds
+     * (forever if negative), then it yields the CPU for \b yield_us
+     * microseconds, then it blocks. Protocols without a poll fd are polled
+     * every \b poll_us microseconds. It overrides MTCL_PROGRESS and it can be
+     * called at any time.
+    */
+    static void setProgressPolicy(long spin_us, long yield_us, long poll_us=PROGRESS_POLL_TIME) {
+        progress.set(spin_us, yield_us, poll_us);
+        wakeup();
+    }
 
+    /**
+     * \brief Enables the same-host upgrade of TCP (and UDS) connections.
+     *
+     * With the upgrade enabled on both sides, a connection between two
+     * processes on the same host is moved to a pair of shared-memory
+     * buffers during the handshake of Manager::connect, the socket is used
+     * only for the EOS and to detect that the peer is gone. The handles are
+     * used as before. It affects the connections established afterwards,
+     * it can also be enabled with MTCL_SHM_UPGRADE=1.
+    */
+    static void setShmUpgrade(bool enable) {
+        shmUpgrade = enable;
+    }
+
+    /**
+     * \brief Current state of the progress engine (see ProgressPolicy).
+    */
+    static ProgressPolicy::State getProgressState() {
+        return progress.getState();
     }
 
     /**
@@ -389,58 +774,157 @@ public:
     */  
 #if defined(SINGLE_IO_THREAD)
     static inline HandleUser getNext(std::chrono::microseconds us=std::chrono::hours(87600)) {
-		if (!handleReady.empty()) {
-			auto el = std::move(handleReady.front());
-			handleReady.pop();
-			return el;
-		}
-		// if us is not multiple of the IO_THREAD_POLL_TIMEOUT we wait a bit less....
-		// if the poll timeout is 0, we just iterate us times
-		size_t niter = us.count(); // in case IO_THREAD_POLL_TIMEOUT is set to 0
-		if constexpr (IO_THREAD_POLL_TIMEOUT)
-			niter = us/std::chrono::milliseconds(IO_THREAD_POLL_TIMEOUT);
-		if (niter==0) niter++;
-		size_t i=0;
+		MTCL_TRACE("Manager::getNext", "manager");
+		if (!handleReady.empty()) return popReady();
+		const auto deadline = std::chrono::steady_clock::now() + us;
 		do { 
+			MTCL_STATS(loop_iterations.add(1);)
 			for(auto& [prot, conn] : protocolsMap) {
+				MTCL_TRACE("ConnType::update", prot.c_str());
 				conn->update();
 			}
+			dispatchReactor();
+			runIOTasks();
 
             for(auto& [ctx, toManage] : contexts) {
                 if(toManage) {
                     bool res = poll(ctx);
                     if(res) {
                         toManage = false;
-                        handleReady.push(HandleUser(ctx, true, false));
+                        pushReady(HandleUser(ctx, true, false));
                     }
                 }
             }
 
-			if (!handleReady.empty()) {
-				auto el = std::move(handleReady.front());
-				handleReady.pop();
-				return el;
-			}
-			if (i >= niter) break;
-			++i;
-			if constexpr (IO_THREAD_POLL_TIMEOUT)
-				std::this_thread::sleep_for(std::chrono::microseconds(IO_THREAD_POLL_TIMEOUT));	
+			if (!handleReady.empty()) return popReady();
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) break;
+			idle(std::chrono::duration_cast<std::chrono::microseconds>(deadline - now));
 		} while(true);
 		return HandleUser(nullptr, true, true);
     }	
+
+    /**
+     * \brief Get up to \b n handles ready to receive.
+     * 
+     * Waits at most \b us for the first ready handle, then appends to \b out
+     * all the handles already available (at most \b n) without blocking again.
+     * The container must provide push_back (e.g., std::vector<HandleUser>).
+     * 
+     * @return the number of handles appended to \b out, 0 on timeout
+    */
+    template<typename Container>
+    static inline size_t getNextBatch(Container& out, size_t n, std::chrono::microseconds us=std::chrono::hours(87600)) {
+		MTCL_TRACE("Manager::getNextBatch", "manager");
+		if (n == 0) return 0;
+		size_t count = 0;
+		if (handleReady.empty()) {
+			// runs the progress loop until something is ready
+			HandleUser el = getNext(us);
+			if (!el.isValid()) return 0;
+			out.push_back(std::move(el));
+			++count;
+		}
+		while(count < n && !handleReady.empty()) {
+			out.push_back(popReady());
+			++count;
+		}
+		return count;
+	}
 #else	
     static inline HandleUser getNext(std::chrono::microseconds us=std::chrono::hours(87600)) { 
-        std::unique_lock lk(mutex);
-        if (condv.wait_for(lk, us, [&]{return !handleReady.empty();})) {
-			auto el = std::move(handleReady.front());
-			handleReady.pop();
-			lk.unlock();
-			return el;
-		}
+        MTCL_TRACE("Manager::getNext", "manager");
+        HandleUser el;
+        if (handleReady.pop(el, us)) {
+            picked(el);
+            return el;
+        }
         return HandleUser(nullptr, true, true);
     }
+
+    /**
+     * \brief Get up to \b n handles ready to receive.
+     * 
+     * Waits at most \b us for the first ready handle, then appends to \b out
+     * all the handles already available (at most \b n) without blocking again.
+     * The container must provide push_back (e.g., std::vector<HandleUser>).
+     * 
+     * @return the number of handles appended to \b out, 0 on timeout
+    */
+    template<typename Container>
+    static inline size_t getNextBatch(Container& out, size_t n, std::chrono::microseconds us=std::chrono::hours(87600)) {
+        MTCL_TRACE("Manager::getNextBatch", "manager");
+        size_t k = handleReady.pop_bulk(out, n, us);
+        MTCL_STATS(for(auto it = std::prev(out.end(), k); it != out.end(); ++it) picked(*it);)
+        return k;
+    }
 #endif
-	
+
+    /**
+     * \brief Snapshot of the performance counters of the Manager and of the
+     * protocols (the sum over all their handles, see also HandleUser::stats).
+     * 
+     * The counters are updated with relaxed atomic operations, thus the
+     * snapshot is not taken atomically. All values are zero if the library
+     * is compiled with MTCL_DISABLE_STATS.
+    */
+    static ManagerStats stats() {
+        ManagerStats s;
+        MTCL_STATS(
+        s.ready_depth     = handleReady.size();
+        s.ready_picked    = ready_picked.get();
+        s.ready_wait_ns   = ready_wait_ns.get();
+        s.loop_iterations = loop_iterations.get();
+        for(auto& [prot, conn] : protocolsMap)
+            s.protocols[prot] = conn->counters.snapshot();
+        )
+        return s;
+    }
+
+    /**
+     * \brief Switch the handle \b h to reactor mode.
+     * 
+     * Each message received on \b h is read by the progress engine (the IO
+     * thread, or the thread calling getNext if SINGLE_IO_THREAD is defined)
+     * and passed to \b fn, without going through getNext. The buffer passed
+     * to \b fn is valid only during the call. When the peer closes the
+     * connection \b fn is called with size 0 and it should close the handle.
+     * Passing an empty \b fn switches \b h back to getNext.
+     * 
+     * It must be called when the caller owns \b h (e.g., just after getNext
+     * or connect, before yielding it) or from within the handler itself.
+     * Only point-to-point handles are supported.
+     * 
+     * @return 0 on success, -1 with errno set to EINVAL otherwise
+    */
+    static int onMessage(HandleUser& h, MessageHandler fn) {
+        if (!h.isValid() || h.getType() != P2P) {
+            errno = EINVAL;
+            return -1;
+        }
+        Handle* handle = static_cast<Handle*>(h.realHandle);
+        if (fn) handle->handler = std::make_shared<MessageHandler>(std::move(fn));
+        else handle->handler.reset();
+        return 0;
+    }
+
+    /**
+     * \brief Run \b fn on the progress engine (the IO thread, or the thread
+     * calling getNext if SINGLE_IO_THREAD is defined).
+     *
+     * \b fn is called at each progress round until it returns true, the
+     * engine does not block while it is pending. The tasks are run in order,
+     * e.g., to hand over to the IO thread the handles it reads in reactor mode.
+     * It can be called by any thread, \b fn itself included.
+    */
+    static void runOnIO(std::function<bool()> fn) {
+        {
+            REMOVE_CODE_IF(std::unique_lock lk(io_mutex));
+            ioTasks.push_back(std::move(fn));
+        }
+        REMOVE_CODE_IF(if (std::this_thread::get_id() != t1.get_id()) wakeup());
+    }
+
     /**
      * \brief Create an instance of the protocol implementation.
      * 
@@ -484,6 +968,82 @@ public:
     }
 
 
+	// Happy eyeballs over the candidate endpoints ("PROTOCOL:address"): the
+	// i-th attempt starts CONNECT_ATTEMPT_DELAY*i ms after the first one,
+	// unless a previous one has already succeeded. The first handle connected
+	// is returned, the attempts still running are collected by reapConnects.
+	// If SINGLE_IO_THREAD is defined the protocols are not thread safe, the
+	// candidates are tried one at a time.
+	static Handle* connectFirst(const std::vector<std::string>& endpoints, int retry, unsigned timeout) {
+		std::vector<std::pair<std::shared_ptr<ConnType>, std::string>> cands;
+		for(auto& le : endpoints) {
+			std::string protocol = le.substr(0, le.find(":"));
+			if (protocolsMap.count(protocol))
+				cands.emplace_back(protocolsMap[protocol], le.substr(le.find(":") + 1, le.length()));
+		}
+		if (cands.empty()) return nullptr;
+		if (cands.size() == 1) return cands[0].first->connect(cands[0].second, retry, timeout);
+#if defined(SINGLE_IO_THREAD)
+		for(auto& [conn, addr] : cands)
+			if (Handle* h = conn->connect(addr, retry, timeout)) return h;
+		return nullptr;
+#endif
+
+		reapConnects(false);
+		struct state_t {
+			std::mutex mtx;
+			std::condition_variable cv;
+			Handle* winner  = nullptr;
+			size_t  nfailed = 0;
+		};
+		auto st = std::make_shared<state_t>();
+		std::vector<std::future<Handle*>> attempts;
+		for(size_t i=0; i<cands.size(); ++i) {
+			attempts.push_back(std::async(std::launch::async, [st, i, retry, timeout, c=cands[i]]() -> Handle* {
+				{
+					std::unique_lock lk(st->mtx);
+					if (st->cv.wait_for(lk, std::chrono::milliseconds(CONNECT_ATTEMPT_DELAY*i),
+										[&]{ return st->winner != nullptr; })) {
+						++st->nfailed;
+						st->cv.notify_all();
+						return nullptr;
+					}
+				}
+				Handle* h = c.first->connect(c.second, retry, timeout);
+				std::unique_lock lk(st->mtx);
+				if (h && !st->winner) {
+					st->winner = h;
+					h = nullptr;
+				} else ++st->nfailed;
+				st->cv.notify_all();
+				return h; // a late winner, it has to be closed
+			}));
+		}
+		Handle* winner;
+		{
+			std::unique_lock lk(st->mtx);
+			st->cv.wait(lk, [&]{ return st->winner || st->nfailed == cands.size(); });
+			winner = st->winner;
+		}
+		std::unique_lock lk(connects_mutex);
+		for(auto& f : attempts) strayConnects.push_back(std::move(f));
+		return winner;
+	}
+
+	// closes the handles connected by the attempts that lost the race
+	static void reapConnects(bool blocking) {
+		std::unique_lock lk(connects_mutex);
+		for(auto it = strayConnects.begin(); it != strayConnects.end();) {
+			if (!blocking && it->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				++it;
+				continue;
+			}
+			Handle* h = it->get();
+			if (h) h->close(true, true);
+			it = strayConnects.erase(it);
+		}
+	}
+
     static Handle* connectHandle(std::string s, int retry, unsigned timeout) {
         size_t pos;
         std::string protocol = s.substr(0, (pos = s.find(":")) == std::string::npos ? 0 : pos);
@@ -491,15 +1051,10 @@ public:
         if(protocol.empty()){
             // checking if there is a config file to cycle on all addresses
 #ifdef ENABLE_CONFIGFILE
-            if (components.count(s))
-                for(auto& le : std::get<2>(components[s])){
-                    std::string sWoProtocol = le.substr(le.find(":") + 1, le.length());
-                    std::string remote_protocol = le.substr(0, le.find(":"));
-                    if (protocolsMap.count(remote_protocol)){
-                        auto* h = protocolsMap[remote_protocol]->connect(sWoProtocol, retry, timeout);
-                        if (h) return h;
-                    }
-                }
+            if (components.count(s)) {
+                auto* h = connectFirst(std::get<2>(components[s]), retry, timeout);
+                if (h) return h;
+            }
 #endif
             MTCL_ERROR("[internal]:\t", "Manager::connectHandle specified appName (%s) not found in configuration file.\n", s.c_str());
             return nullptr;
@@ -555,13 +1110,12 @@ public:
                         return nullptr;
                     } else {
                         // connessione diretta
+                        std::vector<std::string> endpoints;
                         for (auto& le : std::get<2>(component))
-                            if (le.find(protocol) != std::string::npos){
-                                auto* handle = protocolsMap[protocol]->connect(le.substr(le.find(":") + 1, le.length()), retry, timeout);
-                                if (handle) return handle;
-                            }
+                            if (le.find(protocol) != std::string::npos)
+                                endpoints.push_back(protocol + le.substr(le.find(":"), le.length()));
                         
-                        return nullptr;
+                        return connectFirst(endpoints, retry, timeout);
                     } 
                 
   
@@ -784,17 +1338,55 @@ public:
 
         // if handle is connected, we perform the handshake
         if(handle) {
-            int collective = 0; // no nbh conversion
+            // a peer on the same host is offered shared-memory buffers
+            HandleTCP* th = shmUpgrade ? dynamic_cast<HandleTCP*>(handle) : nullptr;
+            std::string token = th ? th->shmOffer() : "";
+            int collective = token.empty() ? 0 : HANDSHAKE_SHM_UPGRADE; // no nbh conversion
             if (handle->send(&collective, sizeof(int))==-1) {
                 MTCL_ERROR("[Manager]:\t", "handshake error, errno=%d (%s)\n",
 						   errno, strerror(errno));
+                if (th) th->shmCommit(false);
+                handle->close(true, true);
                 return HandleUser();				
 			}
+            if (!token.empty() && offerShmUpgrade(th, token) == -1) {
+                MTCL_ERROR("[Manager]:\t", "handshake error in the shared-memory upgrade, errno=%d (%s)\n",
+						   errno, strerror(errno));
+                handle->close(true, true);
+                return HandleUser();
+            }
         }
 		
         return HandleUser(handle, true, true);
     };
 
+#if defined(__cpp_impl_coroutine) && !defined(SINGLE_IO_THREAD)
+    /**
+     * \brief Awaitable version of getNext, to be used within a Task
+     * (see async.hpp). The coroutine is resumed on its executor as soon as
+     * the IO thread has a ready handle.
+    */
+    static NextAwaiter next();
+#endif
+
+    /**
+     * \brief Connect to a peer without blocking the caller.
+     * 
+     * The connection (see connect) is performed by a separate thread. Within
+     * a Task the returned future can be directly awaited (see async.hpp).
+     * If SINGLE_IO_THREAD is defined the protocols must be used by one thread
+     * only, the connection is performed when the future is waited for.
+     * 
+     * @return a future holding the connected handle, or an invalid handle on failure
+    */
+    static std::future<HandleUser> connectAsync(std::string s, int nretry=-1, unsigned timeout=0) {
+#if defined(SINGLE_IO_THREAD)
+        return std::async(std::launch::deferred, [=]() { return Manager::connect(s, nretry, timeout); });
+#else
+        return std::async(std::launch::async, [=]() { return Manager::connect(s, nretry, timeout); });
+#endif
+    }
+
     /**
      * \brief Given an handle return the name of the protocol instance given in phase of registration.
      * 
@@ -818,4 +1410,8 @@ void CollectiveContext::yield() {
     }
 }
 
+#if defined(__cpp_impl_coroutine) && !defined(SINGLE_IO_THREAD)
+#include "async.hpp"
+#endif
+
 #endif
@@ -0,0 +1,247 @@
+#ifndef MPMCQUEUE_HPP
+#define MPMCQUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "config.hpp"
+#include "utils.hpp"
+
+/**
+ * @brief Bounded lock-free multi-producer/multi-consumer queue (D. Vyukov's
+ * algorithm). Each slot carries a sequence number telling producers and
+ * consumers whether it can be written or read, so that the only shared
+ * writes are the CAS on the head and tail indices.
+ *
+ * Consumers finding the queue empty spin for a while and then park on a
+ * futex. Producers issue the wake-up syscall only if somebody is parked.
+ *
+ * push never waits: the IO thread may be a producer while it holds a
+ * protocol lock that the consumers need. When the ring is full the
+ * elements go to a spill list under a mutex, and producers keep using it
+ * until the consumers have drained it, so the order is kept.
+ *
+ * @tparam T type of the elements, it must be default constructible and
+ * movable
+ */
+template<typename T>
+class MPMCQueue {
+    struct cell_t {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::vector<cell_t> buffer;
+    const size_t mask;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t>   tail{0};    // producers
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t>   head{0};    // consumers
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> waiters{0}; // parked consumers
+    std::atomic<uint32_t> futexword{0};                        // bumped at each wake-up
+
+    std::mutex spillmtx;
+    std::deque<T> spill;
+    std::atomic<size_t> nspilled{0};
+
+    static size_t roundup(size_t n) {
+        size_t sz = 2;
+        while(sz < n) sz <<= 1;
+        return sz;
+    }
+
+    // the spill list is emptied once the ring has been drained
+    bool try_unspill(T& v) {
+        if (nspilled.load(std::memory_order_acquire) == 0) return false;
+        std::unique_lock lk(spillmtx);
+        if (spill.empty()) return false;
+        v = std::move(spill.front());
+        spill.pop_front();
+        nspilled.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    void notify() {
+        // pairs with the fence in pop: either we see the waiter or it sees the element
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            futexword.fetch_add(1, std::memory_order_release);
+            futex_wake(&futexword, 1);
+        }
+    }
+
+public:
+    MPMCQueue(size_t capacity) : buffer(roundup(capacity)), mask(buffer.size()-1) {
+        for(size_t i=0; i<buffer.size(); ++i)
+            buffer[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+    /**
+     * @brief Non-blocking insertion.
+     *
+     * @return \c false if the queue is full, \b v is left untouched
+     */
+    bool try_push(T&& v) {
+        cell_t* cell;
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for(;;) {
+            cell = &buffer[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(v);
+        cell->seq.store(pos+1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Non-blocking extraction.
+     *
+     * @return \c false if the queue is empty
+     */
+    bool try_pop(T& v) {
+        cell_t* cell;
+        size_t pos = head.load(std::memory_order_relaxed);
+        for(;;) {
+            cell = &buffer[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+            if (dif == 0) {
+                if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return try_unspill(v);
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        v = std::move(cell->data);
+        cell->seq.store(pos+mask+1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Non-blocking extraction of up to \b n elements with a single CAS
+     * on the head index. Elements are appended to \b out.
+     *
+     * @return the number of extracted elements
+     */
+    template<typename Container>
+    size_t try_pop_bulk(Container& out, size_t n) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        size_t k;
+        for(;;) {
+            // counts how many consecutive cells have already been published
+            for(k=0; k<n; ++k) {
+                size_t seq = buffer[(pos+k) & mask].seq.load(std::memory_order_acquire);
+                if ((intptr_t)seq - (intptr_t)(pos+k+1) != 0) break;
+            }
+            if (k == 0) {
+                size_t seq = buffer[pos & mask].seq.load(std::memory_order_acquire);
+                if ((intptr_t)seq - (intptr_t)(pos+1) < 0) {
+                    T v;
+                    if (!try_unspill(v)) return 0;
+                    out.push_back(std::move(v));
+                    return 1;
+                }
+                pos = head.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (head.compare_exchange_weak(pos, pos+k, std::memory_order_relaxed))
+                break;
+        }
+        for(size_t i=0; i<k; ++i) {
+            cell_t* cell = &buffer[(pos+i) & mask];
+            out.push_back(std::move(cell->data));
+            cell->seq.store(pos+i+mask+1, std::memory_order_release);
+        }
+        return k;
+    }
+
+    /**
+     * @brief Inserts \b v waking up one parked consumer, if any. If the ring
+     * is full \b v goes to the spill list.
+     */
+    void push(T&& v) {
+        if (nspilled.load(std::memory_order_acquire) > 0 || !try_push(std::move(v))) {
+            std::unique_lock lk(spillmtx);
+            spill.push_back(std::move(v));
+            nspilled.fetch_add(1, std::memory_order_release);
+        }
+        notify();
+    }
+
+    /**
+     * @brief Extracts one element waiting at most \b timeout for it.
+     *
+     * @return \c true if \b v has been written, \c false on timeout
+     */
+    bool pop(T& v, std::chrono::microseconds timeout) {
+        if (try_pop(v)) return true;
+        for(unsigned i=0; i<READY_QUEUE_SPIN; ++i) {
+            cpu_relax();
+            if (try_pop(v)) return true;
+        }
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        for(;;) {
+            waiters.fetch_add(1, std::memory_order_relaxed);
+            const uint32_t key = futexword.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (try_pop(v)) {
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            futex_wait(&futexword, key,
+                       std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count());
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+            if (try_pop(v)) return true;
+        }
+    }
+
+    /**
+     * @brief Waits at most \b timeout for at least one element, then extracts
+     * all the available ones up to \b n.
+     *
+     * @return the number of elements appended to \b out, \c 0 on timeout
+     */
+    template<typename Container>
+    size_t pop_bulk(Container& out, size_t n, std::chrono::microseconds timeout) {
+        if (n == 0) return 0;
+        size_t k = try_pop_bulk(out, n);
+        if (k) return k;
+        T v;
+        if (!pop(v, timeout)) return 0;
+        out.push_back(std::move(v));
+        return 1 + try_pop_bulk(out, n-1);
+    }
+
+    // approximated number of elements in the queue
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_relaxed);
+        return (t > h ? t - h : 0) + nspilled.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const { return size() == 0; }
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef PROGRESS_HPP
+#define PROGRESS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "config.hpp"
+#include "utils.hpp"
+
+/**
+ * @brief Adaptive polling policy of the progress engine (the IO thread, or
+ * the thread calling getNext if SINGLE_IO_THREAD is defined).
+ *
+ * While events keep coming the engine busy-polls the protocols (SPIN). When
+ * nothing happened for more than \b spin microseconds it yields the CPU
+ * between two rounds (YIELD), and after further \b yield microseconds it
+ * blocks waiting for events (BLOCK). Protocols without a poll fd are polled
+ * every \b poll microseconds in the BLOCK state.
+ *
+ * The defaults are in config.hpp, they can be changed at run time with
+ * Manager::setProgressPolicy or with the environment variable
+ * MTCL_PROGRESS="spin[:yield[:poll]]" (microseconds). A negative spin time
+ * means busy-polling forever (lowest latency, one core always busy).
+ */
+class ProgressPolicy {
+public:
+    enum State { SPIN, YIELD, BLOCK };
+
+private:
+    std::atomic<long> spin_us {PROGRESS_SPIN_TIME};
+    std::atomic<long> yield_us{PROGRESS_YIELD_TIME};
+    std::atomic<long> poll_us {PROGRESS_POLL_TIME};
+    std::atomic<State> state{BLOCK};
+    std::chrono::steady_clock::time_point last;   // last round with events
+
+public:
+    static const char* toString(State s) {
+        switch(s) {
+        case SPIN:  return "spin";
+        case YIELD: return "yield";
+        case BLOCK: return "block";
+        }
+        return "unknown";
+    }
+
+    void set(long spin, long yield, long poll) {
+        spin_us  = spin;
+        yield_us = yield < 0 ? 0 : yield;
+        poll_us  = poll  < 0 ? 0 : poll;
+    }
+
+    /**
+     * @brief Reads the MTCL_PROGRESS environment variable, if set.
+     *
+     * @return \c -1 if the variable is malformed, \c 0 otherwise
+     */
+    int setFromEnv() {
+        const char* env = std::getenv("MTCL_PROGRESS");
+        if (!env) return 0;
+        long v[3] = {spin_us, yield_us, poll_us};
+        std::string s(env);
+        try {
+            for(int i=0; i<3 && !s.empty(); ++i) {
+                size_t pos = s.find(':');
+                v[i] = std::stol(s.substr(0, pos));
+                s = (pos == std::string::npos) ? "" : s.substr(pos+1);
+            }
+        } catch(...) {
+            return -1;
+        }
+        set(v[0], v[1], v[2]);
+        return 0;
+    }
+
+    long pollInterval() const { return poll_us.load(std::memory_order_relaxed); }
+
+    State getState() const { return state.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Called by the progress engine after each round, \b active tells
+     * whether something has been done in the round.
+     *
+     * @return what the engine has to do before the next round
+     */
+    State next(bool active) {
+        auto now = std::chrono::steady_clock::now();
+        if (active) last = now;
+        const long spin = spin_us.load(std::memory_order_relaxed);
+        State s = BLOCK;
+        if (spin < 0) s = SPIN;
+        else {
+            long idle = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+            if (idle < spin) s = SPIN;
+            else if (idle < spin + yield_us.load(std::memory_order_relaxed)) s = YIELD;
+        }
+        if (s != state.load(std::memory_order_relaxed)) {
+            MTCL_PRINT(200, "[Progress]:\t", "%s -> %s\n", toString(state.load()), toString(s));
+            state.store(s, std::memory_order_relaxed);
+        }
+        return s;
+    }
+};
+
+#endif
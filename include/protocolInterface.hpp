@@ -6,6 +6,8 @@
 #include <functional>
 #include <errno.h>
 
+#include "stats.hpp"
+
 class Handle;
 class ConnType {
 
@@ -16,6 +18,8 @@ protected:
 
     std::function<void(bool, Handle*)> addinQ;
 
+    MTCL_STATS(HandleCounters counters;) // sum of the counters of its handles
+
     static void setAsClosed(Handle* h, bool blockflag);
 
 public:
@@ -56,8 +60,32 @@ public:
      * Must return control to the Manager after the polling phase is completed.
      * 
      */
-    virtual void update() = 0; 
-    
+    virtual void update() = 0;
+
+
+    /**
+     * @brief Returns a file descriptor that becomes readable (EPOLLIN) when
+     * there is something to be done in the update method. The IO thread blocks
+     * on it instead of sleeping between two update calls.
+     * Protocols that cannot provide such a descriptor return \c -1 and are
+     * polled.
+     *
+     * @return the pollable file descriptor or \c -1
+     */
+    virtual int getPollFd() { return -1; }
+
+
+    /**
+     * @brief Called by the IO thread after the update and before blocking on the
+     * descriptor returned by getPollFd.
+     *
+     * @return \c true if the IO thread can block waiting for the descriptor to
+     * become readable, \c false if the update method has to be called again
+     * without blocking (e.g., there are pending events or the protocol must be
+     * polled).
+     */
+    virtual bool arm() { return getPollFd() != -1; }
+
 
     /**
      * @brief Manage the notification of an Handle object \b h issuing a yield operation.
@@ -0,0 +1,66 @@
+#ifndef COALESCING_HPP
+#define COALESCING_HPP
+
+#include <endian.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <chrono>
+#include <vector>
+
+#include "../utils.hpp"
+
+/*
+ * Send-side coalescing buffer of the stream transports (TCP, UCX), see
+ * HandleUser::setCoalescing. The messages are appended with their size
+ * header, thus the content of the buffer is exactly what the transport would
+ * have written message by message. Bytes in [head, tail) are not written yet.
+ * It is not thread safe, the handle protects it.
+ */
+class SendCoalescer {
+	using clock = std::chrono::steady_clock;
+
+	std::vector<char> buf;
+	size_t head = 0, tail = 0;
+	long deadline_us = -1;
+	clock::time_point oldest;  // when the first byte not written was appended
+
+public:
+	// a size of 0 disables the coalescing, the buffer must be empty
+	void set(size_t size, long deadline) {
+		buf.resize(size);
+		buf.shrink_to_fit();
+		head = tail = 0;
+		deadline_us = deadline;
+	}
+
+	bool enabled() const { return !buf.empty(); }
+	bool timed() const { return deadline_us >= 0; }
+	size_t pending() const { return tail - head; }
+	const char* data() const { return buf.data() + head; }
+
+	// n bytes have been written
+	void consumed(size_t n) {
+		head += n;
+		if (head == tail) head = tail = 0;
+	}
+	void clear() { head = tail = 0; }
+
+	// appends the message if it fits in the free space of the buffer
+	bool append(const struct iovec* iov, int iovcnt, size_t size) {
+		if (sizeof(size_t) + size > buf.size() - tail) return false;
+		if (tail == 0) oldest = clock::now();
+		size_t sz = htobe64(size);
+		memcpy(buf.data() + tail, &sz, sizeof(size_t));
+		iov_gather(buf.data() + tail + sizeof(size_t), iov, iovcnt);
+		tail += sizeof(size_t) + size;
+		return true;
+	}
+
+	// true if there are bytes older than the deadline
+	bool expired(clock::time_point now) const {
+		return pending() > 0 && timed() &&
+			now - oldest >= std::chrono::microseconds(deadline_us);
+	}
+};
+
+#endif
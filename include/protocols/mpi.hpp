@@ -18,6 +18,101 @@
 
 
 class HandleMPI : public Handle {
+
+	class SendRequest : public RequestImpl {
+		size_t sz;
+		MPI_Request reqs[2];
+		bool done = false;
+	public:
+		SendRequest(HandleMPI* h, const void* buff, size_t size) : sz(size) {
+			result = size;
+			if (MPI_Isend(&sz, 1, MPI_UNSIGNED_LONG, h->rank, h->tag, MPI_COMM_WORLD, &reqs[0]) != MPI_SUCCESS ||
+				MPI_Isend(buff, size, MPI_BYTE, h->rank, h->tag, MPI_COMM_WORLD, &reqs[1]) != MPI_SUCCESS) {
+				MTCL_MPI_PRINT(100, "HandleMPI::isend MPI_Isend ERROR\n");
+				result = -1; err = ECOMM; done = true;
+			}
+		}
+		bool test() {
+			if (done) return true;
+			int flag = 0;
+			if (MPI_Testall(2, reqs, &flag, MPI_STATUSES_IGNORE) != MPI_SUCCESS) {
+				result = -1; err = ECOMM; flag = 1;
+			}
+			return done = flag;
+		}
+		void wait() {
+			if (done) return;
+			if (MPI_Waitall(2, reqs, MPI_STATUSES_IGNORE) != MPI_SUCCESS) {
+				result = -1; err = ECOMM;
+			}
+			done = true;
+		}
+	};
+
+	// the header is received first, then the payload
+	class RecvRequest : public RequestImpl {
+		HandleMPI* h;
+		void*  buff;
+		size_t size;
+		size_t sz;
+		MPI_Request req;
+		bool header = true;
+		bool done = false;
+
+		bool complete(ssize_t r, int e=0) {
+			result = r; err = e; done = true;
+			return true;
+		}
+		// called when the current receive has completed
+		bool next(MPI_Status& status) {
+			if (!header) {
+				int count;
+				MPI_Get_count(&status, MPI_BYTE, &count);
+				return complete(count);
+			}
+			if (sz == 0) { // EOS received
+				h->close(false, true);
+				return complete(0);
+			}
+			if (sz > size) { // the message can be received later with a larger buffer
+				h->probed = {true, sz};
+				return complete(-1, ENOMEM);
+			}
+			header = false;
+			if (MPI_Irecv(buff, sz, MPI_BYTE, h->rank, h->tag, MPI_COMM_WORLD, &req) != MPI_SUCCESS) {
+				MTCL_MPI_PRINT(100, "HandleMPI::irecv MPI_Irecv Payload ERROR\n");
+				return complete(-1, ECOMM);
+			}
+			return false;
+		}
+	public:
+		RecvRequest(HandleMPI* h, void* buff, size_t size) : h(h), buff(buff), size(size) {
+			if (MPI_Irecv(&sz, 1, MPI_UNSIGNED_LONG, h->rank, h->tag, MPI_COMM_WORLD, &req) != MPI_SUCCESS) {
+				MTCL_MPI_PRINT(100, "HandleMPI::irecv MPI_Irecv Header ERROR\n");
+				complete(-1, ECOMM);
+			}
+		}
+		bool test() {
+			while(!done) {
+				int flag = 0;
+				MPI_Status status;
+				if (MPI_Test(&req, &flag, &status) != MPI_SUCCESS) return complete(-1, ECOMM);
+				if (!flag) return false;
+				next(status);
+			}
+			return true;
+		}
+		void wait() {
+			while(!done) {
+				MPI_Status status;
+				if (MPI_Wait(&req, &status) != MPI_SUCCESS) {
+					complete(-1, ECOMM);
+					return;
+				}
+				next(status);
+			}
+		}
+	};
 	
 public:
     bool closing = false;
@@ -48,6 +143,14 @@ public:
         return size;
     }*/
 
+    std::shared_ptr<RequestImpl> isend(const void* buff, size_t size) {
+        return std::make_shared<SendRequest>(this, buff, size);
+    }
+
+    std::shared_ptr<RequestImpl> irecv(void* buff, size_t size) {
+        return std::make_shared<RecvRequest>(this, buff, size);
+    }
+
     ssize_t send(const void* buff, size_t size) {
         if (MPI_Send(&size, 1, MPI_UNSIGNED_LONG, this->rank, this->tag, MPI_COMM_WORLD) != MPI_SUCCESS){
             MTCL_MPI_PRINT(100, "HandleMPI::send MPI_Send Header ERROR\n");
@@ -63,6 +166,64 @@ public:
         return size;
     }
 
+    // describes the buffers with an MPI datatype relative to MPI_BOTTOM,
+    // false if they cannot be described (lengths not fitting in an int)
+    static bool iovType(const struct iovec* iov, int iovcnt, MPI_Datatype* type) {
+        std::vector<int> lens(iovcnt);
+        std::vector<MPI_Aint> displs(iovcnt);
+        for(int i=0; i<iovcnt; ++i) {
+            if (iov[i].iov_len > INT_MAX) return false;
+            lens[i] = iov[i].iov_len;
+            MPI_Get_address(iov[i].iov_base, &displs[i]);
+        }
+        if (MPI_Type_create_hindexed(iovcnt, lens.data(), displs.data(), MPI_BYTE, type) != MPI_SUCCESS)
+            return false;
+        if (MPI_Type_commit(type) != MPI_SUCCESS) {
+            MPI_Type_free(type);
+            return false;
+        }
+        return true;
+    }
+
+    // the payload is sent with an hindexed datatype, or packed if it cannot
+    // be described with a datatype
+    ssize_t sendv(const struct iovec* iov, int iovcnt) {
+        MPI_Datatype type;
+        if (iovcnt == 1 || !iovType(iov, iovcnt, &type))
+            return Handle::sendv(iov, iovcnt);
+
+        size_t size = iov_length(iov, iovcnt);
+        if (MPI_Send(&size, 1, MPI_UNSIGNED_LONG, this->rank, this->tag, MPI_COMM_WORLD) != MPI_SUCCESS){
+            MTCL_MPI_PRINT(100, "HandleMPI::sendv MPI_Send Header ERROR\n");
+            MPI_Type_free(&type);
+            errno = ECOMM;
+            return -1;
+        }
+        int r = MPI_Send(MPI_BOTTOM, 1, type, this->rank, this->tag, MPI_COMM_WORLD);
+        MPI_Type_free(&type);
+        if (r != MPI_SUCCESS) {
+            MTCL_MPI_PRINT(100, "HandleMPI::sendv MPI_Send Payload ERROR\n");
+            errno = ECOMM;
+            return -1;
+        }
+        return size;
+    }
+
+    ssize_t receivev(const struct iovec* iov, int iovcnt) {
+        MPI_Datatype type;
+        if (iovcnt == 1 || !iovType(iov, iovcnt, &type))
+            return Handle::receivev(iov, iovcnt);
+
+        int r = MPI_Recv(MPI_BOTTOM, 1, type, this->rank, this->tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Type_free(&type);
+        if (r != MPI_SUCCESS) {
+            MTCL_MPI_PRINT(100, "HandleMPI::receivev MPI_Recv ERROR\n");
+            errno = ECOMM;
+            return -1;
+        }
+        return iov_length(iov, iovcnt);
+    }
+
     /*ssize_t receive(void* buff, size_t size){
         MPI_Status status; 
         int count;
@@ -3,6 +3,8 @@
 
 #include <cassert>
 #include <cstring>
+#include <unordered_map>
+#include <vector>
 
 #include "../handle.hpp"
 #include "../protocolInterface.hpp"
@@ -23,6 +25,10 @@ public:
     ssize_t send(const void* buff, size_t size) {
 		return out.put(buff,size);
     }
+
+    ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		return out.putv(iov, iovcnt);
+    }
 	// receives the header containing the size (sizeof(size_t) bytes)
 	ssize_t probe(size_t& size, const bool blocking=true) {
 		ssize_t sz;
@@ -41,7 +47,30 @@ public:
         return in.get(buff,size);
     }
 
-    bool peek() {return false;}
+    ssize_t receivev(const struct iovec* iov, int iovcnt) {
+        return in.getv(iov, iovcnt);
+    }
+
+	// the message is built and read in place in the shared segment
+	void* acquireSendBuffer(size_t size) {
+		return out.acquire(size);
+	}
+
+	ssize_t commit() {
+		return out.commit();
+	}
+
+	ssize_t receiveView(const void*& buff) {
+		return in.view(buff);
+	}
+
+	int release() {
+		return in.release();
+	}
+
+    bool peek() { return in.peek() > 0; }
+
+	uint32_t id = 0; // sent to the doorbell of ConnSHM when it is parked
 
     ~HandleSHM() {}
 };
@@ -54,6 +83,88 @@ protected:
 	
     shmBuffer connbuff;    
     std::map<HandleSHM*, bool> connections;  // Active connections for this Connector
+	std::unordered_map<uint32_t, HandleSHM*> byid;
+	uint32_t nextid = 1;                     // 0 is connbuff
+
+	// Doorbell: a datagram socket in the abstract namespace where the
+	// producers of the parked buffers (connbuff and the input buffers of the
+	// yielded handles) send their id, see shmBuffer::park. It is the poll fd
+	// of the protocol, thus the IO thread sleeps until there is something
+	// to read and then checks only those buffers.
+	int bellfd = -1;
+	std::string bellname;
+	// raised by the producers that could not ring the doorbell
+	shmBellFlag bellflag;
+
+	// rings our own doorbell
+	void notify(uint32_t id) {
+		struct sockaddr_un sa;
+		socklen_t len;
+		if (unix_address(bellname, sa, len) == 0)
+			sendto(bellfd, &id, sizeof(id), MSG_DONTWAIT, (struct sockaddr*)&sa, len);
+	}
+
+	// the connection requests in connbuff
+	void acceptAll() {
+		REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));
+		do {
+			ssize_t sz;
+			while((sz=connbuff.trygetsize()) != -1) {
+				std::string msg(sz+1, '\0'); // +1 for the EOS (sz=0)
+				if ((sz=connbuff.get(msg.data(), msg.size()))==-1) {
+					MTCL_SHM_ERROR("ConnSHM::update ERROR errno=%d (%s)\n", errno,strerror(errno));
+					break;
+				}
+				msg.resize(sz);
+				auto c = msg.find(":");
+				if (c == std::string::npos) {
+					MTCL_SHM_ERROR("ConnSHM::update ERROR invalid message\n");
+					continue;
+				}
+				std::string inname  = msg.substr(0, c);
+				std::string outname = msg.substr(c+1);
+				
+				shmBuffer in;
+				if (in.open(outname)==-1) {
+					MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", outname.c_str(), errno, strerror(errno));
+					continue;
+				}
+				shmBuffer out;
+				if (out.open(inname)==-1) {
+					MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", inname.c_str(), errno, strerror(errno));
+					in.close();
+					continue;
+				}
+				
+				auto handle = new HandleSHM(this, in, out);
+				REMOVE_CODE_IF(ulock.lock());
+				insert(handle);
+				REMOVE_CODE_IF(ulock.unlock());                    
+				addinQ(true, handle);
+			}
+		} while(connbuff.park(bellname, 0));
+	}
+
+	// a yielded handle whose doorbell rang, called with the lock held. It
+	// returns true if the handle goes back to the user, addinQ has to be
+	// called after releasing the lock.
+	bool rung(HandleSHM* handle) {
+		// the ring might be spurious, e.g., from before a yield, thus the
+		// buffer is parked again if it is still empty
+		if (handle->in.peek() > 0 || handle->in.park(bellname, handle->id)) {
+			handle->in.unpark();
+			connections[handle] = false;
+			return true;
+		}
+		return false;
+	}
+
+	// called with the lock held
+	void insert(HandleSHM* handle) {
+		handle->id = nextid++;
+		connections[handle] = false;
+		byid[handle->id] = handle;
+	}
 
 #if !defined(SINGLE_IO_THREAD)
     std::shared_mutex shm;
@@ -66,85 +177,111 @@ public:
 
     int init(std::string name) {
 		shmname = name;
+		static std::atomic<int> nbells{0};
+		bellname = "@mtcl-shm-" + std::to_string(getpid()) + "-" + std::to_string(nbells++);
+		struct sockaddr_un sa;
+		socklen_t len;
+		if ((bellfd = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1 ||
+			unix_address(bellname, sa, len) == -1 ||
+			bind(bellfd, (struct sockaddr*)&sa, len) == -1) {
+			MTCL_SHM_PRINT(100, "ConnSHM::init doorbell errno=%d\n", errno);
+			if (bellfd != -1) close(bellfd);
+			bellfd = -1;
+			return -1;
+		}
+		if (bellflag.create(bellname) == -1) {
+			MTCL_SHM_PRINT(100, "ConnSHM::init doorbell flag errno=%d\n", errno);
+			close(bellfd);
+			bellfd = -1;
+			return -1;
+		}
 		return 0;
 	}
+
+	int getPollFd() { return bellfd; }
 	
     int listen(std::string address) {
 
 		//FIX: controllo che l'indirizzo parte con '/' e che non sia piu' lungo di NAME_MAX
 		// vale la pena prependere name all'address e mettere noi lo slash?
 		
-		if (connbuff.create(address, false)==-1) {
+		// written by all the connecting processes
+		if (connbuff.create(address, false, true, SHM_LISTEN_BUFFER_SIZE)==-1) {
 			MTCL_SHM_PRINT(100, "ConnSHM::listen ERROR errno=%d (%s)\n", errno, strerror(errno));
 			return -1;
 		}
         MTCL_SHM_PRINT(1, "listening to %s\n", address.c_str());
+		// requests sent before parking connbuff
+		if (connbuff.park(bellname, 0)) notify(0);
 
         return 0;
     }
 
     void update() {
-
         REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));		
-		ssize_t sz=-1;
-		if (connbuff.isOpen()) { // we are listening for incoming connections
-			// check first for new connections
-			if (((sz=connbuff.trygetsize())==-1) && errno!=EAGAIN) {
-				MTCL_SHM_ERROR("ConnSHM::update ERROR errno=%d (%s)\n", errno,strerror(errno));
-				goto skip;
-			}
-			if (sz!=-1) { // new connection
-				char msg[SHM_SMALL_MSG_SIZE];
-				if ((sz=connbuff.get(msg, SHM_SMALL_MSG_SIZE))==-1) {
-					MTCL_SHM_ERROR("ConnSHM::update ERROR errno=%d (%s)\n", errno,strerror(errno));
-					goto skip;
-				}
-				msg[sz]='\0';
-				auto c = std::string(msg).find(":");
-				if (c == std::string::npos) {
-					MTCL_SHM_ERROR("ConnSHM::update ERROR invalid message\n");
-					goto skip;
-				}
-				std::string inname  = std::string(msg).substr(0, c);
-				std::string outname = std::string(msg).substr(c+1);
-				
-				shmBuffer in;
-				if (in.open(outname)==-1) {
-					MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", outname.c_str(), errno, strerror(errno));
-					goto skip;
-				}
-				shmBuffer out;
-				if (out.open(inname)==-1) {
-					MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", inname.c_str(), errno, strerror(errno));
-					goto skip;
-				}
-				
-				auto handle = new HandleSHM(this, in, out);
-				REMOVE_CODE_IF(ulock.lock());
-				connections.insert({handle, false});
-				REMOVE_CODE_IF(ulock.unlock());                    
-				addinQ(true, handle);
+		uint32_t id;
+		bool accept = false;
+		while(recv(bellfd, &id, sizeof(id), 0) == sizeof(id)) {
+			if (id == 0) {
+				accept = true;
+				continue;
 			}
+			// the handle is yielded, nobody else can close it until addinQ
+			HandleSHM* handle = nullptr;
+			REMOVE_CODE_IF(ulock.lock());
+			auto it = byid.find(id);
+			if (it != byid.end() && connections[it->second] && rung(it->second)) handle = it->second;
+			REMOVE_CODE_IF(ulock.unlock());
+			if (handle) addinQ(false, handle);
 		}
-	skip:
-		REMOVE_CODE_IF(ulock.lock());		
-        for (auto &[handle, to_manage] : connections) {
-            if(to_manage) {
-				if (((sz=handle->in.peek())<0)) {
-					if (errno!=EWOULDBLOCK)
-						MTCL_SHM_ERROR("ConnSHM::update, peek errno=%d (%s)\n", errno, strerror(errno));
-					continue;
+		// the producers that could not ring the doorbell (full, or not
+		// reachable) raised its flag and the one of their segment, only then
+		// the yielded handles are checked
+		if (!bellflag.raised()) {
+			if (accept && connbuff.isOpen()) acceptAll();
+			return;
+		}
+		if (connbuff.isOpen() && (connbuff.overflowed() || accept)) acceptAll();
+		std::vector<HandleSHM*> ready;
+		REMOVE_CODE_IF(ulock.lock());
+		for(auto& [handle, managed] : connections)
+			if (managed && handle->in.overflowed() && rung(handle)) ready.push_back(handle);
+		REMOVE_CODE_IF(ulock.unlock());
+		for(auto* handle : ready) addinQ(false, handle);
+    }
+
+	// The size of the rings of a connection is chosen by who connects, with
+	// the "size" parameter of the address (e.g., "/name?size=64M", K, M and G
+	// suffixes), the peer gets it from the segments.
+    Handle* connect(const std::string& uri, int retry=-1, unsigned timeout=0) {
+		std::string address = uri.substr(0, uri.find('?'));
+		size_t size = SHM_SMALL_MSG_SIZE;
+		if (address.size() < uri.size()) {
+			const std::string param = uri.substr(address.size()+1);
+			char* end = nullptr;
+			if (param.compare(0, 5, "size=") == 0) size = strtoul(param.c_str()+5, &end, 10);
+			int shift = 0;
+			if (end && *end && !end[1]) {
+				switch(*end) {
+				case 'K': shift = 10; ++end; break;
+				case 'M': shift = 20; ++end; break;
+				case 'G': shift = 30; ++end; break;
 				}
-				// NOTE: called with ulock lock hold. Double lock if there is the IO-thread!
-				addinQ(false, handle);
 			}
-        }
-		REMOVE_CODE_IF(ulock.unlock());		
-    }
+			if (!end || end == param.c_str()+5 || *end || size > (SHM_MAX_SEGMENT_SIZE >> shift)) {
+				MTCL_SHM_PRINT(100, "ConnSHM::connect, invalid parameter %s\n", param.c_str());
+				errno = EINVAL;
+				return nullptr;
+			}
+			size <<= shift;
+		}
 
-    Handle* connect(const std::string& address, int retry=-1, unsigned timeout=0) {
 		shmBuffer connshm;
-		if (connshm.open(address) == -1) {
+		do {
+			if (connshm.open(address) == 0) break;
+			if (--retry > 0) std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+		} while(retry > 0);
+		if (!connshm.isOpen()) {
 			MTCL_SHM_PRINT(100, "ConnSHM::connect, cannot open the connection buffer, errno=%d\n", errno);
 			return nullptr;
 		}
@@ -154,20 +291,28 @@ public:
 
 		shmBuffer in;
 		// create a buffer for input messages
-		if (in.create(inname, false)<0) {
+		if (in.create(inname, false, false, size)<0) {
 			MTCL_SHM_PRINT(100, "ConnSHM::connect, cannot create input buffer, errno=%d\n", errno);
+			connshm.close();
 			return nullptr;
 		}
 		shmBuffer out;
 		// create a buffer for output messages
-		if (out.create(outname, false)<0) {
+		if (out.create(outname, false, false, size)<0) {
 			MTCL_SHM_PRINT(100, "ConnSHM::connect, cannot create output buffer, errno=%d\n", errno);
+			in.close(true);
+			connshm.close();
 			return nullptr;
 		}
-		std::string msg= inname+":"+outname;
+		// the names of the segments on huge pages are not inname and outname
+		std::string msg= in.name()+":"+out.name();
 		// sending the connection message
-		if (connshm.put(msg.c_str(),msg.length())<0) {
+		ssize_t r = connshm.put(msg.c_str(),msg.length());
+		connshm.close();
+		if (r<0) {
 			MTCL_SHM_PRINT(100, "ConnSHM::connect, ERROR sending the connect message %s, errno=%d (%s)\n", msg.c_str(), errno, strerror(errno));
+			in.close(true);
+			out.close(true);
 			return nullptr;
 		}
 		
@@ -176,7 +321,7 @@ public:
         HandleSHM *handle = new HandleSHM(this, in, out);
 		{
 			REMOVE_CODE_IF(std::unique_lock lock(shm));
-			connections[handle] = false;
+			insert(handle);
 		}
         return handle;
     }
@@ -189,7 +334,11 @@ public:
 		if (close_rd) {
 			{
 				REMOVE_CODE_IF(std::unique_lock lock(shm));
-				connections.erase(handle);
+				auto it = connections.find(handle);
+				if (it != connections.end()) {
+					byid.erase(handle->id);
+					connections.erase(it);
+				}
 			}
 			handle->in.close(true);			
 		}
@@ -199,8 +348,11 @@ public:
 		REMOVE_CODE_IF(std::unique_lock l(shm));
 		auto handle = reinterpret_cast<HandleSHM*>(h);
 		auto it = connections.find(handle);
-		if (it != connections.end())
-			connections[handle] = true;
+		if (it != connections.end() && !it->second) {
+			it->second = true;
+			// the IO thread gets the messages already there from the doorbell
+			if (handle->in.park(bellname, handle->id)) notify(handle->id);
+		}
     }
 
     void end(bool blockflag=false) {
@@ -209,6 +361,11 @@ public:
 			setAsClosed(handle, blockflag);
 		}
 		connbuff.close(true);
+		if (bellfd != -1) {
+			close(bellfd);
+			bellfd = -1;
+		}
+		bellflag.close();
     }
 
 };
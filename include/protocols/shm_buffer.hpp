@@ -3,6 +3,8 @@
 
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cmath>
@@ -13,93 +15,254 @@
 #include <pthread.h>
 
 /*
- * shared-memory buffer, one single slot of SHM_SMAL_MSG_SIZE size
+ * shared-memory buffer, a single-producer single-consumer ring whose size
+ * is chosen by the creator (SHM_SMALL_MSG_SIZE bytes by default). The
+ * producer and the consumer share only the head (bytes written) and the
+ * tail (bytes consumed) counters, that are on different cache lines, thus
+ * they run concurrently without locks and several messages can be in the
+ * ring at the same time.
+ *
+ * A message is a record (header and payload, aligned to a cache line), the
+ * messages larger than a quarter of the ring are split into several records
+ * so that the consumer copies a fragment out while the producer copies the
+ * next one in. Records never wrap around, the producer skips the end of the
+ * ring with a wrap record.
+ *
+ * Threads of the same process are serialized by a local mutex. The buffers
+ * created as shared (e.g., the one of the SHM listener) can be written by
+ * several processes, that take a producer lock in the segment.
+ *
+ * Rings larger than SHM_SMALL_MSG_SIZE are backed by huge pages if the
+ * system has some reserved (a memfd on hugetlbfs, that the peer opens
+ * through /proc/<pid>/fd), otherwise they are named segments as the others
+ * and transparent huge pages are requested for them.
  */
+/*
+ * Overflow flag of a doorbell (see shmBuffer::park), in a small segment
+ * named after it: "@name" is "/name". The producers that could not ring
+ * the doorbell raise it, thus the owner looks for the parked buffers with
+ * data only after an overflow.
+ */
+class shmBellFlag {
+	std::atomic<uint32_t>* flag = nullptr;
+	std::string name;
+
+	static std::string segment(const std::string& bell) { return "/" + bell.substr(1); }
+
+public:
+	// called by the owner of the doorbell
+	int create(const std::string& bell) {
+		name = segment(bell);
+		int fd = shm_open(name.c_str(), O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR);
+		if (fd == -1) return -1;
+		void* p = MAP_FAILED;
+		if (ftruncate(fd, sizeof(*flag)) == 0)
+			p = mmap(nullptr, sizeof(*flag), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED) {
+			shm_unlink(name.c_str());
+			return -1;
+		}
+		flag = (std::atomic<uint32_t>*)p;
+		return 0;
+	}
+
+	void close() {
+		if (!flag) return;
+		munmap(flag, sizeof(*flag));
+		shm_unlink(name.c_str());
+		flag = nullptr;
+	}
+
+	// true if a producer could not ring the doorbell since the last call
+	bool raised() {
+		return flag && flag->load(std::memory_order_relaxed) &&
+			flag->exchange(0, std::memory_order_acquire);
+	}
+
+	// called by a producer that could not ring the doorbell bell
+	static void raise(const std::string& bell) {
+		int fd = shm_open(segment(bell).c_str(), O_RDWR, 0);
+		if (fd == -1) return;
+		void* p = mmap(nullptr, sizeof(*flag), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED) return;
+		((std::atomic<uint32_t>*)p)->store(1, std::memory_order_release);
+		munmap(p, sizeof(*flag));
+	}
+};
+
 class shmBuffer {
 protected:
-	struct buffer_element_t {
-		size_t  size;
-		char    data[SHM_SMALL_MSG_SIZE];
+	static constexpr size_t   align    = 64;
+	static constexpr uint64_t WRAP     = ~0ULL;
+
+	struct record_t {
+		uint64_t size;  // of the message, 0 is the EOS
+		uint64_t len;   // bytes of the message in this record (WRAP: go back to the start)
 	};
+	// largest payload of a record written by putv
+	size_t maxfrag() const { return ringsize/4 - sizeof(record_t); }
+
+	// A side that cannot proceed spins for a while, then it flags that it is
+	// sleeping and waits on the futex word (shared between processes) that
+	// the other side bumps, only if someone sleeps, after moving its counter.
 	struct shmSegment {
-		pthread_spinlock_t spinlock;
-		void* guard;
-		buffer_element_t data;
+		alignas(64) std::atomic<uint64_t> head;      // written by the producer
+		std::atomic<uint32_t> headseq;               // futex of the consumer
+		std::atomic<uint32_t> rsleeping;             // the consumer sleeps on headseq
+		alignas(64) std::atomic<uint64_t> tail;      // written by the consumer
+		std::atomic<uint32_t> tailseq;               // futex of the producers
+		std::atomic<uint32_t> wsleeping;             // producers sleeping on tailseq
+		std::atomic<uint32_t> parked;                // the consumer waits for the doorbell
+		std::atomic<uint32_t> overflow;              // the doorbell could not be rung
+		uint32_t bellid;                             // sent to the doorbell
+		char     bell[64];                           // address of the doorbell
+		alignas(64) pthread_mutex_t wlock;           // producers of shared buffers (robust)
+		uint32_t wpartial;                           // a message of several records is being written
+		uint64_t wstart;                             // head at its first record
+		uint32_t wbroken;                            // by a producer that died
+		uint32_t shared;
+		std::atomic<uint32_t> ready;                 // set by the creator at the end
+		// followed by the ring, up to the end of the segment
+		char* data() { return (char*)(this+1); }
 	} *shmp = nullptr;
 
-	
 	std::string segmentname{};
 	std::atomic<bool> opened{false};
+	size_t ringsize = 0;
+	size_t maplen   = 0;   // of the segment
+	int    memfd    = -1;  // of a segment on huge pages, kept open for the peer
 
     std::mutex mutex;
 
-	int createBuffer(const std::string& name, bool force=false) {
-		int flags = O_CREAT|O_RDWR|O_EXCL;
-		if (force) flags |= O_TRUNC;
-		int fd = shm_open(name.c_str(), flags, S_IRUSR|S_IWUSR);
-		if (fd == -1) return -1;
-		if (ftruncate(fd, sizeof(shmSegment)) == -1) return -1;
-		shmp = (shmSegment*)mmap(NULL, sizeof(shmSegment), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-		::close(fd);
+	static size_t recsize(size_t len) { return (sizeof(record_t) + len + align-1) & ~(align-1); }
+
+	static size_t roundup(size_t n, size_t m) { return (n + m-1) / m * m; }
+
+	// maps the segment of fd, of maplen bytes
+	int map(int fd) {
+		shmp = (shmSegment*)mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
 		if (shmp == MAP_FAILED) {
 			shmp = nullptr;
 			return -1;
 		}
+		ringsize = maplen - sizeof(shmSegment);
+		return 0;
+	}
+	// a segment on huge pages if there are any, it has no name in /dev/shm
+	int createHuge(const std::string& name) {
+#if defined(MFD_HUGETLB)
+		int fd = memfd_create(name.c_str()+1, MFD_CLOEXEC|MFD_HUGETLB);
+		if (fd == -1) return -1;
+		maplen = roundup(maplen, SHM_HUGEPAGE_SIZE);
+		if (ftruncate(fd, maplen) == -1 || map(fd) == -1) {
+			MTCL_SHM_PRINT(100, "shmBuffer::createHuge, no huge pages for %s errno=%d\n", name.c_str(), errno);
+			::close(fd);
+			return -1;
+		}
+		memfd = fd;
+		segmentname = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+		return 0;
+#else
+		errno = ENOTSUP;
+		return -1;
+#endif
+	}
+
+	int createBuffer(const std::string& name, bool force, bool shared, size_t size) {
+		maplen = sizeof(shmSegment) + roundup(size, align);
+		if (size <= SHM_SMALL_MSG_SIZE || shared || createHuge(name) == -1) {
+			int flags = O_CREAT|O_RDWR|O_EXCL;
+			if (force) flags |= O_TRUNC;
+			int fd = shm_open(name.c_str(), flags, S_IRUSR|S_IWUSR);
+			if (fd == -1) return -1;
+			if (ftruncate(fd, maplen) == -1 || map(fd) == -1) {
+				int e = errno;
+				::close(fd);
+				shm_unlink(name.c_str());
+				errno = e;
+				return -1;
+			}
+			::close(fd);
+			segmentname = name;
+#if defined(MADV_HUGEPAGE)
+			if (maplen >= SHM_HUGEPAGE_SIZE) madvise(shmp, maplen, MADV_HUGEPAGE);
+#endif
+		}
 		int rc;
-		if ((rc=posix_madvise(shmp, sizeof(shmSegment), POSIX_MADV_SEQUENTIAL))==-1) {
+		if ((rc=posix_madvise(shmp, maplen, POSIX_MADV_SEQUENTIAL))==-1) {
 			MTCL_SHM_PRINT(100, "shmBuffer::createBuffer, ERROR madvise errno=%d\n", rc);
 		}
-		if ((rc=pthread_spin_init(&shmp->spinlock, PTHREAD_PROCESS_SHARED)) != 0) {
-			MTCL_SHM_PRINT(100, "shmBuffer::createBuffer, ERROR pthread_spin_init errno=%d\n", rc);
-			return -1;
+		// the other counters are zeroed by ftruncate
+		shmp->shared = shared;
+		if (shared) {
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&shmp->wlock, &attr);
+			pthread_mutexattr_destroy(&attr);
 		}
-		
-		shmp->guard = nullptr;		
-		segmentname=name;
+		shmp->ready.store(1, std::memory_order_release);
 		opened=true;
 		return 0;
 	}
 public:
 
 	shmBuffer() {}
-	shmBuffer(const shmBuffer& o):shmp(o.shmp),segmentname(o.segmentname),opened(o.opened.load()) {}
-	
+	shmBuffer(const shmBuffer& o):shmp(o.shmp),segmentname(o.segmentname),opened(o.opened.load()),
+								  ringsize(o.ringsize),maplen(o.maplen),memfd(o.memfd) {}
+
 	const std::string& name() {return segmentname;}
-	
-	// creates a shared-memory buffer with a name
-	int create(const std::string name, bool force=false) {
-		if constexpr (SHM_SMALL_MSG_SIZE<sizeof(size_t)) {
+
+	// creates a shared-memory buffer with a name and a ring of size bytes,
+	// shared if it is written by several processes. The name of a segment on
+	// huge pages is different, the peers open it with name().
+	int create(const std::string name, bool force=false, bool shared=false, size_t size=SHM_SMALL_MSG_SIZE) {
+		if (size < 8*align || size > SHM_MAX_SEGMENT_SIZE) {
 			errno = EINVAL;
 			return -1;
 		}
-		return createBuffer(name,force);
+		return createBuffer(name,force,shared,size);
 	}
 	const bool isOpen() { return opened;}
+	// size of the ring
+	size_t size() const { return ringsize; }
 	// opens an existing shared-memory buffer
 	int open(const std::string name) {
-		if constexpr (SHM_SMALL_MSG_SIZE<sizeof(size_t)) {
-			errno = EINVAL;
-			return -1;
-		}
 		if (opened) {
 			errno = EPERM;
 			return -1;
 		}
-		int fd = shm_open(name.c_str(), O_RDWR, 0); 
+		int fd = name.compare(0, 6, "/proc/") == 0 ? ::open(name.c_str(), O_RDWR|O_CLOEXEC)
+			                                       : shm_open(name.c_str(), O_RDWR, 0);
 		if (fd == -1)
 			return -1;
-		//struct stat sb;
-		//if (fstat(fd, &sb) == -1) return -1;
-		//assert(sb.st_size == sizeof(shmSegment));
-		shmp = (shmSegment*)mmap(NULL, sizeof(shmSegment), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-		if (shmp == MAP_FAILED) return -1;
+		// the creator sizes the segment after shm_open and then initializes
+		// it, until then the buffer does not exist yet
+		struct stat sb;
+		if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)(sizeof(shmSegment) + 8*align)) {
+			::close(fd);
+			errno = ENOENT;
+			return -1;
+		}
+		maplen = sb.st_size;
+		int r = map(fd);
 		::close(fd);
+		if (r == -1) return -1;
+		if (!shmp->ready.load(std::memory_order_acquire)) {
+			munmap(shmp, maplen);
+			shmp = nullptr;
+			errno = ENOENT;
+			return -1;
+		}
 		int rc;
-		if ((rc=posix_madvise(shmp, sizeof(shmSegment), POSIX_MADV_SEQUENTIAL))==-1) {
+		if ((rc=posix_madvise(shmp, maplen, POSIX_MADV_SEQUENTIAL))==-1) {
 			MTCL_SHM_PRINT(100, "shmBuffer::open, ERROR madvise errno=%d\n", rc);
 		}
 		segmentname=name;
-		opened = true;		
+		opened = true;
 		return 0;
 	}
 	// closes and destroys (unlink=true) a shared-memory buffer previously
@@ -109,175 +272,391 @@ public:
 			errno = EPERM;
 			return -1;
 		}
-		munmap(shmp,sizeof(shmSegment));
-		if (unlink) shm_unlink(segmentname.c_str());
+		munmap(shmp,maplen);
+		if (memfd != -1) {
+			::close(memfd);
+			memfd = -1;
+		} else if (unlink && segmentname.compare(0, 6, "/proc/") != 0)
+			shm_unlink(segmentname.c_str());
 		shmp=nullptr;
 		opened = false;
 		return 0;
-	}	
+	}
+protected:
+	// copies the next s bytes of the message described by iov (from position
+	// cur/off, updated) into dst
+	static void gather(char* dst, size_t s, const struct iovec* iov, int iovcnt, int& cur, size_t& off) {
+		for(size_t p=0; p<s && cur<iovcnt; ) {
+			size_t l = std::min(s-p, iov[cur].iov_len-off);
+			memcpy(dst+p, (char*)iov[cur].iov_base+off, l);
+			p += l; off += l;
+			if (off == iov[cur].iov_len) { ++cur; off = 0; }
+		}
+	}
+	// copies s bytes of src into the buffers described by iov (from position
+	// cur/off, updated), the bytes exceeding the buffers are discarded
+	static void scatter(const char* src, size_t s, const struct iovec* iov, int iovcnt, int& cur, size_t& off) {
+		for(size_t p=0; p<s && cur<iovcnt; ) {
+			size_t l = std::min(s-p, iov[cur].iov_len-off);
+			memcpy((char*)iov[cur].iov_base+off, src+p, l);
+			p += l; off += l;
+			if (off == iov[cur].iov_len) { ++cur; off = 0; }
+		}
+	}
+	// spins SHM_SPIN_ITERS times waiting for ready, then sleeps on seq
+	template<typename F>
+	static void waitFor(F ready, std::atomic<uint32_t>& seq, std::atomic<uint32_t>& sleeping) {
+		for(unsigned i=0; i<SHM_SPIN_ITERS; ++i) {
+			if (ready()) return;
+			cpu_relax();
+		}
+		while(!ready()) {
+			uint32_t s = seq.load(std::memory_order_acquire);
+			sleeping.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!ready()) futex_wait(&seq, s, -1, true);
+			sleeping.fetch_sub(1);
+		}
+	}
+	// wakes up who sleeps on seq, if any
+	static void wake(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& sleeping) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed) == 0) return;
+		seq.fetch_add(1, std::memory_order_release);
+		futex_wake(&seq, INT_MAX, true);
+	}
+	// The producers of shared buffers are serialized by a robust mutex: if
+	// one of them dies holding it, the next one takes it over. The ring is
+	// still consistent unless the dead one had published only some records
+	// of a message, then the buffer is broken for everybody (EOWNERDEAD).
+	int lockProducers() {
+		if (!shmp->shared) return 0;
+		int rc = pthread_mutex_lock(&shmp->wlock);
+		if (rc == EOWNERDEAD) {
+			MTCL_SHM_PRINT(100, "shmBuffer::lockProducers, a producer of %s died\n", segmentname.c_str());
+			if (shmp->wpartial && shmp->head.load(std::memory_order_relaxed) != shmp->wstart)
+				shmp->wbroken = 1;
+			shmp->wpartial = 0;
+			rc = pthread_mutex_consistent(&shmp->wlock);
+		}
+		if (rc == 0 && shmp->wbroken) {
+			pthread_mutex_unlock(&shmp->wlock);
+			rc = EOWNERDEAD;
+		}
+		if (rc != 0) {
+			errno = rc;
+			return -1;
+		}
+		return 0;
+	}
+	void unlockProducers() {
+		if (shmp->shared) pthread_mutex_unlock(&shmp->wlock);
+	}
+	// waits until the ring has room for a record of n bytes (producer side)
+	// and returns it, the producer publishes it with publish
+	record_t* reserve(size_t n) {
+		uint64_t head = shmp->head.load(std::memory_order_relaxed);
+		size_t idx = head % ringsize;
+		size_t skip = idx + n > ringsize ? ringsize - idx : 0;
+		waitFor([&]{ return head + skip + n - shmp->tail.load(std::memory_order_acquire) <= ringsize; },
+				shmp->tailseq, shmp->wsleeping);
+		if (skip) {
+			((record_t*)(shmp->data() + idx))->len = WRAP;
+			head += skip;
+			idx = 0;
+		}
+		wpos = head + n;
+		return (record_t*)(shmp->data() + idx);
+	}
+	void publish() {
+		shmp->head.store(wpos, std::memory_order_release);
+		wake(shmp->headseq, shmp->rsleeping);
+		ring();
+	}
+	// sends the id to the doorbell of a parked consumer (after the fence of
+	// wake), only the producer that unparks it. It never blocks: if the
+	// doorbell is full or unreachable the consumer finds the overflow flag,
+	// and its owner the one of the doorbell.
+	void ring() {
+		if (shmp->parked.load(std::memory_order_relaxed) == 0 ||
+			shmp->parked.exchange(0, std::memory_order_acquire) == 0)
+			return;
+		static int fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+		struct sockaddr_un sa;
+		socklen_t len;
+		uint32_t id = shmp->bellid;
+		if (unix_address(shmp->bell, sa, len) == -1 ||
+			sendto(fd, &id, sizeof(id), MSG_DONTWAIT|MSG_NOSIGNAL, (struct sockaddr*)&sa, len) == -1) {
+			if (errno != EAGAIN)
+				MTCL_SHM_ERROR("shmBuffer::ring, doorbell %s errno=%d (%s)\n", shmp->bell, errno, strerror(errno));
+			shmp->overflow.store(1, std::memory_order_release);
+			shmBellFlag::raise(shmp->bell);
+		}
+	}
+
+	// the first record of the ring (consumer side), nullptr if the ring is
+	// empty and blocking is false
+	record_t* front(bool blocking) {
+		uint64_t tail = shmp->tail.load(std::memory_order_relaxed);
+		while(true) {
+			if (shmp->head.load(std::memory_order_acquire) == tail) {
+				if (!blocking) return nullptr;
+				waitFor([&]{ return shmp->head.load(std::memory_order_acquire) != tail; },
+						shmp->headseq, shmp->rsleeping);
+			}
+			record_t* r = (record_t*)(shmp->data() + tail % ringsize);
+			if (r->len != WRAP) return r;
+			tail += ringsize - tail % ringsize;
+			shmp->tail.store(tail, std::memory_order_release);
+			wake(shmp->tailseq, shmp->wsleeping);
+		}
+	}
+	// removes the record returned by front
+	void pop(record_t* r) {
+		shmp->tail.store(shmp->tail.load(std::memory_order_relaxed) + recsize(r->len), std::memory_order_release);
+		wake(shmp->tailseq, shmp->wsleeping);
+	}
+
+	uint64_t  wpos = 0;           // head after the reserved record
+	size_t    acquired = 0;       // size of the message being written in place
+	record_t* viewed = nullptr;   // message being read in place
+public:
+	// largest message that can be written in place
+	size_t maxInPlace() const { return ringsize/2 - sizeof(record_t); }
+
 	// adds a message to the buffer
 	ssize_t put(const void* data, const size_t sz) {
 		if (!shmp || !data) {
 			errno=EINVAL;
 			return -1;
 		}
-
-		std::unique_lock lk(mutex);
 		if (sz==0) {
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard==0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				cpu_relax();
-			} while(1);
-			shmp->data.size=sz;
-			shmp->guard=(void*)data;
-			pthread_spin_unlock(&shmp->spinlock);
+			std::unique_lock lk(mutex);
+			if (lockProducers() == -1) return -1;
+			record_t* r = reserve(recsize(0));
+			r->size = r->len = 0;
+			publish();
+			unlockProducers();
 			return 0;
 		}
+		struct iovec v = {const_cast<void*>(data), sz};
 		posix_madvise((void*)data, sz, POSIX_MADV_SEQUENTIAL);
-		for (size_t size = sz, s=0, p=0; size>0; size-=s, p+=s) {
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard==0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				cpu_relax();
-			} while(1);
-			shmp->data.size=sz;
-			s = std::min(size, (size_t)SHM_SMALL_MSG_SIZE);
-			memcpy(shmp->data.data, (char*)data + p, s);
-			shmp->guard = (void*)data;
-			pthread_spin_unlock(&shmp->spinlock);
-		}
+		ssize_t r = putv(&v, 1);
 		posix_madvise((void*)data, sz, POSIX_MADV_NORMAL);
-		return sz;
+		return r;
 	}
-	// retrieves a message from the buffer, it blocks if the buffer is empty	
-	ssize_t get(void* data, const size_t sz) {
-		if (!shmp || !data || !sz) {
+	// adds a message made of the iovcnt buffers described by iov, they are
+	// copied directly into the shared segment
+	ssize_t putv(const struct iovec* iov, int iovcnt) {
+		const size_t sz = iov ? iov_length(iov, iovcnt) : 0;
+		if (!shmp || sz==0) {
 			errno=EINVAL;
 			return -1;
 		}
-		
-		std::unique_lock lk(mutex);
-
-		do {
-			pthread_spin_lock(&shmp->spinlock);
-			if (shmp->guard != nullptr) {
-				break;
-			}
-			pthread_spin_unlock(&shmp->spinlock);
-			cpu_relax();
-		} while(true);				
 
-		size_t size = shmp->data.size;
-		if (size==0) {
-			shmp->guard=0;
-			pthread_spin_unlock(&shmp->spinlock);
-			return 0;
+		std::unique_lock lk(mutex);
+		if (lockProducers() == -1) return -1;
+		int cur = 0;
+		size_t off = 0;
+		if (sz > maxfrag()) {
+			shmp->wstart = shmp->head.load(std::memory_order_relaxed);
+			shmp->wpartial = 1;
 		}
-		posix_madvise(data, sz, POSIX_MADV_SEQUENTIAL);
-		int nmsgs = std::ceil((float)size / SHM_SMALL_MSG_SIZE);
-		for (size_t sz=size, s=0, p=0; nmsgs; sz-=s, p+=s) {
-			s = std::min(sz, (size_t)SHM_SMALL_MSG_SIZE);
-			memcpy((char*)data + p, shmp->data.data, s);
-			shmp->guard = 0;
-			pthread_spin_unlock(&shmp->spinlock);
-			if (--nmsgs == 0) break;
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard!=0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				cpu_relax();
-			} while(true);
+		for (size_t left = sz; left>0; ) {
+			size_t s = std::min(left, maxfrag());
+			record_t* r = reserve(recsize(s));
+			r->size = sz;
+			r->len  = s;
+			gather((char*)(r+1), s, iov, iovcnt, cur, off);
+			publish();
+			left -= s;
 		}
-		posix_madvise(data, sz, POSIX_MADV_NORMAL);
-		return size;
+		shmp->wpartial = 0;
+		unlockProducers();
+		return sz;
 	}
-	// retrieves the size of the message in the buffer without removing the message
-	// from the buffer, it blocks if the buffer is empty	
-	ssize_t getsize() {
+	// reserves a message of sz bytes (at most maxInPlace) in the buffer and
+	// returns where its payload has to be written, it is sent by commit.
+	// The caller cannot send anything else until then, and it must call
+	// commit from the same thread.
+	void* acquire(const size_t sz) {
+		if (!shmp || sz==0 || sz > maxInPlace()) {
+			errno = (shmp && sz) ? EMSGSIZE : EINVAL;
+			return nullptr;
+		}
+		mutex.lock();
+		if (lockProducers() == -1) {
+			mutex.unlock();
+			return nullptr;
+		}
+		record_t* r = reserve(recsize(sz));
+		r->size = r->len = sz;
+		acquired = sz;
+		return r+1;
+	}
+	// sends the message returned by acquire
+	ssize_t commit() {
+		if (!acquired) {
+			errno = EINVAL;
+			return -1;
+		}
+		size_t sz = acquired;
+		acquired = 0;
+		publish();
+		unlockProducers();
+		mutex.unlock();
+		return sz;
+	}
+	// points data to the payload of the next message, that stays in the
+	// buffer until release (called from the same thread). It blocks if the
+	// buffer is empty, the EOS is consumed. Messages split into several
+	// records (see putv) cannot be read in place, EMSGSIZE is returned and
+	// they have to be received with get.
+	ssize_t view(const void*& data) {
 		if (!shmp) {
 			errno=EINVAL;
 			return -1;
 		}
-		//std::unique_lock lk(mutex);
-		do {
-			pthread_spin_lock(&shmp->spinlock);
-			if (shmp->guard != nullptr) {
-				break;
-			}
-			pthread_spin_unlock(&shmp->spinlock);
-			cpu_relax();
-		} while(true);				
-		size_t size = shmp->data.size;
-		pthread_spin_unlock(&shmp->spinlock);
-		return size;
+		mutex.lock();
+		record_t* r = front(true);
+		if (r->size == 0) {
+			pop(r);
+			mutex.unlock();
+			return 0;
+		}
+		if (r->len != r->size) {
+			mutex.unlock();
+			errno = EMSGSIZE;
+			return -1;
+		}
+		viewed = r;
+		data = r+1;
+		return r->size;
 	}
-	// retrieves a message from the buffer, it doesn't block if the buffer is empty	
-	ssize_t tryget(void* data, const size_t sz) {
+	// removes the message returned by view
+	int release() {
+		if (!viewed) {
+			errno = EINVAL;
+			return -1;
+		}
+		pop(viewed);
+		viewed = nullptr;
+		mutex.unlock();
+		return 0;
+	}
+	// retrieves a message from the buffer, it blocks if the buffer is empty
+	ssize_t get(void* data, const size_t sz) {
 		if (!shmp || !data || !sz) {
 			errno=EINVAL;
 			return -1;
 		}
+		struct iovec v = {data, sz};
+		posix_madvise(data, sz, POSIX_MADV_SEQUENTIAL);
+		ssize_t r = getv(&v, 1, true);
+		posix_madvise(data, sz, POSIX_MADV_NORMAL);
+		return r;
+	}
+	// retrieves a message from the buffer into the iovcnt buffers described by
+	// iov, if blocking is false it doesn't block if the buffer is empty
+	ssize_t getv(const struct iovec* iov, int iovcnt, bool blocking=true) {
+		if (!shmp || !iov || iovcnt<=0) {
+			errno=EINVAL;
+			return -1;
+		}
 
 		std::unique_lock lk(mutex);
 
-		pthread_spin_lock(&shmp->spinlock);
-		if (shmp->guard == nullptr) {
-			pthread_spin_unlock(&shmp->spinlock);
+		record_t* r = front(blocking);
+		if (!r) {
 			errno = EAGAIN;
 			return -1;
 		}
-		size_t size = shmp->data.size;
-		if (size==0) {
-			shmp->guard=0;
-			pthread_spin_unlock(&shmp->spinlock);
-			return 0;
+		size_t size = r->size;
+		int cur = 0;
+		size_t off = 0;
+		for (size_t left = size; ; ) {
+			scatter((char*)(r+1), r->len, iov, iovcnt, cur, off);
+			left -= r->len;
+			pop(r);
+			if (left == 0) break;
+			r = front(true); // the next fragment
 		}
-		posix_madvise(data, sz, POSIX_MADV_SEQUENTIAL);
-		int nmsgs = std::ceil((float)size / SHM_SMALL_MSG_SIZE);
-		for (size_t sz=size, s=0, p=0; nmsgs; sz-=s, p+=s) {
-			s = std::min(sz, (size_t)SHM_SMALL_MSG_SIZE);
-			memcpy((char*)data + p, shmp->data.data, s);
-			shmp->guard = 0;
-			pthread_spin_unlock(&shmp->spinlock);
-			if (--nmsgs == 0) break;
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard!=0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				cpu_relax();
-			} while(true);
-		}
-		posix_madvise(data, sz, POSIX_MADV_NORMAL);
 		return size;
 	}
 	// retrieves the size of the message in the buffer without removing the message
-	// from the buffer, it doesn't block if the buffer is empty	
+	// from the buffer, it blocks if the buffer is empty
+	ssize_t getsize() {
+		if (!shmp) {
+			errno=EINVAL;
+			return -1;
+		}
+		std::unique_lock lk(mutex);
+		return front(true)->size;
+	}
+	// retrieves a message from the buffer, it doesn't block if the buffer is empty
+	ssize_t tryget(void* data, const size_t sz) {
+		if (!shmp || !data || !sz) {
+			errno=EINVAL;
+			return -1;
+		}
+		struct iovec v = {data, sz};
+		return getv(&v, 1, false);
+	}
+	// retrieves the size of the message in the buffer without removing the message
+	// from the buffer, it doesn't block if the buffer is empty
 	ssize_t trygetsize() {
 		if (!shmp) {
 			errno=EINVAL;
 			return -1;
 		}
-		//std::unique_lock lk(mutex);
-		pthread_spin_lock(&shmp->spinlock);
-		if (shmp->guard == nullptr) {
-			pthread_spin_unlock(&shmp->spinlock);
+		std::unique_lock lk(mutex);
+		record_t* r = front(false);
+		if (!r) {
 			errno = EAGAIN;
 			return -1;
 		}
-		size_t size = shmp->data.size;
-		pthread_spin_unlock(&shmp->spinlock);
-		return size;
+		return r->size;
+	}
+	// the consumer waits for the messages on the doorbell bell (an AF_UNIX
+	// datagram socket, see ConnSHM), the next producer sends id to it. It
+	// returns true if the buffer is not empty, the doorbell may not be rung.
+	bool park(const std::string& bell, uint32_t id) {
+		if (bell.size() >= sizeof(shmp->bell)) return peek() > 0;
+		memcpy(shmp->bell, bell.c_str(), bell.size()+1);
+		shmp->bellid = id;
+		shmp->parked.store(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return peek() > 0;
+	}
+	// the consumer does not wait for the doorbell anymore
+	void unpark() { shmp->parked.store(0, std::memory_order_relaxed); }
+	// the consumer waits until the buffer is not empty or woken() is true:
+	// it spins, then it sleeps on the futex (at most timeout_us) until a
+	// producer publishes or calls wakeConsumer. It may return earlier.
+	template<typename F>
+	void waitConsumer(F woken, long timeout_us) {
+		for(unsigned i=0; i<SHM_SPIN_ITERS; ++i) {
+			if (peek() > 0) return;
+			cpu_relax();
+		}
+		uint32_t s = shmp->headseq.load(std::memory_order_acquire);
+		shmp->rsleeping.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (peek() == 0 && !woken()) futex_wait(&shmp->headseq, s, timeout_us, true);
+		shmp->rsleeping.fetch_sub(1);
+	}
+	// wakes up the consumer sleeping in waitConsumer (producer side), after
+	// something that woken() checks has happened
+	void wakeConsumer() { wake(shmp->headseq, shmp->rsleeping); }
+	// true if a producer could not ring the doorbell since the last call
+	bool overflowed() {
+		return shmp->overflow.load(std::memory_order_relaxed) &&
+			shmp->overflow.exchange(0, std::memory_order_acquire);
 	}
 	// it peeks at whether there are any messages in the buffer
 	// WARNING: The buffer may already be emptied by the time 'pick' returns.
 	ssize_t peek() {
-		pthread_spin_lock(&shmp->spinlock);
-		int val = ((shmp->guard)?1:0);
-		pthread_spin_unlock(&shmp->spinlock);
-		return val;
+		return shmp->head.load(std::memory_order_acquire) != shmp->tail.load(std::memory_order_relaxed) ? 1 : 0;
 	}
 };
 
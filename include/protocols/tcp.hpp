@@ -13,18 +13,34 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <queue>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <shared_mutex>
 
 #include "../handle.hpp"
 #include "../protocolInterface.hpp"
+#include "coalescing.hpp"
+#include "shm_buffer.hpp"
 
 
 
 class HandleTCP : public Handle {
+	friend class HandleTCPStriped;
+	friend class ConnTcp;
 
     ssize_t readn(int fd, char *ptr, size_t n) {  
         size_t   nleft = n;
@@ -44,7 +60,7 @@ class HandleTCP : public Handle {
 	ssize_t readvn(int fd, struct iovec *v, int count){
 		ssize_t rread;
 		for (int cur = 0;;) {
-			rread = readv(fd, v+cur, count-cur);
+			rread = readv(fd, v+cur, std::min(count-cur, IOV_MAX));
 			if (rread <= 0) return rread; // error or closed connection
 			while (cur < count && rread >= (ssize_t)v[cur].iov_len)
 				rread -= v[cur++].iov_len;
@@ -70,10 +86,23 @@ class HandleTCP : public Handle {
         return(n - nleft); /* return >= 0 */
     }
 
-	ssize_t writevn(int fd, struct iovec *v, int count){
+	// with zerocopy the calls use MSG_ZEROCOPY, the kernel may still be
+	// reading the buffers when it returns (see waitZerocopy)
+	ssize_t writevn(int fd, struct iovec *v, int count, bool zerocopy=false){
 		ssize_t written;
 		for (int cur = 0;;) {
-			written = writev(fd, v+cur, count-cur);
+			if (zerocopy) {
+				struct msghdr msg = {};
+				msg.msg_iov    = v+cur;
+				msg.msg_iovlen = std::min(count-cur, IOV_MAX);
+				written = sendmsg(fd, &msg, MSG_ZEROCOPY);
+				if (written < 0 && errno == ENOBUFS) { // too many notifications pending
+					zerocopy = false;
+					continue;
+				}
+				if (written >= 0) ++zcSent;
+			} else
+				written = writev(fd, v+cur, std::min(count-cur, IOV_MAX));
 			if (written < 0) return -1;
 			while (cur < count && written >= (ssize_t)v[cur].iov_len)
 				written -= v[cur++].iov_len;
@@ -84,16 +113,562 @@ class HandleTCP : public Handle {
 		return -1;
 	}
 	
+	// Read-ahead buffer: the socket is read as much as possible (up to rcap
+	// bytes) and probe/receive/peek are served from here. Data not consumed
+	// yet is in [rpos, rend). Only the owner of the handle accesses it.
+	static constexpr size_t rcap = std::max((size_t)TCP_READAHEAD_SIZE, sizeof(size_t));
+	std::vector<char> rbuf;
+	size_t rpos = 0, rend = 0;
+
+	// copies at most n buffered bytes into ptr
+	size_t takeBuffered(char* ptr, size_t n) {
+		size_t l = std::min(n, rend - rpos);
+		memcpy(ptr, rbuf.data() + rpos, l);
+		rpos += l;
+		if (rpos == rend) rpos = rend = 0;
+		return l;
+	}
+
+	// reads what is available on the socket (at least one byte if flags does
+	// not contain MSG_DONTWAIT) into the free space of the buffer
+	ssize_t fill(int flags) {
+		if (rbuf.empty()) rbuf.resize(rcap);
+		if (rpos > 0) { // keeps the free space at the end
+			memmove(rbuf.data(), rbuf.data() + rpos, rend - rpos);
+			rend -= rpos;
+			rpos = 0;
+		}
+		ssize_t r;
+		do {
+			r = recv(fd, rbuf.data() + rend, rcap - rend, flags);
+		} while(r < 0 && errno == EINTR);
+		if (r > 0) rend += r;
+		return r;
+	}
+
+	// as readn, the buffered data is consumed first. Payloads larger than the
+	// buffer are read directly into the user memory.
+	ssize_t readBuffered(char* ptr, size_t n) {
+		size_t got = takeBuffered(ptr, n);
+		while (got < n) {
+			if (n - got >= rcap) {
+				ssize_t r = readn(fd, ptr + got, n - got);
+				if (r < 0) return got ? (ssize_t)got : -1;
+				return got + r;
+			}
+			ssize_t r = fill(0);
+			if (r <= 0) {
+				if (r < 0 && got == 0) return -1;
+				break;
+			}
+			got += takeBuffered(ptr + got, n - got);
+		}
+		return got;
+	}
+
+	// as recv with MSG_DONTWAIT, the buffered data is consumed first
+	ssize_t readNonBlocking(char* ptr, size_t n) {
+		if (buffered() == 0 && n < rcap) {
+			ssize_t r = fill(MSG_DONTWAIT);
+			if (r <= 0) return r;
+		}
+		if (buffered() > 0) return takeBuffered(ptr, n);
+		return recv(fd, ptr, n, MSG_DONTWAIT);
+	}
+
+	// Same-host upgrade (see Manager::setShmUpgrade). The messages go
+	// through two shared-memory buffers created by the connecting side, the
+	// socket carries only the EOS and tells when the peer is gone.
+	struct ShmPath {
+		shmBuffer in, out;
+		~ShmPath() {
+			if (in.isOpen()) in.close();
+			if (out.isOpen()) out.close();
+		}
+	};
+	std::unique_ptr<ShmPath> shmPath;
+	std::unique_ptr<ShmPath> shmOffered; // during the handshake
+
+	// identifies the running kernel, thus the host
+	static const std::string& bootId() {
+		static const std::string id = []{
+			std::string s;
+			std::ifstream f("/proc/sys/kernel/random/boot_id");
+			if (!std::getline(f, s)) {
+				char host[256] = {};
+				gethostname(host, sizeof(host)-1);
+				s = host;
+			}
+			return s;
+		}();
+		return id;
+	}
+
+	bool peerIsLocal() {
+		struct sockaddr_storage local, peer;
+		socklen_t ll = sizeof(local), pl = sizeof(peer);
+		if (getsockname(fd, (struct sockaddr*)&local, &ll) == -1 ||
+			getpeername(fd, (struct sockaddr*)&peer, &pl) == -1)
+			return false;
+		switch(peer.ss_family) {
+		case AF_UNIX: return true;
+		case AF_INET: {
+			auto* p = (struct sockaddr_in*)&peer;
+			auto* l = (struct sockaddr_in*)&local;
+			return (ntohl(p->sin_addr.s_addr) >> 24) == 127 ||
+				p->sin_addr.s_addr == l->sin_addr.s_addr;
+		}
+		case AF_INET6: {
+			auto* p = (struct sockaddr_in6*)&peer;
+			auto* l = (struct sockaddr_in6*)&local;
+			return IN6_IS_ADDR_LOOPBACK(&p->sin6_addr) ||
+				(IN6_IS_ADDR_V4MAPPED(&p->sin6_addr) && p->sin6_addr.s6_addr[12] == 127) ||
+				memcmp(&p->sin6_addr, &l->sin6_addr, sizeof(struct in6_addr)) == 0;
+		}}
+		return false;
+	}
+
+	// true if the socket has something to report (the EOS, or it has been
+	// closed), nothing else is sent on it after the upgrade
+	bool socketReadable() {
+		if (buffered() > 0) return true;
+		struct pollfd pfd = {fd, POLLIN, 0};
+		return ::poll(&pfd, 1, 0) > 0;
+	}
+
+	// 1 if the next message is in the shared buffer (size is set), 0 if it
+	// has to be read from the socket, -1 if there is nothing yet (not
+	// blocking). The messages sent before the EOS are in the buffer before
+	// the EOS reaches the socket. A blocking probe sleeps on the futex of the
+	// buffer, the peer wakes it up after sending the EOS (see sendEOS).
+	int shmProbe(size_t& size, bool blocking) {
+		while(true) {
+			ssize_t sz = shmPath->in.trygetsize();
+			if (sz >= 0) {
+				size = sz;
+				return 1;
+			}
+			if (socketReadable()) {
+				if ((sz = shmPath->in.trygetsize()) >= 0) {
+					size = sz;
+					return 1;
+				}
+				return 0;
+			}
+			if (!blocking) return -1;
+			shmPath->in.waitConsumer([&]{ return socketReadable(); }, SHM_UPGRADE_HANGUP_CHECK*1000L);
+		}
+	}
+
+	// isend not completed yet, written by the IO thread when the socket
+	// becomes writable (or by the owner in test/wait)
+	class SendRequest : public RequestImpl {
+		friend class HandleTCP;
+		HandleTCP* h;
+		size_t sz;
+		struct iovec iov[2];
+		int cur = 0;
+		std::atomic<bool> done{false};
+		bool zerocopy = false;  // done when the kernel has released the pages
+		uint32_t zcTarget = 0;  // see HandleTCP::waitZerocopy
+	public:
+		SendRequest(HandleTCP* h, const void* buff, size_t size) : h(h), sz(htobe64(size)) {
+			iov[0].iov_base = &sz;
+			iov[0].iov_len  = sizeof(sz);
+			iov[1].iov_base = const_cast<void*>(buff);
+			iov[1].iov_len  = size;
+			result = size;
+		}
+		bool test() {
+			if (done.load(std::memory_order_acquire)) return true;
+			h->drainPending();
+			if (zerocopy) h->reapZerocopy();
+			return done.load(std::memory_order_acquire);
+		}
+		void wait() {
+			if (!done.load(std::memory_order_acquire)) h->flushPending();
+			if (!done.load(std::memory_order_acquire)) h->waitZerocopy(zcTarget);
+		}
+	};
+
+	// irecv, progressed by the owner of the handle with non-blocking reads
+	class RecvRequest : public RequestImpl {
+		HandleTCP* h;
+		char*  buff;
+		size_t size;
+		size_t hdr;
+		size_t got = 0;  // header + payload bytes received so far
+		size_t msgsz = 0;
+		bool   done = false;
+
+		bool complete(ssize_t r, int e=0) {
+			result = r; err = e; done = true;
+			return true;
+		}
+		bool progress() {
+			while(!done) {
+				char*  ptr;
+				size_t len;
+				if (got < sizeof(size_t)) {
+					ptr = (char*)&hdr + got;
+					len = sizeof(size_t) - got;
+				} else {
+					ptr = buff + (got - sizeof(size_t));
+					len = msgsz - (got - sizeof(size_t));
+				}
+				ssize_t r = h->readNonBlocking(ptr, len);
+				if (r < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+					if (errno == EINTR) continue;
+					if (errno != ECONNRESET) return complete(-1, errno);
+					r = 0;
+				}
+				if (r == 0) {
+					h->close(true, true);
+					return complete(0);
+				}
+				got += r;
+				if (got == sizeof(size_t)) {
+					msgsz = be64toh(hdr);
+					if (msgsz == 0) { // EOS received
+						h->close(false, true);
+						return complete(0);
+					}
+					if (msgsz > size) { // the message can be received later with a larger buffer
+						h->probed = {true, msgsz};
+						return complete(-1, ENOMEM);
+					}
+				}
+				if (got > sizeof(size_t) && got - sizeof(size_t) == msgsz)
+					return complete(msgsz);
+			}
+			return true;
+		}
+	public:
+		RecvRequest(HandleTCP* h, void* buff, size_t size) : h(h), buff((char*)buff), size(size) {}
+		bool test() { return done || progress(); }
+		void wait() {
+			if (!progress()) h->flush(); // the reply may depend on the coalesced sends
+			while(!progress()) {
+				struct pollfd pfd = {h->fd, POLLIN, 0};
+				::poll(&pfd, 1, -1);
+				if (pfd.revents & POLLERR) h->reapZerocopy();
+			}
+		}
+	};
+
+	std::mutex wmtx;                                  // protects pending and coalescer
+	std::deque<std::shared_ptr<SendRequest>> pending; // isend in progress
+	std::atomic<size_t> npending{0};
+	// Coalesced sends, enabled and disabled only by the owner. The pending
+	// isends and the coalesced bytes are never both non-empty: send writes
+	// the former before appending, isend flushes the latter before queueing.
+	SendCoalescer coalescer;
+	bool dirty = false; // counted in ConnTcp::ncoalesced
+
+	// MSG_ZEROCOPY. The kernel numbers the zerocopy calls of the socket,
+	// their completions are read from the error queue by the IO thread (or
+	// by whoever is waiting for them).
+	int zerocopy = 0;        // 1 SO_ZEROCOPY set, -1 not used (owner only)
+	uint32_t zcSent = 0;     // zerocopy calls, updated by the writer
+	std::mutex zmtx;         // protects the following
+	std::condition_variable zcv;
+	uint32_t zcDone = 0;     // the calls before zcDone have completed
+	std::map<uint32_t, uint32_t> zcRanges;            // completed out of order
+	std::deque<std::shared_ptr<SendRequest>> zcWait;  // isends written, pages still in use
+	std::atomic<bool> zcCopied{false}; // the kernel copied the data anyway
+
+	bool zcReached(uint32_t target) const { return (int32_t)(zcDone - target) >= 0; }
+
+	// reads the completions from the error queue, zmtx must be held
+	bool reapZerocopyLocked() {
+		char control[128];
+		bool reaped = false;
+		while(true) {
+			struct msghdr msg = {};
+			msg.msg_control    = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+				if (errno == EINTR) continue;
+				break;
+			}
+			for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+					!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+					continue;
+				struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cm);
+				if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0) continue;
+				if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zcCopied = true;
+				zcRanges[ee->ee_info] = ee->ee_data;  // [ee_info, ee_data]
+				reaped = true;
+			}
+		}
+		if (!reaped) return false;
+		for(auto it = zcRanges.find(zcDone); it != zcRanges.end(); it = zcRanges.find(zcDone)) {
+			zcDone = it->second + 1;
+			zcRanges.erase(it);
+		}
+		while(!zcWait.empty() && zcReached(zcWait.front()->zcTarget)) {
+			zcWait.front()->done.store(true, std::memory_order_release);
+			zcWait.pop_front();
+		}
+		zcv.notify_all();
+		return true;
+	}
+
+	// waits until the kernel has released the buffers of the zerocopy calls
+	// before target
+	void waitZerocopy(uint32_t target) {
+		int e = errno;
+		std::unique_lock lk(zmtx);
+		while(!zcReached(target)) {
+			if (reapZerocopyLocked()) continue;
+#if defined(SINGLE_IO_THREAD)
+			lk.unlock();
+			struct pollfd pfd = {fd, 0, 0}; // POLLERR is always reported
+			::poll(&pfd, 1, -1);
+			lk.lock();
+#else
+			// reaped by the IO thread, the timeout covers the case in which
+			// it has already stopped
+			zcv.wait_for(lk, std::chrono::milliseconds(1));
+#endif
+		}
+		errno = e;
+	}
+
+	inline bool useZerocopy(size_t size);
+
+	// a written isend is done, or it will be when the kernel releases its
+	// pages if it was sent with MSG_ZEROCOPY. wmtx must be held.
+	void finishSend(const std::shared_ptr<SendRequest>& req) {
+		if (req->zerocopy) {
+			std::unique_lock lk(zmtx);
+			req->zcTarget = zcSent;
+			if (!zcReached(zcSent)) {
+				zcWait.push_back(req);
+				return;
+			}
+		}
+		req->done.store(true, std::memory_order_release);
+	}
+
+	// updates the count of the handles the IO thread has to flush, wmtx
+	// must be held
+	inline void setDirty();
+
+	// writes the coalesced bytes in blocking mode, wmtx must be held
+	int flushCoalesced() {
+		size_t n = coalescer.pending();
+		if (n == 0) return 0;
+		ssize_t r = writen(fd, coalescer.data(), n);
+		coalescer.clear();
+		setDirty();
+		return r == (ssize_t)n ? 0 : -1;
+	}
+
+	// the message is appended to the coalescing buffer, if it does not fit
+	// it is written together with the buffered ones
+	ssize_t sendCoalesced(const struct iovec* iov, int iovcnt) {
+		if (npending) flushPending();
+		size_t size = iov_length(iov, iovcnt);
+		std::unique_lock lk(wmtx);
+		if (coalescer.append(iov, iovcnt, size)) {
+			setDirty();
+			return size;
+		}
+		size_t sz = htobe64(size);
+		// writevn modifies the array
+		struct iovec small[16];
+		std::vector<struct iovec> large;
+		struct iovec* v = small;
+		if (iovcnt+2 > 16) {
+			large.resize(iovcnt+2);
+			v = large.data();
+		}
+		v[0].iov_base = const_cast<char*>(coalescer.data());
+		v[0].iov_len  = coalescer.pending();
+		v[1].iov_base = &sz;
+		v[1].iov_len  = sizeof(sz);
+		std::copy(iov, iov+iovcnt, v+2);
+		ssize_t r = writevn(fd, v, iovcnt+2);
+		coalescer.clear();
+		setDirty();
+		if (r < 0) return -1;
+		return size;
+	}
+
+	// pipe of receiveToFile, created by the first call
+	int spipe[2] = {-1, -1};
+
+	// moves n bytes from the pipe to the file, with a copy if the file
+	// does not support splice
+	int drainPipe(int ffd, size_t n) {
+		while (n > 0) {
+			ssize_t r = splice(spipe[0], nullptr, ffd, nullptr, n, SPLICE_F_MOVE|SPLICE_F_MORE);
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0 && errno == EINVAL) {
+				char chunk[65536];
+				while (n > 0) {
+					ssize_t l = read(spipe[0], chunk, std::min(n, sizeof(chunk)));
+					if (l < 0 && errno == EINTR) continue;
+					if (l <= 0 || write_all(ffd, chunk, l) == -1) return -1;
+					n -= l;
+				}
+				return 0;
+			}
+			if (r <= 0) return -1;
+			n -= r;
+		}
+		return 0;
+	}
+
+	// writes the pending isends in blocking mode
+	void flushPending() {
+		std::unique_lock lk(wmtx);
+		while(!pending.empty()) {
+			auto& req = pending.front();
+			if (writevn(fd, req->iov + req->cur, 2 - req->cur, req->zerocopy) < 0) {
+				req->result = -1;
+				req->err = errno;
+			}
+			finishSend(req);
+			pending.pop_front();
+			--npending;
+		}
+	}
+
 public:
     int fd; // File descriptor of the connection represented by this Handle
     HandleTCP(ConnType* parent, int fd) : Handle(parent), fd(fd) {}
 
+	// bytes received from the socket and not consumed yet
+	size_t buffered() const { return rend - rpos; }
+
+	bool upgraded() const { return shmPath != nullptr; }
+	// a message is in the shared buffer
+	bool shmReady() { return shmPath && shmPath->in.peek() > 0; }
+
+	// connecting side of the upgrade: if the peer is on this host, the
+	// buffers are created and the token to be sent to the peer is returned
+	std::string shmOffer() {
+		if (!peerIsLocal() || openDoorbell() == -1) return "";
+		static std::atomic<unsigned> nextid{0};
+		std::string name = "/mtcl-up-" + std::to_string(getpid()) + "-" + std::to_string(nextid++);
+		auto p = std::make_unique<ShmPath>();
+		if (p->in.create(name + "-a") == -1) {
+			MTCL_TCP_PRINT(100, "HandleTCP::shmOffer cannot create %s-a, errno=%d\n", name.c_str(), errno);
+			return "";
+		}
+		if (p->out.create(name + "-b") == -1) {
+			MTCL_TCP_PRINT(100, "HandleTCP::shmOffer cannot create %s-b, errno=%d\n", name.c_str(), errno);
+			p->in.close(true);
+			return "";
+		}
+		shmOffered = std::move(p);
+		return bootId() + "|" + name;
+	}
+
+	// accepting side: the buffers offered by the peer are opened if it is
+	// on this host, 0 on success
+	int shmAccept(const std::string& token) {
+		auto c = token.find('|');
+		if (c == std::string::npos || token.substr(0, c) != bootId() || openDoorbell() == -1) return -1;
+		std::string name = token.substr(c+1);
+		auto p = std::make_unique<ShmPath>();
+		if (p->in.open(name + "-b") == -1 || p->out.open(name + "-a") == -1) {
+			MTCL_TCP_PRINT(100, "HandleTCP::shmAccept cannot open %s, errno=%d\n", name.c_str(), errno);
+			return -1;
+		}
+		shmOffered = std::move(p);
+		return 0;
+	}
+
+	// both sides, once the reply has been sent/received on the socket. The
+	// names are not needed anymore, the segments live as long as they are
+	// mapped.
+	void shmCommit(bool accepted) {
+		if (!shmOffered) return;
+		shm_unlink(shmOffered->in.name().c_str());
+		shm_unlink(shmOffered->out.name().c_str());
+		if (accepted) shmPath = std::move(shmOffered);
+		else shmOffered.reset();
+	}
+
+	// writes the pending isends without blocking, then it asks the IO thread
+	// to be called again when the socket is writable if needed
+	inline void drainPending();
+
+	// the doorbell of the protocol, where the input buffer of the upgraded
+	// connection is parked when it is yielded
+	inline int openDoorbell();
+
+	// called by the IO thread when the error queue is readable, false if it
+	// was empty
+	bool reapZerocopy() {
+		std::unique_lock lk(zmtx);
+		return reapZerocopyLocked();
+	}
+
+	std::shared_ptr<RequestImpl> isend(const void* buff, size_t size) {
+		if (shmPath) return Handle::isend(buff, size);
+		if (flush() == -1) return std::make_shared<CompletedRequest>(-1, errno);
+		auto req = std::make_shared<SendRequest>(this, buff, size);
+		req->zerocopy = useZerocopy(size);
+		{
+			std::unique_lock lk(wmtx);
+			pending.push_back(req);
+			++npending;
+		}
+		drainPending();
+		return req;
+	}
+
+	std::shared_ptr<RequestImpl> irecv(void* buff, size_t size) {
+		if (shmPath) return Handle::irecv(buff, size);
+		return std::make_shared<RecvRequest>(this, buff, size);
+	}
+
+	inline int setCoalescing(size_t size, long deadline_us);
+
+	int flush() {
+		if (!coalescer.enabled()) return 0;
+		std::unique_lock lk(wmtx);
+		return flushCoalesced();
+	}
+
+	// called by the IO thread, the expired coalesced bytes are written
+	// without blocking, the rest at the next call
+	void flushExpired(std::chrono::steady_clock::time_point now) {
+		std::unique_lock lk(wmtx, std::try_to_lock);
+		if (!lk.owns_lock() || !coalescer.expired(now)) return;
+		while(coalescer.pending() > 0) {
+			ssize_t r = ::send(fd, coalescer.data(), coalescer.pending(), MSG_DONTWAIT);
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				break; // errors are reported to the owner by the next flush
+			}
+			coalescer.consumed(r);
+		}
+		setDirty();
+	}
+
 	ssize_t sendEOS() {
+		if (npending) flushPending();
+		if (flush() == -1) return -1;
 		size_t sz = 0;
-		return writen(fd, (char*)&sz, sizeof(size_t)); 
+		ssize_t r = writen(fd, (char*)&sz, sizeof(size_t));
+		if (shmPath) shmPath->out.wakeConsumer(); // the peer may sleep in shmProbe
+		return r;
 	}
 	
     ssize_t send(const void* buff, size_t size) {
+		if (shmPath) return shmPath->out.put(buff, size);
+		if (coalescer.enabled()) {
+			struct iovec iov = {const_cast<void*>(buff), size};
+			return sendCoalesced(&iov, 1);
+		}
+		if (npending) flushPending(); // keeps the order with previous isends
 		size_t sz = htobe64(size);
         struct iovec iov[2];
         iov[0].iov_base = &sz;
@@ -101,27 +676,76 @@ public:
         iov[1].iov_base = const_cast<void*>(buff);
         iov[1].iov_len  = size;
 
-        if (writevn(fd, iov, 2) < 0)
-            return -1;
+		bool zc = useZerocopy(size);
+		ssize_t r = writevn(fd, iov, 2, zc);
+		if (zc) waitZerocopy(zcSent); // the caller can reuse the buffer
+		if (r < 0)
+			return -1;
 		return size;
     }
 
+	// header and buffers are written with a single writev
+	ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		if (shmPath) return shmPath->out.putv(iov, iovcnt);
+		if (coalescer.enabled()) return sendCoalesced(iov, iovcnt);
+		if (npending) flushPending();
+		size_t size = iov_length(iov, iovcnt);
+		size_t sz = htobe64(size);
+		// writevn modifies the array
+		struct iovec small[16];
+		std::vector<struct iovec> large;
+		struct iovec* v = small;
+		if (iovcnt+1 > 16) {
+			large.resize(iovcnt+1);
+			v = large.data();
+		}
+		v[0].iov_base = &sz;
+		v[0].iov_len  = sizeof(sz);
+		std::copy(iov, iov+iovcnt, v+1);
+		bool zc = useZerocopy(size);
+		ssize_t r = writevn(fd, v, iovcnt+1, zc);
+		if (zc) waitZerocopy(zcSent);
+		if (r < 0)
+			return -1;
+		return size;
+	}
+
 	// receives the header containing the size (sizeof(size_t) bytes)
 	ssize_t probe(size_t& size, const bool blocking=true) {
 		size_t sz;
 		ssize_t r;
+		if (shmPath) {
+			int s = shmProbe(size, blocking);
+			if (s == 1) return sizeof(size_t);
+			if (s == -1) {
+				errno = EWOULDBLOCK;
+				return -1;
+			}
+			// the EOS or the connection closed, from the socket
+		}
 		if (blocking) {
-			if ((r=readn(fd, (char*)&sz, sizeof(size_t)))<=0)
+			if (flush() == -1) return -1;
+			if ((r=readBuffered((char*)&sz, sizeof(size_t)))<=0)
 				return r;
 		} else {
-			if ((r=recv(fd, (char*)&sz, sizeof(size_t), MSG_DONTWAIT))<=0)
-				return r;
+			// a partially received header is kept in the buffer
+			if (buffered() < sizeof(size_t)) {
+				if ((r=fill(MSG_DONTWAIT))<=0)
+					return r;
+				if (buffered() < sizeof(size_t)) {
+					errno = EWOULDBLOCK;
+					return -1;
+				}
+			}
+			takeBuffered((char*)&sz, sizeof(size_t));
 		}
 		size = be64toh(sz);
 		return sizeof(size_t);
 	}
 
     bool peek() {
+        if (shmReady()) return true;
+        if (buffered() > 0) return true;
         size_t sz;
         ssize_t r = recv(fd, &sz, sizeof(size_t), MSG_PEEK | MSG_DONTWAIT);
     
@@ -129,16 +753,137 @@ public:
     }
 	
     ssize_t receive(void* buff, size_t size) {
-        return readn(fd, (char*)buff, size); 
+		if (shmPath) return shmPath->in.get(buff, size);
+        return readBuffered((char*)buff, size); 
     }
 
+	ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		if (shmPath) return shmPath->in.getv(iov, iovcnt);
+		// readvn modifies the array
+		struct iovec small[16];
+		std::vector<struct iovec> large;
+		struct iovec* v = small;
+		if (iovcnt > 16) {
+			large.resize(iovcnt);
+			v = large.data();
+		}
+		std::copy(iov, iov+iovcnt, v);
+		// the first bytes may be in the read-ahead buffer
+		int cur = 0;
+		while (cur < iovcnt && buffered() > 0) {
+			size_t l = takeBuffered((char*)v[cur].iov_base, v[cur].iov_len);
+			v[cur].iov_base = (char*)v[cur].iov_base + l;
+			v[cur].iov_len -= l;
+			if (v[cur].iov_len == 0) ++cur;
+		}
+		if (cur < iovcnt) {
+			ssize_t r = readvn(fd, v+cur, iovcnt-cur);
+			if (r <= 0) return r;
+		}
+		return iov_length(iov, iovcnt);
+	}
+
+	// the header is corked with MSG_MORE and the payload goes from the page
+	// cache to the socket with sendfile, files that sendfile does not
+	// support are read and written in chunks
+	ssize_t sendFile(int ffd, off_t off, size_t len) {
+		if (shmPath) return Handle::sendFile(ffd, off, len);
+		if (npending) flushPending();
+		if (flush() == -1) return -1;
+		size_t sz = htobe64(len);
+		for(size_t done = 0; done < sizeof(sz);) {
+			ssize_t r = ::send(fd, (char*)&sz + done, sizeof(sz) - done, MSG_MORE);
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			done += r;
+		}
+		// pipes are read at their current offset
+		bool seekable = lseek(ffd, 0, SEEK_CUR) != -1;
+		size_t done = 0;
+		while (done < len) {
+			ssize_t r = sendfile(fd, ffd, seekable ? &off : nullptr, len - done);
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS)) break;
+			if (r <= 0) {
+				if (r == 0) errno = EIO; // the file has been truncated
+				return -1;
+			}
+			done += r;
+		}
+		if (done < len) {
+			std::vector<char> chunk(std::min(len, (size_t)TCP_SPLICE_SIZE));
+			while (done < len) {
+				size_t l = std::min(len - done, chunk.size());
+				if (read_all(ffd, chunk.data(), l, seekable ? off : -1) == -1 ||
+					writen(fd, chunk.data(), l) != (ssize_t)l)
+					return -1;
+				off  += l;
+				done += l;
+			}
+		}
+		return len;
+	}
+
+	// the payload goes from the socket to the file through a pipe with
+	// splice (the read-ahead bytes are written first), or it is copied in
+	// chunks if the file does not support it
+	ssize_t receiveToFile(int ffd, size_t size) {
+		if (shmPath) return Handle::receiveToFile(ffd, size);
+		size_t done = std::min(size, buffered());
+		if (done > 0) {
+			if (write_all(ffd, rbuf.data() + rpos, done) == -1) return -1;
+			rpos += done;
+			if (rpos == rend) rpos = rend = 0;
+		}
+		if (done < size && spipe[0] == -1 && pipe2(spipe, O_CLOEXEC) == 0)
+			fcntl(spipe[1], F_SETPIPE_SZ, TCP_SPLICE_SIZE);
+		while (done < size && spipe[0] != -1) {
+			ssize_t r = splice(fd, nullptr, spipe[1], nullptr, std::min(size - done, (size_t)TCP_SPLICE_SIZE), SPLICE_F_MOVE|SPLICE_F_MORE);
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0 && errno == EINVAL) break;
+			if (r <= 0) {
+				if (r == 0) errno = ECONNRESET;
+				return -1;
+			}
+			if (drainPipe(ffd, r) == -1) { // the pipe may not be empty
+				int e = errno;
+				::close(spipe[0]);
+				::close(spipe[1]);
+				spipe[0] = spipe[1] = -1;
+				errno = e;
+				return -1;
+			}
+			done += r;
+		}
+		if (done < size) {
+			std::vector<char> chunk(std::min(size - done, (size_t)TCP_SPLICE_SIZE));
+			while (done < size) {
+				size_t l = std::min(size - done, chunk.size());
+				if (readBuffered(chunk.data(), l) != (ssize_t)l) {
+					if (errno == 0) errno = ECONNRESET;
+					return -1;
+				}
+				if (write_all(ffd, chunk.data(), l) == -1) return -1;
+				done += l;
+			}
+		}
+		return size;
+	}
 
-    ~HandleTCP() {}
+    ~HandleTCP() {
+		if (spipe[0] != -1) {
+			::close(spipe[0]);
+			::close(spipe[1]);
+		}
+	}
 
 };
 
 
 class ConnTcp : public ConnType {
+	friend class HandleTCP;
 private:
     // enum class ConnEvent {close, yield};
 
@@ -146,14 +891,38 @@ protected:
     std::string address;
     int port;
     
-    std::map<int, Handle*> connections;  // Active connections for this Connector
+    std::unordered_map<int, Handle*> connections;  // Active connections for this Connector
 
-    fd_set set, tmpset;
     int listen_sck;
-#if defined(SINGLE_IO_THREAD)
-	int fdmax;
-#else	
-    std::atomic<int> fdmax;
+    // Listening socket (level-triggered) and connections yielded to the IO
+    // thread (edge-triggered, one-shot). A descriptor is disarmed by the kernel
+    // when it becomes ready and re-armed by notify_yield.
+    int epfd = -1;
+    // connections with pending isends waiting for EPOLLOUT (one-shot), it is
+    // part of epfd
+    int wepfd = -1;
+    // connections that sent with MSG_ZEROCOPY, their completions are read
+    // from the error queue (edge-triggered, EPOLLERR), it is part of epfd
+    int zepfd = -1;
+    // yielded connections with a message already in the read-ahead buffer,
+    // epoll cannot report them. The eventfd is part of epfd, it also wakes
+    // up the IO thread when there are coalesced sends to be flushed.
+    std::vector<Handle*> readyBuffered;
+    int bfd = -1;
+    // handles with coalescing enabled and how many of them have bytes to be
+    // written at the deadline
+    std::vector<HandleTCP*> coalescing;
+    std::atomic<int> ncoalesced{0};
+    // Yielded connections upgraded to shared memory, their input buffers
+    // are parked on a doorbell (see ConnSHM) with the fd as id, their sockets
+    // are in epfd for the EOS. The doorbell is created by the first upgrade,
+    // it is part of epfd.
+    std::unordered_set<HandleTCP*> shmYielded;
+    int sbfd = -1;
+    std::string sbname;
+    shmBellFlag sbflag;
+    std::mutex sbmtx;
+#if !defined(SINGLE_IO_THREAD)
     std::shared_mutex shm;
 #endif
 
@@ -165,52 +934,198 @@ private:
      * @return int status code
      */
     int _init() {
-        if ((listen_sck=socket(AF_INET, SOCK_STREAM, 0)) < 0){
-			MTCL_TCP_PRINT(100, "ConnTcp::_init socket errno=%d\n", errno);
+        int fd;
+        if ((fd=internal_listen(address, port, TCP_BACKLOG)) < 0){
+			MTCL_TCP_PRINT(100, "ConnTcp::_init internal_listen errno=%d\n", errno);
             return -1;
         }
+		if (watchListener(fd) == -1) {
+			close(fd);
+			return -1;
+		}
+        return 0;
+    }
 
-        int enable = 1;
-        // enable the reuse of the address
-        if (setsockopt(listen_sck, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-			MTCL_TCP_PRINT(100, "ConnTcp::_init setsockopt errno=%d\n", errno);
-            return -1;
-        }
+	void drainWriters() {
+		struct epoll_event events[TCP_MAX_EVENTS];
+		int nready = epoll_wait(wepfd, events, TCP_MAX_EVENTS, 0);
+		// the lock prevents the handle from being closed and deleted meanwhile
+		REMOVE_CODE_IF(std::shared_lock slock(shm));
+		for(int i=0; i<nready; ++i) {
+			auto it = connections.find(events[i].data.fd);
+			if (it != connections.end())
+				reinterpret_cast<HandleTCP*>((*it).second)->drainPending();
+		}
+	}
+
+	void reapZerocopy() {
+		struct epoll_event events[TCP_MAX_EVENTS];
+		int nready = epoll_wait(zepfd, events, TCP_MAX_EVENTS, 0);
+		REMOVE_CODE_IF(std::shared_lock slock(shm));
+		for(int i=0; i<nready; ++i) {
+			auto it = connections.find(events[i].data.fd);
+			if (it != connections.end())
+				reinterpret_cast<HandleTCP*>((*it).second)->reapZerocopy();
+		}
+	}
+
+	void drainBuffered() {
+		eventfd_t v;
+		eventfd_read(bfd, &v);
+		std::vector<Handle*> ready;
+		{
+			REMOVE_CODE_IF(std::unique_lock lock(shm));
+			ready.swap(readyBuffered);
+		}
+		for(Handle* h : ready) addinQ(false, h);
+	}
 
-		struct addrinfo hints;
-		struct addrinfo *result, *rp;
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family   = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-		hints.ai_socktype = SOCK_STREAM;  /* Stream socket */
-		hints.ai_flags    = AI_PASSIVE;
-		hints.ai_protocol = IPPROTO_TCP;  /* Allow only TCP */
-		if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
-			MTCL_TCP_PRINT(100, "ConnTcp::_init getaddrinfo errno=%d\n", errno);		
+	// creates the doorbell of the upgraded connections the first time
+	int openShmBell() {
+		std::unique_lock lk(sbmtx);
+		if (sbfd != -1) return 0;
+		static std::atomic<int> nbells{0};
+		std::string name = "@mtcl-tcp-" + std::to_string(getpid()) + "-" + std::to_string(nbells++);
+		struct sockaddr_un sa;
+		socklen_t len;
+		int fd;
+		if ((fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1 ||
+			unix_address(name, sa, len) == -1 ||
+			bind(fd, (struct sockaddr*)&sa, len) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::openShmBell doorbell errno=%d\n", errno);
+			if (fd != -1) close(fd);
+			return -1;
+		}
+		if (sbflag.create(name) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::openShmBell doorbell flag errno=%d\n", errno);
+			close(fd);
+			return -1;
+		}
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::openShmBell epoll_ctl errno=%d\n", errno);
+			sbflag.close();
+			close(fd);
 			return -1;
 		}
+		sbname = name;
+		sbfd = fd;
+		return 0;
+	}
 
-		bool ok = false;
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			if (bind(listen_sck, rp->ai_addr, (int)rp->ai_addrlen) < 0){
-				MTCL_TCP_PRINT(100, "ConnTcp::_init bind errno=%d, continue\n", errno);
-				continue;
+	// rings our own doorbell
+	void ringShm(uint32_t id) {
+		struct sockaddr_un sa;
+		socklen_t len;
+		if (unix_address(sbname, sa, len) == 0)
+			sendto(sbfd, &id, sizeof(id), MSG_DONTWAIT, (struct sockaddr*)&sa, len);
+	}
+
+	// a yielded upgraded connection whose doorbell rang, shm must be held.
+	// The ring might be spurious (e.g., from before a yield or for a reused
+	// fd), the buffer is parked again if it is still empty.
+	bool rungShm(HandleTCP* h) {
+		auto& in = h->shmPath->in;
+		if (in.peek() == 0 && !in.park(sbname, h->fd)) return false;
+		in.unpark();
+		shmYielded.erase(h);
+		// the EOS must not report it again
+		struct epoll_event ev = {};
+		ev.data.fd = h->fd;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, h->fd, &ev);
+		return true;
+	}
+
+	void drainShm() {
+		std::vector<uint32_t> ids;
+		uint32_t id;
+		while(recv(sbfd, &id, sizeof(id), 0) == sizeof(id)) ids.push_back(id);
+		std::vector<Handle*> ready;
+		{
+			REMOVE_CODE_IF(std::unique_lock lock(shm));
+			for(uint32_t fd : ids) {
+				auto it = connections.find(fd);
+				if (it == connections.end()) continue;
+				HandleTCP* h = reinterpret_cast<HandleTCP*>((*it).second);
+				if (shmYielded.count(h) && rungShm(h)) ready.push_back(h);
 			}
-			ok = true;
-			break;
+			// the peers that could not ring the doorbell raised its flag
+			if (sbflag.raised())
+				for(auto it = shmYielded.begin(); it != shmYielded.end();) {
+					HandleTCP* h = *it++;
+					if (h->shmPath->in.overflowed() && rungShm(h)) ready.push_back(h);
+				}
 		}
-		free(result);
-		if (!ok) {
-			MTCL_TCP_PRINT(100, "ConnTcp::_init bind loop exit with errno=%d\n", errno);
+		for(Handle* h : ready) addinQ(false, h);
+	}
+
+	// h is not yielded anymore, shm must be held
+	void unwatchShm(HandleTCP* h) {
+		if (shmYielded.erase(h)) h->shmPath->in.unpark();
+	}
+
+	void flushExpired() {
+		auto now = std::chrono::steady_clock::now();
+		// the lock prevents the handles from being closed and deleted meanwhile
+		REMOVE_CODE_IF(std::shared_lock slock(shm));
+		for(HandleTCP* h : coalescing) h->flushExpired(now);
+	}
+
+	void watchCoalescing(HandleTCP* h, bool enable) {
+		REMOVE_CODE_IF(std::unique_lock lock(shm));
+		auto it = std::find(coalescing.begin(), coalescing.end(), h);
+		if (enable && it == coalescing.end()) coalescing.push_back(h);
+		if (!enable && it != coalescing.end()) coalescing.erase(it);
+	}
+
+protected:
+
+	// fd is a listening stream socket, its connections are accepted by update
+	int watchListener(int fd) {
+		// pending connections are accepted in a loop up to EAGAIN
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+			MTCL_TCP_PRINT(100, "ConnTcp::watchListener fcntl errno=%d\n", errno);
 			return -1;
 		}
-        if (::listen(listen_sck, TCP_BACKLOG) < 0){
-			MTCL_TCP_PRINT(100, "ConnTcp::_init listen errno=%d\n", errno);
-            return -1;
-        }
+		struct epoll_event ev;
+		ev.events  = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::watchListener epoll_ctl errno=%d\n", errno);
+			return -1;
+		}
+		listen_sck = fd;
+		return 0;
+	}
 
-        return 0;
-    }
+	// fd is a connected stream socket
+	Handle* newHandle(int fd) { return addHandle(new HandleTCP(this, fd)); }
 
+	Handle* addHandle(HandleTCP* handle) {
+		{
+			REMOVE_CODE_IF(std::unique_lock lock(shm));
+			connections[handle->fd] = handle;
+		}
+        return handle;
+	}
+
+	// a connection has been accepted, its handle goes through the handshake
+	virtual void accepted(int fd) { addinQ(true, newHandle(fd)); }
+
+	// fd is in epfd but it is not a connection, a subclass has added it
+	virtual void readable(int) {}
+
+private:
+
+	void acceptAll() {
+		int connfd;
+		while((connfd = accept(this->listen_sck, (struct sockaddr*)NULL ,NULL)) != -1)
+			accepted(connfd);
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			MTCL_TCP_ERROR("ConnTcp::update accept ERROR: errno=%d -- %s\n", errno, strerror(errno));
+	}
 
 public:
 
@@ -218,16 +1133,74 @@ public:
    ~ConnTcp(){};
 
     int init(std::string) {
-		// For clients who do just connect, the communication thread anyway calls
-		// the update method, and we do not want to call the select function with
-		// invalid fields.
-        FD_ZERO(&set);
-        FD_ZERO(&tmpset);
 		listen_sck=-1;
-		fdmax = -1;
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::init epoll_create1 errno=%d\n", errno);
+			return -1;
+		}
+		if ((wepfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::init epoll_create1 errno=%d\n", errno);
+			return -1;
+		}
+		struct epoll_event ev;
+		ev.events  = EPOLLIN;
+		ev.data.fd = wepfd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, wepfd, &ev) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::init epoll_ctl errno=%d\n", errno);
+			return -1;
+		}
+		if ((zepfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::init epoll_create1 errno=%d\n", errno);
+			return -1;
+		}
+		ev.events  = EPOLLIN;
+		ev.data.fd = zepfd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, zepfd, &ev) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::init epoll_ctl errno=%d\n", errno);
+			return -1;
+		}
+		if ((bfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::init eventfd errno=%d\n", errno);
+			return -1;
+		}
+		ev.events  = EPOLLIN;
+		ev.data.fd = bfd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, bfd, &ev) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::init epoll_ctl errno=%d\n", errno);
+			return -1;
+		}
         return 0;
     }
 
+	// the IO thread has to drain the pending isends of fd when it is writable
+	void watchWrite(int fd) {
+		struct epoll_event ev;
+		ev.events  = EPOLLOUT | EPOLLONESHOT;
+		ev.data.fd = fd;
+		if (epoll_ctl(wepfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+			if (errno != ENOENT ||
+				epoll_ctl(wepfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+				MTCL_TCP_ERROR("ConnTcp::watchWrite epoll_ctl ERROR: errno=%d -- %s\n", errno, strerror(errno));
+		}
+	}
+
+	// the IO thread reads the zerocopy completions of fd
+	void watchZerocopy(int fd) {
+		struct epoll_event ev;
+		ev.events  = EPOLLERR | EPOLLET;
+		ev.data.fd = fd;
+		if (epoll_ctl(zepfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			MTCL_TCP_ERROR("ConnTcp::watchZerocopy epoll_ctl ERROR: errno=%d -- %s\n", errno, strerror(errno));
+	}
+
+	int getPollFd() { return epfd; }
+
+	// the coalesced sends are written by update when their deadline
+	// expires, the shared buffers cannot notify the IO thread
+	bool arm() {
+		return epfd != -1 && ncoalesced.load(std::memory_order_relaxed) == 0;
+	}
+
     int listen(std::string s) {
         address = s.substr(0, s.find(":"));
         port = stoi(s.substr(address.length()+1));
@@ -237,87 +1210,68 @@ public:
 		}
 		
         MTCL_TCP_PRINT(1, "listen to %s:%d\n", address.c_str(),port);
-
-        // intialize both sets (master, temp)
-        FD_ZERO(&set);
-        FD_ZERO(&tmpset);
-
-        // add the listen socket to the master set
-        FD_SET(this->listen_sck, &set);
-
-        // hold the greater descriptor
-        fdmax = this->listen_sck;
-
         return 0;
     }
 
     void update() {
-        // copy the master set to the temporary
-
-        REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));
-
-        REMOVE_CODE_IF(ulock.lock());
-        tmpset = set;
-        REMOVE_CODE_IF(ulock.unlock());
-
-        struct timeval wait_time = {.tv_sec=0, .tv_usec=TCP_POLL_TIMEOUT};
-		int nready=0;
-		if (fdmax==-1) return;
-        switch(nready=select(fdmax+1, &tmpset, NULL, NULL, &wait_time)) {
-		case -1: {
-			// NOTE: EBADF can happen because we may close an fd that is in the set
-			if (errno==EBADF) {
-				MTCL_TCP_PRINT(100, "ConnTcp::update select ERROR: errno=EBADF\n");
-				return;
-			}			
-			MTCL_TCP_ERROR("ConnTcp::update select ERROR: errno=%d -- %s\n", errno, strerror(errno));
+		if (ncoalesced.load(std::memory_order_relaxed) > 0) flushExpired();
+
+		struct epoll_event events[TCP_MAX_EVENTS];
+		int nready = epoll_wait(epfd, events, TCP_MAX_EVENTS, 0);
+		if (nready == -1) {
+			if (errno != EINTR)
+				MTCL_TCP_ERROR("ConnTcp::update epoll_wait ERROR: errno=%d -- %s\n", errno, strerror(errno));
+			return;
 		}
-		case  0: return;
-        }
 
-        for(int idx=0; idx <= fdmax && nready>0; idx++){
-            if (FD_ISSET(idx, &tmpset)){
-                if (idx == this->listen_sck) {
-                    int connfd = accept(this->listen_sck, (struct sockaddr*)NULL ,NULL);
-                    if (connfd == -1){
-						MTCL_TCP_ERROR("ConnTcp::update accept ERROR: errno=%d -- %s\n", errno, strerror(errno));
-                        return;
-                    }
-
-                    REMOVE_CODE_IF(ulock.lock());
-                    // FD_SET(connfd, &set);
-                    // if(connfd > fdmax) {
-					// 	fdmax = connfd;
-					// }
-                    connections[connfd] = new HandleTCP(this, connfd);
-					addinQ(true, connections[connfd]);
-					REMOVE_CODE_IF(ulock.unlock());                    
-                } else {
-                    REMOVE_CODE_IF(ulock.lock());
-
-					
-                    // Updates ready connections and removes from listening
-                    FD_CLR(idx, &set);
-
-                    // update the maximum file descriptor
-                    if (idx == fdmax) {
-						int ii;
-                        for(ii=(fdmax-1);ii>=0;--ii) {
-                            if (FD_ISSET(ii, &set)){
-                                fdmax = ii;
-                                break;
-                            }
-                        }
-						if (ii==-1) fdmax = -1;
-					}
-					auto it = connections.find(idx);
-					if (it != connections.end()) {
-						addinQ(false, (*it).second);
-					}
-                    REMOVE_CODE_IF(ulock.unlock());
-                }
-				--nready;
-            }
+        for(int i=0; i<nready; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == this->listen_sck) {
+				acceptAll();
+				continue;
+			}
+			if (fd == wepfd) {
+				drainWriters();
+				continue;
+			}
+			if (fd == bfd) {
+				drainBuffered();
+				continue;
+			}
+			if (fd == zepfd) {
+				reapZerocopy();
+				continue;
+			}
+			if (fd == sbfd) {
+				drainShm();
+				continue;
+			}
+			// the descriptor has been disarmed (EPOLLONESHOT), the handle
+			// goes back to the user until the next yield. Nobody else can
+			// close it meanwhile, thus addinQ is called without the lock.
+			Handle* h = nullptr;
+			{
+				REMOVE_CODE_IF(std::shared_lock slock(shm));
+				auto it = connections.find(fd);
+				if (it != connections.end()) h = (*it).second;
+			}
+			if (!h) {
+				readable(fd);
+				continue;
+			}
+			if (reinterpret_cast<HandleTCP*>(h)->upgraded()) {
+				REMOVE_CODE_IF(std::unique_lock lock(shm));
+				unwatchShm(reinterpret_cast<HandleTCP*>(h));
+			}
+			// only zerocopy completions in the error queue, the handle stays
+			// with the IO thread (even if a user thread in waitZerocopy has
+			// already reaped them)
+			if (!(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLRDHUP))) {
+				reinterpret_cast<HandleTCP*>(h)->reapZerocopy();
+				notify_yield(h);
+				continue;
+			}
+			addinQ(false, h);
         }
     }
 
@@ -328,17 +1282,12 @@ public:
 		if (fd == -1) {
 			return nullptr;
 		}
-		
-        HandleTCP *handle = new HandleTCP(this, fd);
-		{
-			REMOVE_CODE_IF(std::unique_lock lock(shm));
-			connections[fd] = handle;
-		}
-        return handle;
+		return newHandle(fd);
     }
 
     void notify_close(Handle* h, bool close_wr=true, bool close_rd=true) {
 		HandleTCP *handle = reinterpret_cast<HandleTCP*>(h);
+		if (close_wr && close_rd) watchCoalescing(handle, false);
 		if (close_wr) {
 			if (handle->fd != -1) {
 				shutdown(handle->fd, SHUT_WR);
@@ -361,21 +1310,11 @@ public:
 			{
 				REMOVE_CODE_IF(std::unique_lock lock(shm));
 				connections.erase(fd);
-				FD_CLR(fd, &set);
-				
-				// update the maximum file descriptor
-				if (fd == fdmax) {
-					int ii;
-					for(ii=(fdmax-1);ii>=0;--ii) {
-						if (FD_ISSET(ii, &set)){
-							fdmax = ii;
-							break;
-						}
-					}
-					// the listen socket might not be in the set, thus without the following
-					// we risk to leave fdmax set to the old value.
-					if (ii==-1) fdmax = -1; 
-				}
+				unwatchShm(handle);
+				if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1 && errno != ENOENT)
+					MTCL_TCP_PRINT(100, "ConnTcp::notify_close epoll_ctl errno=%d\n", errno);
+				epoll_ctl(wepfd, EPOLL_CTL_DEL, fd, NULL);
+				epoll_ctl(zepfd, EPOLL_CTL_DEL, fd, NULL);
 			}
 			if (close_wr) {
 				close(fd);
@@ -390,10 +1329,28 @@ public:
 		if (fd==-1) return;
 		REMOVE_CODE_IF(std::unique_lock l(shm));
 		if (h->isClosed()) return;
-        FD_SET(fd, &set);
-        if(fd > fdmax) {
-            fdmax = fd;
-        }
+		if (reinterpret_cast<HandleTCP*>(h)->buffered() >= sizeof(size_t)) {
+			// the header is already in the read-ahead buffer, the socket
+			// might have nothing more to report
+			readyBuffered.push_back(h);
+			eventfd_write(bfd, 1);
+			return;
+		}
+		if (reinterpret_cast<HandleTCP*>(h)->upgraded()) {
+			HandleTCP* th = reinterpret_cast<HandleTCP*>(h);
+			shmYielded.insert(th);
+			// the IO thread gets the messages already there from the doorbell
+			if (th->shmPath->in.park(sbname, fd)) ringShm(fd);
+		}
+		// if data is already there the event is reported by the next epoll_wait
+		struct epoll_event ev;
+		ev.events  = EPOLLIN | EPOLLET | EPOLLONESHOT;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+			if (errno != ENOENT ||
+				epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+				MTCL_TCP_ERROR("ConnTcp::notify_yield epoll_ctl ERROR: errno=%d -- %s\n", errno, strerror(errno));
+		}
     }
 
     void end(bool blockflag=false) {
@@ -401,13 +1358,113 @@ public:
         for(auto& [fd, h] : modified_connections) {
 			setAsClosed(h, blockflag);
 		}
-    }
-
-    bool isSet(int fd){
-        REMOVE_CODE_IF(std::shared_lock s(shm));
-        return FD_ISSET(fd, &set);
+		if (epfd != -1) {
+			close(epfd);
+			epfd = -1;
+		}
+		if (wepfd != -1) {
+			close(wepfd);
+			wepfd = -1;
+		}
+		if (zepfd != -1) {
+			close(zepfd);
+			zepfd = -1;
+		}
+		if (bfd != -1) {
+			close(bfd);
+			bfd = -1;
+		}
+		if (sbfd != -1) {
+			close(sbfd);
+			sbfd = -1;
+		}
+		sbflag.close();
     }
 
 };
 
+// SO_ZEROCOPY is set by the first send above the threshold. The kernel
+// copies the data anyway on some paths (e.g., loopback), then the zerocopy
+// only adds the notifications and it is not used anymore.
+inline bool HandleTCP::useZerocopy(size_t size) {
+	if (TCP_ZEROCOPY_THRESHOLD == 0 || size < TCP_ZEROCOPY_THRESHOLD || zerocopy < 0)
+		return false;
+	if (zcCopied.load(std::memory_order_relaxed)) {
+		zerocopy = -1;
+		return false;
+	}
+	if (zerocopy == 0) {
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+			MTCL_TCP_PRINT(100, "HandleTCP::useZerocopy setsockopt errno=%d\n", errno);
+			zerocopy = -1;
+			return false;
+		}
+		static_cast<ConnTcp*>(parent)->watchZerocopy(fd);
+		zerocopy = 1;
+	}
+	return true;
+}
+
+inline void HandleTCP::setDirty() {
+	bool d = coalescer.pending() > 0 && coalescer.timed();
+	if (d == dirty) return;
+	dirty = d;
+	ConnTcp* conn = static_cast<ConnTcp*>(parent);
+	// the IO thread may be blocked, it must poll until the deadline
+	if (conn->ncoalesced.fetch_add(d ? 1 : -1, std::memory_order_relaxed) == 0)
+		eventfd_write(conn->bfd, 1);
+}
+
+inline int HandleTCP::setCoalescing(size_t size, long deadline_us) {
+	if (npending) flushPending();
+	{
+		std::unique_lock lk(wmtx);
+		if (flushCoalesced() == -1) return -1;
+		coalescer.set(size, deadline_us);
+	}
+	static_cast<ConnTcp*>(parent)->watchCoalescing(this, size > 0);
+	return 0;
+}
+
+inline int HandleTCP::openDoorbell() {
+	return static_cast<ConnTcp*>(parent)->openShmBell();
+}
+
+inline void HandleTCP::drainPending() {
+	std::unique_lock lk(wmtx);
+	bool zcFull = false; // too many notifications pending, the data is copied
+	while(!pending.empty()) {
+		auto& req = pending.front();
+		struct msghdr msg = {};
+		msg.msg_iov    = req->iov + req->cur;
+		msg.msg_iovlen = 2 - req->cur;
+		const bool zc = req->zerocopy && !zcFull;
+		ssize_t written = sendmsg(fd, &msg, MSG_DONTWAIT | (zc ? MSG_ZEROCOPY : 0));
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			if (errno == ENOBUFS && zc) {
+				zcFull = true;
+				continue;
+			}
+			req->result = -1;
+			req->err = errno;
+		} else {
+			if (zc) ++zcSent;
+			while (req->cur < 2 && written >= (ssize_t)req->iov[req->cur].iov_len)
+				written -= req->iov[req->cur++].iov_len;
+			if (req->cur < 2) {
+				req->iov[req->cur].iov_base = (char*)req->iov[req->cur].iov_base + written;
+				req->iov[req->cur].iov_len -= written;
+				continue;
+			}
+		}
+		finishSend(req);
+		pending.pop_front();
+		--npending;
+	}
+	if (!pending.empty()) static_cast<ConnTcp*>(parent)->watchWrite(fd);
+}
+
 #endif
@@ -0,0 +1,443 @@
+#ifndef TCP_STRIPED_HPP
+#define TCP_STRIPED_HPP
+
+/*
+ * Multi-rail TCP, registered as "STCP" (addresses STCP:host:port). A
+ * connection is made of STCP_RAILS sockets to the same peer: the first one
+ * is a regular ConnTcp connection (handshake, small messages, EOS, yield),
+ * the others only carry the payloads of at least STCP_THRESHOLD bytes. Such
+ * a payload is split into one chunk per socket, the first chunk follows the
+ * size header on the first socket and the others are written and read in
+ * parallel by one thread per additional socket. The chunks are in the same
+ * order on all the sockets, thus they are reassembled without any further
+ * header.
+ *
+ * Each socket starts with a Hello identifying the connection it belongs to,
+ * the connection is handed to the Manager once all its sockets have been
+ * accepted. STCP peers cannot be connected to TCP peers.
+ */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "tcp.hpp"
+
+
+class HandleTCPStriped : public HandleTCP {
+	friend class ConnTcpStriped;
+
+	// one additional socket, its thread reads or writes one chunk at a time
+	class Rail {
+		enum { IDLE, SEND, RECV, STOP };
+		std::thread th;
+		std::mutex mtx;
+		std::condition_variable cv;
+		int op = IDLE;
+		std::vector<struct iovec> v;
+		ssize_t result = 0;
+		int err = 0;
+
+		// moves all the bytes described by v
+		ssize_t transfer(bool send) {
+			for(size_t cur = 0; cur < v.size();) {
+				int n = std::min(v.size() - cur, (size_t)IOV_MAX);
+				ssize_t r = send ? writev(fd, &v[cur], n) : readv(fd, &v[cur], n);
+				if (r < 0) {
+					if (errno == EINTR) continue;
+					return -1;
+				}
+				if (r == 0) {
+					errno = ECONNRESET;
+					return -1;
+				}
+				while (cur < v.size() && r >= (ssize_t)v[cur].iov_len)
+					r -= v[cur++].iov_len;
+				if (cur < v.size()) {
+					v[cur].iov_base = (char*)v[cur].iov_base + r;
+					v[cur].iov_len -= r;
+				}
+			}
+			return 0;
+		}
+
+		void run() {
+			std::unique_lock lk(mtx);
+			while(true) {
+				cv.wait(lk, [&]{ return op != IDLE; });
+				if (op == STOP) return;
+				bool send = op == SEND;
+				lk.unlock();
+				ssize_t r = transfer(send);
+				int e = errno;
+				lk.lock();
+				result = r;
+				err = e;
+				op = IDLE;
+				cv.notify_all();
+			}
+		}
+	public:
+		int fd = -1;
+
+		// the thread is started by the first chunk
+		void post(bool send, std::vector<struct iovec>&& chunk) {
+			std::unique_lock lk(mtx);
+			if (!th.joinable()) th = std::thread([this]{ run(); });
+			v = std::move(chunk);
+			op = send ? SEND : RECV;
+			cv.notify_all();
+		}
+
+		ssize_t wait() {
+			std::unique_lock lk(mtx);
+			cv.wait(lk, [&]{ return op == IDLE; });
+			errno = err;
+			return result;
+		}
+
+		~Rail() {
+			if (th.joinable()) {
+				{
+					std::unique_lock lk(mtx);
+					op = STOP;
+					cv.notify_all();
+				}
+				th.join();
+			}
+			if (fd != -1) ::close(fd);
+		}
+	};
+
+	std::vector<std::unique_ptr<Rail>> rails;
+	size_t attached = 0;   // rails accepted (accepting side)
+	size_t striped = 0;    // size of the striped message probed, not received yet
+
+	// the chunks go to the rails first, chunk 0 is moved by the caller
+	void postChunks(bool send, const struct iovec* iov, int iovcnt, size_t size) {
+		size_t chunk = (size + rails.size()) / (rails.size() + 1);
+		for(size_t i=0; i<rails.size(); ++i) {
+			size_t off = (i+1) * chunk;
+			std::vector<struct iovec> v;
+			if (off < size) iov_slice(v, iov, iovcnt, off, std::min(chunk, size - off));
+			rails[i]->post(send, std::move(v));
+		}
+	}
+
+	ssize_t waitChunks(ssize_t r) {
+		int e = errno;
+		for(auto& rail : rails)
+			if (rail->wait() == -1 && r != -1) {
+				r = -1;
+				e = errno;
+			}
+		errno = e;
+		return r;
+	}
+
+	bool stripe(size_t size) const { return !rails.empty() && size >= STCP_THRESHOLD && !upgraded(); }
+
+	ssize_t sendStriped(const struct iovec* iov, int iovcnt, size_t size) {
+		if (npending) flushPending(); // keeps the order with previous isends
+		if (flush() == -1) return -1;
+		postChunks(true, iov, iovcnt, size);
+		size_t chunk = (size + rails.size()) / (rails.size() + 1);
+		size_t sz = htobe64(size);
+		std::vector<struct iovec> v;
+		iov_slice(v, iov, iovcnt, 0, chunk);
+		v.insert(v.begin(), {&sz, sizeof(sz)});
+		ssize_t r = writevn(fd, v.data(), v.size()) < 0 ? -1 : (ssize_t)size;
+		return waitChunks(r);
+	}
+
+	ssize_t receiveStriped(const struct iovec* iov, int iovcnt, size_t size) {
+		striped = 0;
+		postChunks(false, iov, iovcnt, size);
+		size_t chunk = (size + rails.size()) / (rails.size() + 1);
+		std::vector<struct iovec> v;
+		iov_slice(v, iov, iovcnt, 0, chunk);
+		ssize_t r = size;
+		for(auto& e : v)
+			if (readBuffered((char*)e.iov_base, e.iov_len) != (ssize_t)e.iov_len) {
+				if (errno == 0) errno = ECONNRESET;
+				r = -1;
+				break;
+			}
+		return waitChunks(r);
+	}
+
+public:
+	HandleTCPStriped(ConnType* parent, int fd, size_t nrails) : HandleTCP(parent, fd) {
+		for(size_t i=0; i<nrails; ++i) rails.push_back(std::make_unique<Rail>());
+	}
+
+	ssize_t send(const void* buff, size_t size) {
+		if (!stripe(size)) return HandleTCP::send(buff, size);
+		struct iovec iov = {const_cast<void*>(buff), size};
+		return sendStriped(&iov, 1, size);
+	}
+
+	ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		size_t size = iov_length(iov, iovcnt);
+		if (!stripe(size)) return HandleTCP::sendv(iov, iovcnt);
+		return sendStriped(iov, iovcnt, size);
+	}
+
+	// the large messages are sent by the caller
+	std::shared_ptr<RequestImpl> isend(const void* buff, size_t size) {
+		if (!stripe(size)) return HandleTCP::isend(buff, size);
+		return Handle::isend(buff, size);
+	}
+
+	std::shared_ptr<RequestImpl> irecv(void* buff, size_t size) {
+		if (rails.empty() || upgraded()) return HandleTCP::irecv(buff, size);
+		return Handle::irecv(buff, size);
+	}
+
+	ssize_t probe(size_t& size, const bool blocking=true) {
+		ssize_t r = HandleTCP::probe(size, blocking);
+		if (r > 0 && stripe(size)) striped = size;
+		return r;
+	}
+
+	ssize_t receive(void* buff, size_t size) {
+		if (!striped) return HandleTCP::receive(buff, size);
+		struct iovec iov = {buff, size};
+		return receiveStriped(&iov, 1, striped);
+	}
+
+	ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		if (!striped) return HandleTCP::receivev(iov, iovcnt);
+		return receiveStriped(iov, iovcnt, striped);
+	}
+
+	// the striped payloads go through a mapping of the file
+	ssize_t sendFile(int ffd, off_t off, size_t len) {
+		if (!stripe(len)) return HandleTCP::sendFile(ffd, off, len);
+		return Handle::sendFile(ffd, off, len);
+	}
+
+	ssize_t receiveToFile(int ffd, size_t size) {
+		if (!striped) return HandleTCP::receiveToFile(ffd, size);
+		return Handle::receiveToFile(ffd, size);
+	}
+};
+
+
+class ConnTcpStriped : public ConnTcp {
+	// first bytes written on each socket, in network byte order
+	struct Hello {
+		uint64_t session;
+		uint32_t rail;    // 0 for the first socket
+		uint32_t nrails;  // additional sockets
+	};
+
+	using clock = std::chrono::steady_clock;
+
+	// accepted sockets, from the accept up to their Hello. The first socket
+	// of a connection is removed when its Hello is complete, an additional
+	// socket when the first one of its session has been read.
+	struct Pending {
+		Hello hello;
+		size_t got = 0;
+		bool watched = false;  // in epfd, waiting for the rest of the Hello
+		clock::time_point deadline;
+	};
+	std::unordered_map<int, Pending> pending;
+
+	// connections whose additional sockets have not been accepted yet
+	struct Incomplete {
+		HandleTCPStriped* handle;
+		clock::time_point deadline;
+	};
+	std::unordered_map<uint64_t, Incomplete> incomplete;
+
+	static int sendHello(int fd, uint64_t session, uint32_t rail, uint32_t nrails) {
+		Hello hello = {htobe64(session), htonl(rail), htonl(nrails)};
+		return ::send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello) ? 0 : -1;
+	}
+
+	// reads what the peer has written of the Hello without blocking, 1 when
+	// it is complete, -1 if the socket has to be closed
+	static int recvHello(int fd, Pending& p) {
+		while (p.got < sizeof(Hello)) {
+			ssize_t r = recv(fd, (char*)&p.hello + p.got, sizeof(Hello) - p.got, MSG_DONTWAIT);
+			if (r == 0) {
+				errno = ECONNRESET;
+				return -1;
+			}
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+			}
+			p.got += r;
+		}
+		p.hello.session = be64toh(p.hello.session);
+		p.hello.rail    = ntohl(p.hello.rail);
+		p.hello.nrails  = ntohl(p.hello.nrails);
+		return 1;
+	}
+
+	void unwatch(int fd, Pending& p) {
+		if (p.watched && epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+			MTCL_TCP_PRINT(100, "ConnTcpStriped::unwatch epoll_ctl errno=%d\n", errno);
+		p.watched = false;
+	}
+
+	void discard(int fd) {
+		unwatch(fd, pending[fd]);
+		pending.erase(fd);
+		close(fd);
+	}
+
+	// the Hello of fd is complete
+	void hello(int fd, Pending& p) {
+		unwatch(fd, p);
+		// accepted sockets inherit O_NONBLOCK from the listener on some systems
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+		const Hello hello = p.hello;
+		if (hello.rail > 0) {
+			auto it = incomplete.find(hello.session);
+			// the first socket may be read after this one
+			if (it == incomplete.end()) return;
+			HandleTCPStriped* handle = it->second.handle;
+			if (hello.rail > handle->rails.size() || handle->rails[hello.rail-1]->fd != -1) {
+				MTCL_TCP_PRINT(100, "ConnTcpStriped::hello unexpected socket %u of %lx\n", hello.rail, hello.session);
+				discard(fd);
+				return;
+			}
+			handle->rails[hello.rail-1]->fd = fd;
+			pending.erase(fd);
+			if (++handle->attached < handle->rails.size()) return;
+			incomplete.erase(it);
+			addinQ(true, addHandle(handle));
+			return;
+		}
+		if (hello.nrails > 1024) {
+			discard(fd);
+			return;
+		}
+		auto* handle = new HandleTCPStriped(this, fd, hello.nrails);
+		pending.erase(fd);
+		if (hello.nrails == 0) {
+			addinQ(true, addHandle(handle));
+			return;
+		}
+		incomplete[hello.session] = {handle, clock::now() + std::chrono::milliseconds(STCP_HELLO_TIMEOUT)};
+		// the additional sockets already read
+		std::vector<int> early;
+		for(auto& [rfd, rp] : pending)
+			if (rp.got == sizeof(Hello) && rp.hello.session == hello.session) early.push_back(rfd);
+		for(int rfd : early) {
+			auto it = pending.find(rfd);
+			if (it != pending.end()) this->hello(rfd, it->second);
+		}
+	}
+
+	// the sockets and the connections that did not complete in time are closed
+	void expire() {
+		auto now = clock::now();
+		std::vector<int> fds;
+		for(auto& [fd, p] : pending)
+			if (p.deadline < now) fds.push_back(fd);
+		for(int fd : fds) {
+			MTCL_TCP_PRINT(100, "ConnTcpStriped::expire socket %d without a session\n", fd);
+			discard(fd);
+		}
+		for(auto it = incomplete.begin(); it != incomplete.end(); ) {
+			if (it->second.deadline >= now) {
+				++it;
+				continue;
+			}
+			MTCL_TCP_PRINT(100, "ConnTcpStriped::expire session %lx without all its sockets\n", it->first);
+			close(it->second.handle->fd);
+			delete it->second.handle;
+			it = incomplete.erase(it);
+		}
+	}
+
+protected:
+	// the Hello is read by update when the socket becomes readable
+	void accepted(int fd) {
+		Pending& p = pending[fd];
+		p.deadline = clock::now() + std::chrono::milliseconds(STCP_HELLO_TIMEOUT);
+		int r = recvHello(fd, p);
+		if (r == 1) {
+			hello(fd, p);
+			return;
+		}
+		struct epoll_event ev;
+		ev.events  = EPOLLIN;
+		ev.data.fd = fd;
+		if (r == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcpStriped::accepted invalid hello, errno=%d\n", errno);
+			discard(fd);
+			return;
+		}
+		p.watched = true;
+	}
+
+	void readable(int fd) {
+		auto it = pending.find(fd);
+		if (it == pending.end() || !it->second.watched) return;
+		int r = recvHello(fd, it->second);
+		if (r == 1) hello(fd, it->second);
+		else if (r == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcpStriped::readable invalid hello, errno=%d\n", errno);
+			discard(fd);
+		}
+	}
+
+public:
+	Handle* connect(const std::string& address, int retry, unsigned timeout_ms) {
+		static std::random_device rd;
+		uint64_t session = ((uint64_t)rd() << 32) ^ rd() ^ ((uint64_t)getpid() << 16);
+
+		int fd = internal_connect(address, retry, timeout_ms);
+		if (fd == -1) return nullptr;
+		auto* handle = new HandleTCPStriped(this, fd, STCP_RAILS > 1 ? STCP_RAILS-1 : 0);
+		bool ok = sendHello(fd, session, 0, handle->rails.size()) == 0;
+		for(size_t i=0; ok && i<handle->rails.size(); ++i) {
+			int rfd = internal_connect(address, retry, timeout_ms);
+			handle->rails[i]->fd = rfd;
+			ok = rfd != -1 && sendHello(rfd, session, i+1, 0) == 0;
+		}
+		if (!ok) {
+			MTCL_TCP_PRINT(100, "ConnTcpStriped::connect cannot connect all the sockets, errno=%d\n", errno);
+			close(fd);
+			delete handle;
+			return nullptr;
+		}
+		return addHandle(handle);
+	}
+
+	// the pending sockets are expired by polling
+	bool arm() { return pending.empty() && incomplete.empty() && ConnTcp::arm(); }
+
+	void update() {
+		ConnTcp::update();
+		if (!pending.empty() || !incomplete.empty()) expire();
+	}
+
+	void end(bool blockflag=false) {
+		ConnTcp::end(blockflag);
+		for(auto& [fd, _] : pending) close(fd);
+		pending.clear();
+		for(auto& [_, i] : incomplete) {
+			close(i.handle->fd);
+			delete i.handle;
+		}
+		incomplete.clear();
+	}
+};
+
+#endif
@@ -0,0 +1,918 @@
+#ifndef TCP_URING_HPP
+#define TCP_URING_HPP
+
+/*
+ * TCP transport driven by io_uring (Linux >= 6.0), registered as "URING" when
+ * compiled with ENABLE_URING. The framing is the one of ConnTcp (8-byte
+ * big-endian size header), thus URING and TCP peers can be connected.
+ *
+ * The ring is driven by a single thread at a time: the IO thread, or the
+ * calling thread with SINGLE_IO_THREAD and after the IO thread has stopped
+ * (ConnTcpUring::end). Each update prepares the pending operations, submits
+ * them with a single io_uring_enter and reaps the completions. Connections
+ * are accepted with a multishot accept and read with a multishot recv using a
+ * pool of provided buffers: the data is copied into the buffer of a pending
+ * receive, or into the receive buffer of the handle. The isends queued on a
+ * handle are written by a single sendmsg. Blocking sends are written directly
+ * by the caller once the isends queued before them have been written.
+ * liburing is not needed, the ring is set up with the raw system calls.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../handle.hpp"
+#include "../protocolInterface.hpp"
+
+
+// Minimal io_uring with a pool of provided buffers (group 0). It is not
+// thread safe, it is used by the thread driving ConnTcpUring.
+class Uring {
+	int ringfd = -1;
+	unsigned *sqHead, *sqTail, *sqMask, *sqFlags;
+	unsigned *cqHead, *cqTail, *cqMask;
+	unsigned sqEntries = 0;
+	io_uring_sqe* sqes = nullptr;
+	io_uring_cqe* cqes = nullptr;
+	void*  sqPtr = MAP_FAILED;
+	void*  cqPtr = MAP_FAILED;
+	size_t sqSize = 0, cqSize = 0;
+	unsigned tail = 0;       // entries prepared
+	unsigned submitted = 0;  // entries passed to the kernel
+
+	// Receive buffers selected by the kernel. The ones consumed are given
+	// back with IORING_OP_PROVIDE_BUFFERS, consecutive ids with one entry.
+	char*    bufs = nullptr;
+	size_t   bufSize = 0;
+	unsigned nbufs = 0;
+	std::vector<unsigned> recycled;
+	bool     skipCqe = false;  // successful provides do not post completions
+
+	int setup(unsigned entries, io_uring_params& p, unsigned flags) {
+		memset(&p, 0, sizeof(p));
+		p.flags = flags;
+		return (int)syscall(__NR_io_uring_setup, entries, &p);
+	}
+
+public:
+	~Uring() { destroy(); }
+
+	int init(unsigned entries) {
+		io_uring_params p;
+		// SUBMIT_ALL is not known by kernels older than 5.18
+		if ((ringfd = setup(entries, p, IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL)) < 0 &&
+			(ringfd = setup(entries, p, IORING_SETUP_CLAMP)) < 0)
+			return -1;
+		sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single) sqSize = cqSize = std::max(sqSize, cqSize);
+		sqPtr = mmap(NULL, sqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+		if (sqPtr == MAP_FAILED) { destroy(); return -1; }
+		if (single) cqPtr = sqPtr;
+		else {
+			cqPtr = mmap(NULL, cqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+			if (cqPtr == MAP_FAILED) { destroy(); return -1; }
+		}
+		void* s = mmap(NULL, p.sq_entries * sizeof(io_uring_sqe), PROT_READ|PROT_WRITE,
+					   MAP_SHARED|MAP_POPULATE, ringfd, IORING_OFF_SQES);
+		if (s == MAP_FAILED) { destroy(); return -1; }
+		sqes = (io_uring_sqe*)s;
+		sqEntries = p.sq_entries;
+		skipCqe = p.features & IORING_FEAT_CQE_SKIP;
+
+		char* sq = (char*)sqPtr;
+		sqHead  = (unsigned*)(sq + p.sq_off.head);
+		sqTail  = (unsigned*)(sq + p.sq_off.tail);
+		sqMask  = (unsigned*)(sq + p.sq_off.ring_mask);
+		sqFlags = (unsigned*)(sq + p.sq_off.flags);
+		unsigned* array = (unsigned*)(sq + p.sq_off.array);
+		for(unsigned i=0; i<sqEntries; ++i) array[i] = i;
+		char* cq = (char*)cqPtr;
+		cqHead = (unsigned*)(cq + p.cq_off.head);
+		cqTail = (unsigned*)(cq + p.cq_off.tail);
+		cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+		cqes   = (io_uring_cqe*)(cq + p.cq_off.cqes);
+		tail = submitted = *sqTail;
+		return 0;
+	}
+
+	// gives n buffers of size bytes to the kernel as group 0
+	int initBuffers(unsigned n, size_t size) {
+		bufs = new (std::nothrow) char[(size_t)n * size];
+		if (!bufs) {
+			errno = ENOMEM;
+			return -1;
+		}
+		bufSize = size;
+		nbufs = n;
+		for(unsigned i=0; i<n; ++i) recycle(i);
+		provide();
+		if (submit(false) < 0) return -1;
+		return 0;
+	}
+
+	void destroy() {
+		if (sqes) munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+		if (cqPtr != MAP_FAILED && cqPtr != sqPtr) munmap(cqPtr, cqSize);
+		if (sqPtr != MAP_FAILED) munmap(sqPtr, sqSize);
+		if (ringfd != -1) close(ringfd);
+		delete [] bufs;
+		sqes = nullptr; sqPtr = cqPtr = MAP_FAILED;
+		bufs = nullptr; ringfd = -1;
+		recycled.clear();
+	}
+
+	int fd() const { return ringfd; }
+
+	// a cleared entry, nullptr if the submission queue is full
+	io_uring_sqe* getSqe() {
+		if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+			submit(false);
+			if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) return nullptr;
+		}
+		io_uring_sqe* sqe = &sqes[tail & *sqMask];
+		memset(sqe, 0, sizeof(*sqe));
+		++tail;
+		return sqe;
+	}
+
+	// submits the prepared entries, if wait is true it also waits for a completion
+	int submit(bool wait) {
+		unsigned n = tail - submitted;
+		unsigned flags = 0;
+		// the completions that did not fit in the queue are flushed by the kernel
+		if (wait || (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+			flags |= IORING_ENTER_GETEVENTS;
+		if (n == 0 && flags == 0) return 0;
+		__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+		int r;
+		do {
+			r = (int)syscall(__NR_io_uring_enter, ringfd, n, wait ? 1 : 0, flags, NULL, 0);
+		} while(r < 0 && errno == EINTR);
+		if (r > 0) submitted += r;
+		return r;
+	}
+
+	bool unsubmitted() const { return tail != submitted; }
+
+	// nothing to be done until the ring fd becomes readable
+	bool idle() const {
+		return tail == submitted &&
+			*cqHead == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) &&
+			!(__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW);
+	}
+
+	// calls f for each completion, f can prepare new entries
+	template<typename F>
+	void reap(F&& f) {
+		unsigned head = *cqHead;
+		while(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+			io_uring_cqe cqe = cqes[head & *cqMask];
+			__atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+			f(cqe);
+		}
+	}
+
+	char* buffer(unsigned bid) { return bufs + (size_t)bid * bufSize; }
+
+	// the buffer can be used again by the kernel, see provide
+	void recycle(unsigned bid) { recycled.push_back(bid); }
+
+	// prepares the entries giving the recycled buffers back
+	void provide() {
+		if (recycled.empty()) return;
+		std::sort(recycled.begin(), recycled.end());
+		size_t i = 0;
+		while(i < recycled.size()) {
+			size_t j = i + 1;
+			while(j < recycled.size() && recycled[j] == recycled[j-1] + 1) ++j;
+			io_uring_sqe* sqe = getSqe();
+			if (!sqe) break; // retried at the next call
+			sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+			sqe->fd        = j - i;
+			sqe->addr      = (uint64_t)(uintptr_t)buffer(recycled[i]);
+			sqe->len       = bufSize;
+			sqe->off       = recycled[i];
+			sqe->buf_group = 0;
+			sqe->user_data = 0;
+			if (skipCqe) sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+			i = j;
+		}
+		recycled.erase(recycled.begin(), recycled.begin() + i);
+	}
+};
+
+
+class ConnTcpUring;
+
+class HandleTCPUring : public Handle {
+	friend class ConnTcpUring;
+
+	// isend, written by the thread driving the ring
+	class SendRequest : public RequestImpl {
+		friend class HandleTCPUring;
+		friend class ConnTcpUring;
+		HandleTCPUring* h;
+		size_t sz;
+		const void* buff;
+		bool done = false;  // protected by h->mtx
+	public:
+		SendRequest(HandleTCPUring* h, const void* buff, size_t size) :
+			h(h), sz(htobe64(size)), buff(buff) { result = size; }
+		inline bool test();
+		inline void wait();
+	};
+
+	ConnTcpUring* conn;
+	// tells the completions of this connection from those of a previous one
+	// with the same descriptor
+	const uint32_t gen;
+
+	std::mutex mtx;              // protects the state shared with the ring driver
+	std::condition_variable cv;  // notified by the ring driver at each completion
+	// Data received and not consumed yet is in [rpos, rend). A pending
+	// receive (dst, dstLeft) is filled directly, the buffer is empty meanwhile.
+	std::vector<char> rbuf;
+	size_t rpos = 0, rend = 0;
+	char*  dst = nullptr;
+	size_t dstLeft = 0;
+	bool   eof = false;
+	int    err = 0;
+	bool   yielded = false;      // given back to the Manager when a header arrives
+	// Above URING_RBUF_MAX buffered bytes the multishot recv is canceled (the
+	// sender is throttled by TCP), it is armed again by take once the buffer
+	// is below the mark and the canceled recv has completed.
+	enum { ARMED, PAUSING, PAUSED } rstate = ARMED;
+
+	// isends queued and the batch being written (header and payload of each
+	// request, the first scur entries have been written)
+	std::deque<std::shared_ptr<SendRequest>> sendq;
+	std::vector<std::shared_ptr<SendRequest>> inflight;
+	std::vector<struct iovec> siov;
+	size_t scur = 0, sdone = 0;
+	struct msghdr smsg;
+	std::atomic<size_t> nqueued{0};
+
+	size_t buffered() const { return rend - rpos; }
+	bool readable() const { return buffered() >= sizeof(size_t) || eof || err; }
+
+	// copies the received bytes, mtx must be held
+	void append(const char* data, size_t len) {
+		if (dstLeft > 0) {
+			size_t l = std::min(len, dstLeft);
+			memcpy(dst, data, l);
+			dst += l; dstLeft -= l;
+			data += l; len -= l;
+		}
+		if (len == 0) return;
+		if (rend + len > rbuf.size()) {
+			if (rpos > 0) {
+				memmove(rbuf.data(), rbuf.data() + rpos, rend - rpos);
+				rend -= rpos;
+				rpos = 0;
+			}
+			if (rend + len > rbuf.size())
+				rbuf.resize(std::max(2 * rbuf.size(), rend + len));
+		}
+		memcpy(rbuf.data() + rend, data, len);
+		rend += len;
+	}
+
+	// copies at most n buffered bytes into ptr, mtx must be held
+	size_t take(char* ptr, size_t n) {
+		size_t l = std::min(n, buffered());
+		memcpy(ptr, rbuf.data() + rpos, l);
+		rpos += l;
+		if (rpos == rend) rpos = rend = 0;
+		if (rstate == PAUSED && buffered() <= URING_RBUF_MAX) {
+			rstate = ARMED;
+			resume();
+		}
+		return l;
+	}
+	// arms the recv again
+	inline void resume();
+
+	// waits for a completion, the driver of the ring reaps it by itself
+	inline void waitEvent(std::unique_lock<std::mutex>& lk);
+	// reaps the completions without blocking if the caller drives the ring
+	inline void poll();
+
+	// as readn
+	ssize_t readn(char* ptr, size_t n) {
+		std::unique_lock lk(mtx);
+		size_t got = take(ptr, n);
+		if (got == n) return n;
+		dst = ptr + got;
+		dstLeft = n - got;
+		while(dstLeft > 0 && !eof && !err) waitEvent(lk);
+		got = n - dstLeft;
+		dst = nullptr;
+		dstLeft = 0;
+		if (got == 0 && err) {
+			errno = err;
+			return -1;
+		}
+		return got;
+	}
+
+	ssize_t writevn(struct iovec* v, int count) {
+		for (int cur = 0;;) {
+			ssize_t written = writev(fd, v+cur, std::min(count-cur, IOV_MAX));
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			while (cur < count && written >= (ssize_t)v[cur].iov_len)
+				written -= v[cur++].iov_len;
+			if (cur == count) return 1;
+			v[cur].iov_base = (char *)v[cur].iov_base + written;
+			v[cur].iov_len -= written;
+		}
+	}
+
+	// keeps the order of a blocking send with the previous isends
+	void waitSends() {
+		if (nqueued.load(std::memory_order_acquire) == 0) return;
+		std::unique_lock lk(mtx);
+		while(!sendq.empty() || !inflight.empty()) waitEvent(lk);
+	}
+
+public:
+	int fd;
+	inline HandleTCPUring(ConnTcpUring* parent, int fd, uint32_t gen);
+
+	ssize_t sendEOS() {
+		waitSends();
+		size_t sz = 0;
+		struct iovec iov = {&sz, sizeof(sz)};
+		if (writevn(&iov, 1) < 0) return -1;
+		return sizeof(size_t);
+	}
+
+	ssize_t send(const void* buff, size_t size) {
+		struct iovec iov = {const_cast<void*>(buff), size};
+		return sendv(&iov, 1);
+	}
+
+	// header and buffers are written with a single writev
+	ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		waitSends();
+		size_t size = iov_length(iov, iovcnt);
+		size_t sz = htobe64(size);
+		// writevn modifies the array
+		struct iovec small[16];
+		std::vector<struct iovec> large;
+		struct iovec* v = small;
+		if (iovcnt+1 > 16) {
+			large.resize(iovcnt+1);
+			v = large.data();
+		}
+		v[0].iov_base = &sz;
+		v[0].iov_len  = sizeof(sz);
+		std::copy(iov, iov+iovcnt, v+1);
+		if (writevn(v, iovcnt+1) < 0)
+			return -1;
+		return size;
+	}
+
+	inline std::shared_ptr<RequestImpl> isend(const void* buff, size_t size);
+
+	ssize_t probe(size_t& size, const bool blocking=true) {
+		if (!blocking) poll();
+		std::unique_lock lk(mtx);
+		while(buffered() < sizeof(size_t)) {
+			if (err) {
+				errno = err;
+				return -1;
+			}
+			if (eof) return 0;
+			if (!blocking) {
+				errno = EWOULDBLOCK;
+				return -1;
+			}
+			waitEvent(lk);
+		}
+		size_t sz;
+		take((char*)&sz, sizeof(size_t));
+		size = be64toh(sz);
+		return sizeof(size_t);
+	}
+
+	bool peek() {
+		poll();
+		std::unique_lock lk(mtx);
+		return buffered() > 0 || eof;
+	}
+
+	ssize_t receive(void* buff, size_t size) {
+		return readn((char*)buff, size);
+	}
+
+	ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		for(int i=0; i<iovcnt; ++i) {
+			ssize_t r = readn((char*)iov[i].iov_base, iov[i].iov_len);
+			if (r != (ssize_t)iov[i].iov_len) return r < 0 ? -1 : 0;
+		}
+		return iov_length(iov, iovcnt);
+	}
+
+	~HandleTCPUring() {}
+};
+
+
+class ConnTcpUring : public ConnType {
+	friend class HandleTCPUring;
+
+	enum : uint64_t { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_WAKE, OP_CANCEL };
+
+	static uint64_t tag(uint64_t op, uint32_t gen, int fd) {
+		return op << 56 | (uint64_t)(gen & 0xffffff) << 32 | (uint32_t)fd;
+	}
+
+protected:
+	std::string address;
+	int port;
+	int listen_sck = -1;
+
+	std::unordered_map<int, HandleTCPUring*> connections;
+	std::atomic<uint32_t> nextGen{0};
+
+	Uring ring;
+	// the other threads post their requests to the ring driver here and wake
+	// it up with the eventfd, polled by the ring
+	int efd = -1;
+	std::vector<std::pair<int, uint32_t>> arms, sends, cancels;
+	std::vector<Handle*> readyq;  // yielded with a message already received
+	bool acceptArm = false, wakeArm = false;
+	// lists being prepared by the driver
+	std::vector<std::pair<int, uint32_t>> parms, psends, pcancels;
+	std::vector<Handle*> preadyq;
+#if !defined(SINGLE_IO_THREAD)
+	std::shared_mutex shm;        // protects connections
+	std::mutex qmtx;              // protects the lists above
+	std::atomic<bool> kicked{false};
+	std::atomic<std::thread::id> driver;
+#endif
+
+	bool isDriver() const {
+#if defined(SINGLE_IO_THREAD)
+		return true;
+#else
+		return driver.load(std::memory_order_relaxed) == std::this_thread::get_id();
+#endif
+	}
+
+	void kick() {
+		REMOVE_CODE_IF(if (!kicked.exchange(true)) eventfd_write(efd, 1));
+	}
+
+	void post(std::vector<std::pair<int, uint32_t>>& list, int fd, uint32_t gen) {
+		{
+			REMOVE_CODE_IF(std::unique_lock lk(qmtx));
+			list.emplace_back(fd, gen);
+		}
+		kick();
+	}
+
+	// connections must be locked
+	HandleTCPUring* find(int fd, uint32_t gen) {
+		auto it = connections.find(fd);
+		if (it == connections.end() || it->second->gen != gen) return nullptr;
+		return it->second;
+	}
+
+	bool prepAccept() {
+		io_uring_sqe* sqe = ring.getSqe();
+		if (!sqe) return false;
+		sqe->opcode    = IORING_OP_ACCEPT;
+		sqe->fd        = listen_sck;
+		sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = tag(OP_ACCEPT, 0, listen_sck);
+		return true;
+	}
+
+	bool prepWake() {
+		io_uring_sqe* sqe = ring.getSqe();
+		if (!sqe) return false;
+		sqe->opcode        = IORING_OP_POLL_ADD;
+		sqe->fd            = efd;
+		sqe->poll32_events = POLLIN;
+		sqe->len           = IORING_POLL_ADD_MULTI;
+		sqe->user_data     = tag(OP_WAKE, 0, efd);
+		return true;
+	}
+
+	bool prepRecv(int fd, uint32_t gen) {
+		io_uring_sqe* sqe = ring.getSqe();
+		if (!sqe) return false;
+		sqe->opcode    = IORING_OP_RECV;
+		sqe->fd        = fd;
+		sqe->ioprio    = IORING_RECV_MULTISHOT;
+		sqe->flags     = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = tag(OP_RECV, gen, fd);
+		return true;
+	}
+
+	bool prepCancel(int fd, uint32_t gen) {
+		io_uring_sqe* sqe = ring.getSqe();
+		if (!sqe) return false;
+		sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+		sqe->fd        = -1;
+		sqe->addr      = tag(OP_RECV, gen, fd);
+		sqe->user_data = tag(OP_CANCEL, gen, fd);
+		return true;
+	}
+
+	// writes the next batch of isends of h, connections must be locked
+	bool prepSend(HandleTCPUring* h) {
+		{
+			std::unique_lock lk(h->mtx);
+			if (h->inflight.empty()) {
+				h->siov.clear();
+				h->scur = h->sdone = 0;
+				while(!h->sendq.empty() && h->inflight.size() < URING_SEND_BATCH) {
+					auto& req = h->sendq.front();
+					h->siov.push_back({&req->sz, sizeof(size_t)});
+					h->siov.push_back({const_cast<void*>(req->buff), (size_t)req->result});
+					h->inflight.push_back(std::move(req));
+					h->sendq.pop_front();
+				}
+			}
+			if (h->inflight.empty()) return true;
+			memset(&h->smsg, 0, sizeof(h->smsg));
+			h->smsg.msg_iov    = h->siov.data() + h->scur;
+			h->smsg.msg_iovlen = std::min(h->siov.size() - h->scur, (size_t)IOV_MAX);
+		}
+		io_uring_sqe* sqe = ring.getSqe();
+		if (!sqe) return false;
+		sqe->opcode    = IORING_OP_SENDMSG;
+		sqe->fd        = h->fd;
+		sqe->addr      = (uint64_t)(uintptr_t)&h->smsg;
+		sqe->len       = 1;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = tag(OP_SEND, h->gen, h->fd);
+		return true;
+	}
+
+	// turns the requests of the other threads into submission entries, the
+	// ones that do not fit in the queue are retried at the next round
+	void prepare() {
+		bool acc, wake;
+		{
+			REMOVE_CODE_IF(std::unique_lock lk(qmtx));
+			parms.swap(arms);
+			psends.swap(sends);
+			pcancels.swap(cancels);
+			preadyq.swap(readyq);
+			acc = acceptArm; acceptArm = false;
+			wake = wakeArm; wakeArm = false;
+			REMOVE_CODE_IF(kicked.store(false));
+		}
+		ring.provide();
+		std::vector<std::pair<int, uint32_t>> retryArms, retrySends, retryCancels;
+		if (wake && !prepWake()) wakeArm = true;
+		if (acc && listen_sck != -1 && !prepAccept()) acceptArm = true;
+		for(auto& [fd, gen] : pcancels)
+			if (!prepCancel(fd, gen)) retryCancels.emplace_back(fd, gen);
+		for(auto& [fd, gen] : parms)
+			if (!prepRecv(fd, gen)) retryArms.emplace_back(fd, gen);
+		if (!psends.empty()) {
+			REMOVE_CODE_IF(std::shared_lock slock(shm));
+			for(auto& [fd, gen] : psends) {
+				HandleTCPUring* h = find(fd, gen);
+				if (h && !prepSend(h)) retrySends.emplace_back(fd, gen);
+			}
+		}
+		parms.clear(); psends.clear(); pcancels.clear();
+		if (!retryArms.empty() || !retrySends.empty() || !retryCancels.empty()) {
+			REMOVE_CODE_IF(std::unique_lock lk(qmtx));
+			arms.insert(arms.end(), retryArms.begin(), retryArms.end());
+			sends.insert(sends.end(), retrySends.begin(), retrySends.end());
+			cancels.insert(cancels.end(), retryCancels.begin(), retryCancels.end());
+		}
+	}
+
+	void newConnection(int fd, std::vector<std::pair<bool, Handle*>>& ready) {
+		HandleTCPUring* h = new HandleTCPUring(this, fd, nextGen++);
+		{
+			REMOVE_CODE_IF(std::unique_lock lock(shm));
+			connections[fd] = h;
+		}
+		if (!prepRecv(fd, h->gen)) post(arms, fd, h->gen);
+		ready.emplace_back(true, h);
+	}
+
+	void recvDone(HandleTCPUring* h, const io_uring_cqe& cqe, std::vector<std::pair<bool, Handle*>>& ready) {
+		const bool last = !(cqe.flags & IORING_CQE_F_MORE);
+		bool rearm = false, enobufs = cqe.res == -ENOBUFS, pause = false;
+		{
+			std::unique_lock lk(h->mtx);
+			if (cqe.res > 0) {
+				h->append(ring.buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT), cqe.res);
+				rearm = last;
+			} else if (cqe.res == 0) h->eof = true;
+			else if (cqe.res == -ECANCELED) rearm = true;
+			else if (!enobufs) h->err = -cqe.res;
+			// the reader is slow, the data stays in the socket
+			if (h->rstate == HandleTCPUring::ARMED && h->buffered() > URING_RBUF_MAX) {
+				h->rstate = last ? HandleTCPUring::PAUSED : HandleTCPUring::PAUSING;
+				pause = !last;
+			} else if (h->rstate == HandleTCPUring::PAUSING && last)
+				h->rstate = h->buffered() > URING_RBUF_MAX ? HandleTCPUring::PAUSED : HandleTCPUring::ARMED;
+			if (h->rstate != HandleTCPUring::ARMED) rearm = enobufs = false;
+			if (h->yielded && h->readable()) {
+				h->yielded = false;
+				ready.emplace_back(false, h);
+			}
+			h->cv.notify_all();
+		}
+		if (pause) post(cancels, h->fd, h->gen);
+		// out of buffers: re-armed after the buffers have been given back
+		if (enobufs) post(arms, h->fd, h->gen);
+		else if (rearm && !prepRecv(h->fd, h->gen)) post(arms, h->fd, h->gen);
+	}
+
+	void sendDone(HandleTCPUring* h, int res) {
+		bool more;
+		{
+			std::unique_lock lk(h->mtx);
+			if (res <= 0) { // the rest of the batch fails
+				for(size_t i=h->sdone; i<h->inflight.size(); ++i) {
+					h->inflight[i]->result = -1;
+					h->inflight[i]->err = res < 0 ? -res : EPIPE;
+					h->inflight[i]->done = true;
+				}
+				h->nqueued -= h->inflight.size() - h->sdone;
+				h->inflight.clear();
+			} else {
+				size_t n = res;
+				while(h->scur < h->siov.size() && n >= h->siov[h->scur].iov_len)
+					n -= h->siov[h->scur++].iov_len;
+				if (h->scur < h->siov.size()) {
+					h->siov[h->scur].iov_base = (char*)h->siov[h->scur].iov_base + n;
+					h->siov[h->scur].iov_len -= n;
+				}
+				for(; h->sdone < h->scur/2; ++h->sdone) {
+					h->inflight[h->sdone]->done = true;
+					--h->nqueued;
+				}
+				if (h->sdone == h->inflight.size()) h->inflight.clear();
+			}
+			more = !h->inflight.empty() || !h->sendq.empty();
+			h->cv.notify_all();
+		}
+		if (more && !prepSend(h)) post(sends, h->fd, h->gen);
+	}
+
+	void dispatch(const io_uring_cqe& cqe, std::vector<std::pair<bool, Handle*>>& ready) {
+		const uint64_t op  = cqe.user_data >> 56;
+		const uint32_t gen = (cqe.user_data >> 32) & 0xffffff;
+		const int      fd  = (int)(uint32_t)cqe.user_data;
+		switch(op) {
+		case OP_WAKE: {
+			eventfd_t v;
+			eventfd_read(efd, &v);
+			if (!(cqe.flags & IORING_CQE_F_MORE) && !prepWake()) wakeArm = true;
+		} break;
+		case OP_ACCEPT:
+			if (cqe.res >= 0) newConnection(cqe.res, ready);
+			else if (cqe.res != -ECANCELED)
+				MTCL_TCP_ERROR("ConnTcpUring::update accept ERROR: errno=%d -- %s\n", -cqe.res, strerror(-cqe.res));
+			if (!(cqe.flags & IORING_CQE_F_MORE) && listen_sck != -1 &&
+				cqe.res != -EINVAL && cqe.res != -EBADF && !prepAccept())
+				acceptArm = true;
+			break;
+		case OP_RECV: {
+			REMOVE_CODE_IF(std::shared_lock slock(shm));
+			HandleTCPUring* h = find(fd, gen);
+			if (h) recvDone(h, cqe, ready);
+		} break;
+		case OP_SEND: {
+			REMOVE_CODE_IF(std::shared_lock slock(shm));
+			HandleTCPUring* h = find(fd, gen);
+			if (h) sendDone(h, cqe.res);
+		} break;
+		}
+		// also the buffers of stale completions go back to the kernel
+		if (cqe.flags & IORING_CQE_F_BUFFER) ring.recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+
+	// one round of the ring: submission, completions, then the handles that
+	// are ready go to the Manager (the handshake of a new connection may call
+	// progress again)
+	void progress(bool wait) {
+		prepare();
+		if (ring.submit(wait) < 0 && errno != EAGAIN && errno != EBUSY)
+			MTCL_TCP_ERROR("ConnTcpUring::progress io_uring_enter ERROR: errno=%d -- %s\n", errno, strerror(errno));
+		std::vector<std::pair<bool, Handle*>> ready;
+		ring.reap([&](const io_uring_cqe& cqe) { dispatch(cqe, ready); });
+		ring.provide();
+		if (ring.unsubmitted()) ring.submit(false);
+		for(Handle* h : preadyq) ready.emplace_back(false, h);
+		preadyq.clear();
+		for(auto& [isNew, h] : ready) addinQ(isNew, h);
+	}
+
+public:
+
+	ConnTcpUring() {}
+	~ConnTcpUring() {}
+
+	int init(std::string) {
+		if (ring.init(URING_ENTRIES) == -1 || ring.initBuffers(URING_BUFFERS, URING_BUFFER_SIZE) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcpUring::init io_uring setup errno=%d\n", errno);
+			ring.destroy();
+			return -1;
+		}
+		if ((efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcpUring::init eventfd errno=%d\n", errno);
+			ring.destroy();
+			return -1;
+		}
+		wakeArm = true;
+		return 0;
+	}
+
+	// the ring fd is readable when there are completions
+	int getPollFd() { return ring.fd(); }
+
+	// the requests posted with SINGLE_IO_THREAD do not wake up the ring
+	bool arm() {
+		if (ring.fd() == -1 || !ring.idle()) return false;
+		REMOVE_CODE_IF(std::unique_lock lk(qmtx));
+		return arms.empty() && sends.empty() && cancels.empty() && readyq.empty() && !acceptArm && !wakeArm;
+	}
+
+	int listen(std::string s) {
+		address = s.substr(0, s.find(":"));
+		port = stoi(s.substr(address.length()+1));
+		if ((listen_sck = internal_listen(address, port, TCP_BACKLOG)) < 0) {
+			MTCL_TCP_PRINT(100, "ConnTcpUring::listen internal_listen errno=%d\n", errno);
+			return -1;
+		}
+		MTCL_TCP_PRINT(1, "listen to %s:%d (io_uring)\n", address.c_str(), port);
+		{
+			REMOVE_CODE_IF(std::unique_lock lk(qmtx));
+			acceptArm = true;
+		}
+		kick();
+		return 0;
+	}
+
+	void update() {
+		REMOVE_CODE_IF(driver.store(std::this_thread::get_id(), std::memory_order_relaxed));
+		progress(false);
+	}
+
+	Handle* connect(const std::string& address, int retry, unsigned timeout_ms) {
+		int fd = internal_connect(address, retry, timeout_ms);
+		if (fd == -1) return nullptr;
+		HandleTCPUring* handle = new HandleTCPUring(this, fd, nextGen++);
+		{
+			REMOVE_CODE_IF(std::unique_lock lock(shm));
+			connections[fd] = handle;
+		}
+		post(arms, fd, handle->gen);
+		return handle;
+	}
+
+	void notify_close(Handle* h, bool close_wr=true, bool close_rd=true) {
+		HandleTCPUring* handle = reinterpret_cast<HandleTCPUring*>(h);
+		if (close_wr && handle->fd != -1) {
+			shutdown(handle->fd, SHUT_WR);
+			// the EOS has already been received, see ConnTcp::notify_close
+			if (!close_rd) {
+				bool gone;
+				{
+					REMOVE_CODE_IF(std::shared_lock slock(shm));
+					gone = connections.find(handle->fd) == connections.end();
+				}
+				if (gone) {
+					close(handle->fd);
+					handle->fd = -1;
+				}
+			}
+		}
+		if (close_rd) {
+			int fd = handle->fd;
+			if (fd == -1) return;
+			shutdown(fd, SHUT_RD);
+			{
+				REMOVE_CODE_IF(std::unique_lock lock(shm));
+				connections.erase(fd);
+			}
+			// the multishot recv holds a reference to the socket
+			post(cancels, fd, handle->gen);
+			if (close_wr) {
+				close(fd);
+				handle->fd = -1;
+			}
+		}
+	}
+
+	void notify_yield(Handle* h) override {
+		HandleTCPUring* handle = reinterpret_cast<HandleTCPUring*>(h);
+		if (handle->fd == -1 || h->isClosed()) return;
+		{
+			std::unique_lock lk(handle->mtx);
+			if (!handle->readable()) {
+				// given back by the driver when the next header arrives
+				handle->yielded = true;
+				return;
+			}
+		}
+		{
+			REMOVE_CODE_IF(std::unique_lock lk(qmtx));
+			readyq.push_back(h);
+		}
+		kick();
+	}
+
+	void end(bool blockflag=false) {
+		// the IO thread has stopped, the caller drives the ring from now on
+		REMOVE_CODE_IF(driver.store(std::this_thread::get_id(), std::memory_order_relaxed));
+		std::vector<HandleTCPUring*> modified_connections;
+		{
+			REMOVE_CODE_IF(std::shared_lock slock(shm));
+			for(auto& [fd, h] : connections) modified_connections.push_back(h);
+		}
+		for(HandleTCPUring* h : modified_connections)
+			setAsClosed(h, blockflag);
+		if (listen_sck != -1) {
+			close(listen_sck);
+			listen_sck = -1;
+		}
+		ring.destroy();
+		if (efd != -1) {
+			close(efd);
+			efd = -1;
+		}
+	}
+};
+
+
+inline HandleTCPUring::HandleTCPUring(ConnTcpUring* parent, int fd, uint32_t gen) :
+	Handle(parent), conn(parent), gen(gen & 0xffffff), fd(fd) {}
+
+inline void HandleTCPUring::waitEvent(std::unique_lock<std::mutex>& lk) {
+	if (conn->isDriver()) {
+		lk.unlock();
+		conn->progress(true);
+		lk.lock();
+	} else cv.wait(lk);
+}
+
+inline void HandleTCPUring::resume() {
+	conn->post(conn->arms, fd, gen);
+}
+
+inline void HandleTCPUring::poll() {
+	if (conn->isDriver()) conn->progress(false);
+}
+
+inline std::shared_ptr<RequestImpl> HandleTCPUring::isend(const void* buff, size_t size) {
+	auto req = std::make_shared<SendRequest>(this, buff, size);
+	bool first;
+	{
+		std::unique_lock lk(mtx);
+		first = sendq.empty() && inflight.empty();
+		sendq.push_back(req);
+		++nqueued;
+	}
+	// the following ones are written when the current batch completes
+	if (first) conn->post(conn->sends, fd, gen);
+	return req;
+}
+
+inline bool HandleTCPUring::SendRequest::test() {
+	h->poll();
+	std::unique_lock lk(h->mtx);
+	return done;
+}
+
+inline void HandleTCPUring::SendRequest::wait() {
+	std::unique_lock lk(h->mtx);
+	while(!done) h->waitEvent(lk);
+}
+
+#endif
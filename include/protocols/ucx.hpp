@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <string.h>
 #include <shared_mutex>
 
@@ -18,6 +19,7 @@
 #include "../protocolInterface.hpp"
 #include "../utils.hpp" 
 #include "../config.hpp"
+#include "coalescing.hpp"
 
 
 class HandleUCX : public Handle {
@@ -105,11 +107,12 @@ protected:
         return status;
     }
 
-    ssize_t receive_internal(void* buff, size_t size, bool blocking) {
+    // if is_iov is true buff is an array of size ucp_dt_iov_t
+    ssize_t receive_internal(void* buff, size_t size, bool blocking, bool is_iov=false) {
         size_t res = 0;
 
         if(request == nullptr) {
-            fill_request_param(&ctx, &param, false);
+            fill_request_param(&ctx, &param, is_iov);
             param.op_attr_mask |= UCP_OP_ATTR_FIELD_FLAGS;
             param.flags = UCP_STREAM_RECV_FLAG_WAITALL;
             param.cb.recv_stream = stream_recv_cb;
@@ -140,6 +143,111 @@ protected:
     }
 
 
+    // blocking stream send of the n buffers described by v
+    int sendIov(ucp_dt_iov_t* v, size_t n) {
+        ucp_request_param_t param;
+        test_req_t ctx;
+
+        fill_request_param(&ctx, &param, true);
+        param.cb.send = send_cb;
+        ucs_status_ptr_t request = ucp_stream_send_nbx(endpoint, v, n, &param);
+
+        ucs_status_t status;
+        if((status = request_wait(request, &ctx, (char*)"flush", true)) != UCS_OK) {
+            errno = (status == UCS_ERR_CONNECTION_RESET) ? ECONNRESET : EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Coalesced sends (see HandleUser::setCoalescing), enabled and disabled
+    // only by the owner, flushed by the IO thread at the deadline
+    std::mutex cmtx;  // protects coalescer
+    SendCoalescer coalescer;
+    bool dirty = false; // counted in ConnUCX::ncoalesced
+
+    // updates the count of the handles the IO thread has to flush, cmtx
+    // must be held
+    inline void setDirty();
+
+    // cmtx must be held
+    int flushCoalesced() {
+        if (coalescer.pending() == 0) return 0;
+        ucp_dt_iov_t v;
+        v.buffer = const_cast<char*>(coalescer.data());
+        v.length = coalescer.pending();
+        int r = sendIov(&v, 1);
+        coalescer.clear();
+        setDirty();
+        return r;
+    }
+
+    // the message is appended to the coalescing buffer, if it does not fit
+    // it is sent together with the buffered ones
+    ssize_t sendCoalesced(const struct iovec* iov, int iovcnt) {
+        size_t size = iov_length(iov, iovcnt);
+        std::unique_lock lk(cmtx);
+        if (coalescer.append(iov, iovcnt, size)) {
+            setDirty();
+            return size;
+        }
+        size_t sz = htobe64(size);
+        std::vector<ucp_dt_iov_t> v;
+        v.reserve(iovcnt+2);
+        if (coalescer.pending() > 0)
+            v.push_back({const_cast<char*>(coalescer.data()), coalescer.pending()});
+        v.push_back({&sz, sizeof(sz)});
+        for(int i=0; i<iovcnt; ++i)
+            v.push_back({iov[i].iov_base, iov[i].iov_len});
+        int r = sendIov(v.data(), v.size());
+        coalescer.clear();
+        setDirty();
+        if (r < 0) return -1;
+        return size;
+    }
+
+    // isend: the stream send is posted without waiting for it
+    class SendRequest : public RequestImpl {
+        size_t sz;
+        ucp_dt_iov_t iov[2];
+        ucp_request_param_t param;
+        test_req_t ctx;
+        ucs_status_ptr_t request;
+        ucp_worker_h worker;
+        bool done = false;
+
+        void complete(ucs_status_t status) {
+            if (status != UCS_OK) {
+                MTCL_UCX_PRINT(100, "HandleUCX::isend status error (%s)\n", ucs_status_string(status));
+                result = -1;
+                err = (status == UCS_ERR_CONNECTION_RESET) ? ECONNRESET : EINVAL;
+            }
+            done = true;
+        }
+    public:
+        SendRequest(HandleUCX* h, const void* buff, size_t size) : sz(htobe64(size)), worker(h->ucp_worker) {
+            result = size;
+            iov[0].buffer = &sz;
+            iov[0].length = sizeof(sz);
+            iov[1].buffer = const_cast<void*>(buff);
+            iov[1].length = size;
+            h->fill_request_param(&ctx, &param, true);
+            param.cb.send = send_cb;
+            request = ucp_stream_send_nbx(h->endpoint, iov, 2, &param);
+            if (request == NULL) complete(UCS_OK);
+            else if (UCS_PTR_IS_ERR(request)) complete(UCS_PTR_STATUS(request));
+        }
+        bool test() {
+            if (done) return true;
+            ucp_worker_progress(worker);
+            if (ctx.complete == 0) return false;
+            ucs_status_t status = ucp_request_check_status(request);
+            ucp_request_free(request);
+            complete(status);
+            return true;
+        }
+    };
+
 public:
     std::atomic<bool> already_closed {false};
     ucp_ep_h endpoint;
@@ -153,7 +261,23 @@ public:
 
     HandleUCX(ConnType* parent, ucp_ep_h endpoint, ucp_worker_h worker) : Handle(parent), endpoint(endpoint), ucp_worker(worker) {}
 
+    inline int setCoalescing(size_t size, long deadline_us);
+
+    int flush() {
+        if (!coalescer.enabled()) return 0;
+        std::unique_lock lk(cmtx);
+        return flushCoalesced();
+    }
+
+    // called by the IO thread
+    void flushExpired(std::chrono::steady_clock::time_point now) {
+        std::unique_lock lk(cmtx, std::try_to_lock);
+        if (!lk.owns_lock() || !coalescer.expired(now)) return;
+        flushCoalesced();
+    }
+
     ssize_t sendEOS() {
+        if (flush() == -1) return -1;
         size_t sz = 0;
 		int useless = -1;
         
@@ -184,7 +308,17 @@ public:
 		return sz;
     }
 
+    std::shared_ptr<RequestImpl> isend(const void* buff, size_t size) {
+        // keeps the order with the coalesced sends
+        if (flush() == -1) return std::make_shared<CompletedRequest>(-1, errno);
+        return std::make_shared<SendRequest>(this, buff, size);
+    }
+
     ssize_t send(const void* buff, size_t size) {
+        if (coalescer.enabled()) {
+            struct iovec iov = {const_cast<void*>(buff), size};
+            return sendCoalesced(&iov, 1);
+        }
         size_t sz = htobe64(size);
         
         ucp_dt_iov_t iov[2];
@@ -215,6 +349,39 @@ public:
         return size;
     }
 
+    // the header and the buffers are sent with a single UCP_DATATYPE_IOV send
+    ssize_t sendv(const struct iovec* iov, int iovcnt) {
+        if (coalescer.enabled()) return sendCoalesced(iov, iovcnt);
+        size_t size = iov_length(iov, iovcnt);
+        size_t sz = htobe64(size);
+
+        std::vector<ucp_dt_iov_t> v(iovcnt+1);
+        v[0].buffer = &sz;
+        v[0].length = sizeof(sz);
+        for(int i=0; i<iovcnt; ++i) {
+            v[i+1].buffer = iov[i].iov_base;
+            v[i+1].length = iov[i].iov_len;
+        }
+
+        ucp_request_param_t param;
+        test_req_t* request;
+        test_req_t ctx;
+
+        fill_request_param(&ctx, &param, true);
+        param.cb.send = send_cb;
+        request       = (test_req_t*)ucp_stream_send_nbx(endpoint, v.data(), v.size(), &param);
+
+		ucs_status_t status;
+		if((status = request_wait(request, &ctx, (char*)"sendv", true)) != UCS_OK) {
+			if(status == UCS_ERR_CONNECTION_RESET)
+				errno = ECONNRESET;
+			else
+				errno = EINVAL;
+			return -1;
+		}
+        return size;
+    }
+
     ssize_t receive(void* buff, size_t size) {
         ssize_t res = receive_internal(buff, size, true);
         // Last recorded probe was consumed, reset probe size
@@ -222,6 +389,18 @@ public:
         return res;
     }
 
+    ssize_t receivev(const struct iovec* iov, int iovcnt) {
+        std::vector<ucp_dt_iov_t> v(iovcnt);
+        for(int i=0; i<iovcnt; ++i) {
+            v[i].buffer = iov[i].iov_base;
+            v[i].length = iov[i].iov_len;
+        }
+        ssize_t res = receive_internal(v.data(), iovcnt, true, true);
+        last_probe = -1;
+        if (res <= 0) return res;
+        return iov_length(iov, iovcnt);
+    }
+
     ssize_t probe(size_t& size, const bool blocking=true) {
         if(last_probe != -1) {
             size = last_probe;
@@ -229,6 +408,8 @@ public:
         }
 
 		ssize_t r;
+        // the reply may depend on the coalesced sends
+        if(blocking && flush() == -1) return -1;
         if((r=receive_internal(&test_probe, sizeof(size_t), blocking)) <= 0) {
             return r;
 		}
@@ -260,6 +441,7 @@ public:
 };
 
 class ConnUCX : public ConnType {
+    friend class HandleUCX;
 
 protected:
 
@@ -268,6 +450,7 @@ protected:
     int         port;
     fd_set      set, tmpset;
     int         listen_sck;
+    int         epfd = -1;   // worker event fd + OOB listening socket
 
 #if defined(SINGLE_IO_THREAD)
         int fdmax;
@@ -281,10 +464,30 @@ protected:
     size_t          local_addr_len;
     ucp_worker_h    ucp_worker;
     ucp_context_h   ucp_context;
+    int             worker_efd = -1;
 
     // UCX endpoint object --> <handle, to_manage>
     std::map<ucp_ep_h, std::pair<HandleUCX*, bool>> connections;
 
+    // handles with coalescing enabled and how many of them have bytes to be
+    // sent at the deadline
+    std::vector<HandleUCX*> coalescing;
+    std::atomic<int> ncoalesced{0};
+
+    void flushExpired() {
+        auto now = std::chrono::steady_clock::now();
+        // the lock prevents the handles from being closed meanwhile
+        REMOVE_CODE_IF(std::shared_lock l(shm));
+        for(HandleUCX* h : coalescing) h->flushExpired(now);
+    }
+
+    void watchCoalescing(HandleUCX* h, bool enable) {
+        REMOVE_CODE_IF(std::unique_lock l(shm));
+        auto it = std::find(coalescing.begin(), coalescing.end(), h);
+        if (enable && it == coalescing.end()) coalescing.push_back(h);
+        if (!enable && it != coalescing.end()) coalescing.erase(it);
+    }
+
 private:
 
     int _init() {
@@ -435,7 +638,7 @@ public:
 
         /* UCX context initialization */
         ucp_params.field_mask   = UCP_PARAM_FIELD_FEATURES;
-        ucp_params.features     = UCP_FEATURE_STREAM;
+        ucp_params.features     = UCP_FEATURE_STREAM | UCP_FEATURE_WAKEUP;
 
         // Initialize context with requested features and parameters
         ep_status = ucp_init(&ucp_params, config, &ucp_context);
@@ -474,9 +677,39 @@ public:
             return -1;
         }
 
+        // Event fd signaled by the worker, the IO thread blocks on it
+        ep_status = ucp_worker_get_efd(ucp_worker, &worker_efd);
+        if(ep_status != UCS_OK) {
+            MTCL_UCX_PRINT(100, "ConnUCX::init error retrieving worker event fd, polling\n");
+            worker_efd = -1;
+            return 0;
+        }
+#if defined(__linux__)
+        if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            MTCL_UCX_PRINT(100, "ConnUCX::init epoll_create1 errno=%d, polling\n", errno);
+            return 0;
+        }
+        struct epoll_event ev;
+        ev.events  = EPOLLIN;
+        ev.data.fd = worker_efd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, worker_efd, &ev) == -1) {
+            MTCL_UCX_PRINT(100, "ConnUCX::init epoll_ctl errno=%d, polling\n", errno);
+            close(epfd);
+            epfd = -1;
+        }
+#endif
         return 0;
     }
 
+    int getPollFd() { return epfd; }
+
+    bool arm() {
+        // the coalesced sends are flushed by update at the deadline
+        if (epfd == -1 || ncoalesced.load(std::memory_order_relaxed) > 0) return false;
+        // UCS_ERR_BUSY means there are unprocessed events, do not block
+        return ucp_worker_arm(ucp_worker) == UCS_OK;
+    }
+
 
     int listen(std::string s) {
         address = s.substr(0, s.find(":"));
@@ -492,6 +725,15 @@ public:
 
         FD_SET(listen_sck, &set);
         fdmax = listen_sck;
+#if defined(__linux__)
+        if (epfd != -1) {
+            struct epoll_event ev;
+            ev.events  = EPOLLIN;
+            ev.data.fd = listen_sck;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sck, &ev) == -1)
+                MTCL_UCX_PRINT(100, "ConnUCX::listen epoll_ctl errno=%d\n", errno);
+        }
+#endif
 
         return 0;
     }
@@ -546,13 +788,16 @@ public:
 
 
     void update() {
+        if (ncoalesced.load(std::memory_order_relaxed) > 0) flushExpired();
+
         REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));
 
         REMOVE_CODE_IF(ulock.lock());
         tmpset = set;
         REMOVE_CODE_IF(ulock.unlock());
 
-        struct timeval wait_time = {.tv_sec = 0, .tv_usec=UCX_POLL_TIMEOUT};
+        // non-blocking, the IO thread waits on the poll fd
+        struct timeval wait_time = {.tv_sec = 0, .tv_usec=0};
         int nready = 0;
         
         // Only if we are listening for new connections
@@ -689,6 +934,8 @@ public:
 
         REMOVE_CODE_IF(std::unique_lock l(shm));
         if(close_rd) {
+            auto it = std::find(coalescing.begin(), coalescing.end(), handle);
+            if (it != coalescing.end()) coalescing.erase(it);
             connections.erase(handle->endpoint);
             handle->already_closed = true;
             ep_close(handle->endpoint);
@@ -705,6 +952,10 @@ public:
 			setAsClosed(handlePair.first, blockflag);
         }
         
+        if (epfd != -1) {
+            close(epfd);
+            epfd = -1;
+        }
         ucp_worker_release_address(ucp_worker, local_addr);
         ucp_worker_destroy(ucp_worker);
         ucp_cleanup(ucp_context);
@@ -712,4 +963,23 @@ public:
 
 };
 
+inline void HandleUCX::setDirty() {
+    bool d = coalescer.pending() > 0 && coalescer.timed();
+    if (d == dirty) return;
+    dirty = d;
+    // the IO thread may be blocked, it must poll until the deadline
+    if (static_cast<ConnUCX*>(parent)->ncoalesced.fetch_add(d ? 1 : -1, std::memory_order_relaxed) == 0)
+        ucp_worker_signal(ucp_worker);
+}
+
+inline int HandleUCX::setCoalescing(size_t size, long deadline_us) {
+    {
+        std::unique_lock lk(cmtx);
+        if (flushCoalesced() == -1) return -1;
+        coalescer.set(size, deadline_us);
+    }
+    static_cast<ConnUCX*>(parent)->watchCoalescing(this, size > 0);
+    return 0;
+}
+
 #endif //UCX_HPP
@@ -0,0 +1,54 @@
+#ifndef UDS_HPP
+#define UDS_HPP
+
+/*
+ * Unix domain sockets (AF_UNIX, SOCK_STREAM) for peers on the same host,
+ * registered as "UDS". The address is a path ("UDS:/tmp/app.sock"), or a
+ * name in the abstract namespace when it starts with '@' ("UDS:@app").
+ * Everything but the addressing is the one of ConnTcp: same framing, same
+ * read-ahead, isend, coalescing and yield handling, thus the handles are
+ * HandleTCP. The listener removes the socket file in end.
+ */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "tcp.hpp"
+
+class ConnUDS : public ConnTcp {
+	std::string path;  // of the listening socket, removed by end
+
+public:
+	int listen(std::string s) {
+		int fd = internal_listen_unix(s, TCP_BACKLOG);
+		if (fd < 0) {
+			MTCL_TCP_PRINT(100, "ConnUDS::listen internal_listen_unix errno=%d\n", errno);
+			return -1;
+		}
+		if (watchListener(fd) == -1) {
+			close(fd);
+			return -1;
+		}
+		if (s[0] != '@') path = s;
+		MTCL_TCP_PRINT(1, "listen to %s\n", s.c_str());
+		return 0;
+	}
+
+	Handle* connect(const std::string& address, int retry, unsigned timeout_ms) {
+		int fd = internal_connect_unix(address, retry, timeout_ms);
+		if (fd == -1) return nullptr;
+		return newHandle(fd);
+	}
+
+	void end(bool blockflag=false) {
+		ConnTcp::end(blockflag);
+		if (!path.empty()) {
+			unlink(path.c_str());
+			path.clear();
+		}
+	}
+};
+
+#endif
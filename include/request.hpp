@@ -0,0 +1,128 @@
+#ifndef REQUEST_HPP
+#define REQUEST_HPP
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <sys/types.h>
+
+/**
+ * @brief State of a non-blocking operation, implemented by each transport.
+ */
+class RequestImpl {
+public:
+    ssize_t result = 0; // valid once completed, as returned by send/receive
+    int     err    = 0; // errno if result is -1
+
+    virtual ~RequestImpl() {}
+
+    /**
+     * @brief Makes progress on the operation without blocking.
+     *
+     * @return \c true if the operation has completed
+     */
+    virtual bool test() = 0;
+
+    /**
+     * @brief Blocks until the operation has completed.
+     */
+    virtual void wait() {
+        while(!test()) std::this_thread::yield();
+    }
+};
+
+// operation completed at the time it was posted
+class CompletedRequest : public RequestImpl {
+public:
+    CompletedRequest(ssize_t r, int e=0) { result = r; err = e; }
+    bool test() { return true; }
+    void wait() {}
+};
+
+
+/**
+ * @brief Handle to a non-blocking operation returned by HandleUser::isend and
+ * HandleUser::irecv. The buffer passed to the operation must not be accessed
+ * until the request has completed. The destructor waits for the completion
+ * of a pending request.
+ */
+class Request {
+    std::shared_ptr<RequestImpl> impl;
+public:
+    Request() {}
+    explicit Request(std::shared_ptr<RequestImpl> r) : impl(std::move(r)) {}
+    Request(ssize_t r, int e) : impl(std::make_shared<CompletedRequest>(r, e)) {}
+
+    Request(const Request&) = delete;
+    Request& operator=(const Request&) = delete;
+    Request(Request&& o) = default;
+    Request& operator=(Request&& o) {
+        if (this != &o) {
+            if (impl) impl->wait();
+            impl = std::move(o.impl);
+        }
+        return *this;
+    }
+
+    ~Request() { if (impl) impl->wait(); }
+
+    /**
+     * @brief \c false if the request has never been posted or its result has
+     * already been collected with wait or waitany.
+     */
+    bool isValid() const { return impl != nullptr; }
+
+    /**
+     * @brief Non-blocking check for completion.
+     *
+     * @return \c true if the operation has completed (or the request is not valid)
+     */
+    bool test() {
+        if (!impl) return true;
+        return impl->test();
+    }
+
+    /**
+     * @brief Waits for the completion of the operation. The request becomes
+     * invalid.
+     *
+     * @return the number of bytes sent or received, \c 0 if the connection
+     * has been closed, \c -1 on error (errno is set).
+     */
+    ssize_t wait() {
+        if (!impl) return 0;
+        impl->wait();
+        ssize_t r = impl->result;
+        int e = impl->err;
+        impl.reset();
+        if (r < 0) errno = e;
+        return r;
+    }
+
+    /**
+     * @brief Waits for the completion of one of the valid requests in
+     * \b reqs. The completed request becomes invalid.
+     *
+     * @param[out] result if not null, the result of the completed request (see wait)
+     * @return the index of the completed request, \c -1 if there are no valid requests
+     */
+    static int waitany(std::vector<Request>& reqs, ssize_t* result=nullptr) {
+        while(true) {
+            bool any = false;
+            for(size_t i=0; i<reqs.size(); ++i) {
+                if (!reqs[i].impl) continue;
+                any = true;
+                if (reqs[i].impl->test()) {
+                    ssize_t r = reqs[i].wait();
+                    if (result) *result = r;
+                    return (int)i;
+                }
+            }
+            if (!any) return -1;
+            std::this_thread::yield();
+        }
+    }
+};
+
+#endif
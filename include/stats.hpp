@@ -0,0 +1,108 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+/*
+ * Performance counters of handles, protocols and of the Manager (see
+ * Manager::stats and HandleUser::stats). They are updated with relaxed
+ * atomic operations on the communication path and they can be compiled out
+ * by defining MTCL_DISABLE_STATS, in which case the snapshots are all zeros.
+ */
+#if defined(MTCL_DISABLE_STATS)
+#define MTCL_STATS(...)
+#else
+#define MTCL_STATS(...) __VA_ARGS__
+#endif
+
+
+/**
+ * @brief Snapshot of the counters of a handle, or of all the handles of a
+ * protocol (including the closed ones).
+ */
+struct HandleStats {
+    uint64_t msgs_sent       = 0;
+    uint64_t bytes_sent      = 0;
+    uint64_t msgs_recv       = 0;
+    uint64_t bytes_recv      = 0;
+    uint64_t probes          = 0;  // calls to probe, blocking or not
+    uint64_t would_block     = 0;  // non-blocking probes without a message
+    uint64_t yields          = 0;  // handle given back to the Manager
+    uint64_t send_blocked_ns = 0;  // time spent in the blocking send
+    uint64_t recv_blocked_ns = 0;  // time spent in the blocking probe/receive
+
+    HandleStats& operator+=(const HandleStats& o) {
+        msgs_sent       += o.msgs_sent;
+        bytes_sent      += o.bytes_sent;
+        msgs_recv       += o.msgs_recv;
+        bytes_recv      += o.bytes_recv;
+        probes          += o.probes;
+        would_block     += o.would_block;
+        yields          += o.yields;
+        send_blocked_ns += o.send_blocked_ns;
+        recv_blocked_ns += o.recv_blocked_ns;
+        return *this;
+    }
+};
+
+/**
+ * @brief Snapshot of the Manager counters, returned by Manager::stats.
+ */
+struct ManagerStats {
+    uint64_t ready_depth     = 0;  // handles in the ready queue at the time of the snapshot
+    uint64_t ready_picked    = 0;  // handles returned by getNext/getNextBatch
+    uint64_t ready_wait_ns   = 0;  // time spent by them in the ready queue
+    uint64_t loop_iterations = 0;  // rounds of the progress engine
+    std::map<std::string, HandleStats> protocols; // per protocol counters
+};
+
+
+// monotonic clock used by the counters, in nanoseconds
+static inline uint64_t stats_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// measures the duration of a call, it costs nothing if the stats are disabled
+struct StatsTimer {
+#if defined(MTCL_DISABLE_STATS)
+    uint64_t elapsed() const { return 0; }
+#else
+    const uint64_t t0 = stats_clock();
+    uint64_t elapsed() const { return stats_clock() - t0; }
+#endif
+};
+
+class StatsCounter {
+    std::atomic<uint64_t> v{0};
+public:
+    void add(uint64_t n) { v.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+// live counters of a handle or of a protocol
+struct HandleCounters {
+    StatsCounter msgs_sent, bytes_sent, msgs_recv, bytes_recv;
+    StatsCounter probes, would_block, yields;
+    StatsCounter send_blocked_ns, recv_blocked_ns;
+
+    HandleStats snapshot() const {
+        HandleStats s;
+        s.msgs_sent       = msgs_sent.get();
+        s.bytes_sent      = bytes_sent.get();
+        s.msgs_recv       = msgs_recv.get();
+        s.bytes_recv      = bytes_recv.get();
+        s.probes          = probes.get();
+        s.would_block     = would_block.get();
+        s.yields          = yields.get();
+        s.send_blocked_ns = send_blocked_ns.get();
+        s.recv_blocked_ns = recv_blocked_ns.get();
+        return s;
+    }
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+/*
+ * Event tracer, enabled by compiling with MTCL_ENABLE_TRACE.
+ *
+ * Each thread records the duration of the traced calls in its own ring
+ * buffer (the last TRACE_BUFFER_EVENTS are kept) without any locking. The
+ * buffers are dumped by Manager::finalize in the Chrome trace JSON array
+ * format to the file given by the MTCL_TRACE environment variable (default
+ * mtcl-trace.json). All the processes append to the same file, thus a
+ * multi-process run can be loaded as a single timeline in chrome://tracing
+ * or in the Perfetto UI. Remove the file before a new run.
+ */
+#if defined(MTCL_ENABLE_TRACE)
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "config.hpp"
+#include "utils.hpp"
+
+class Trace {
+    struct Event {
+        const char* name;   // static strings only
+        const char* cat;
+        uint64_t    ts;     // begin, microseconds since the epoch
+        uint64_t    dur;    // nanoseconds
+        int64_t     arg;    // bytes, or -1
+    };
+
+    struct Buffer {
+        const long tid = syscall(SYS_gettid);
+        std::string threadName;
+        std::vector<Event> events{TRACE_BUFFER_EVENTS};
+        std::atomic<size_t> head{0}; // events ever recorded
+    };
+
+    inline static std::mutex mtx;  // protects buffers, not used on the hot path
+    inline static std::vector<std::shared_ptr<Buffer>> buffers;
+
+    static Buffer& local() {
+        thread_local std::shared_ptr<Buffer> buf = [] {
+            auto b = std::make_shared<Buffer>();
+            std::unique_lock lk(mtx);
+            buffers.push_back(b);
+            return b;
+        }();
+        return *buf;
+    }
+
+    // the realtime clock makes the events of different processes comparable
+    static uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static void escape(std::string& out, const std::string& s) {
+        for(char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            if ((unsigned char)c >= 0x20) out += c;
+        }
+    }
+
+public:
+    // records the duration of a scope
+    class Scope {
+        const char* name;
+        const char* cat;
+        int64_t     arg;
+        uint64_t    t0 = now_ns();
+    public:
+        Scope(const char* name, const char* cat, int64_t arg=-1) : name(name), cat(cat), arg(arg) {}
+        ~Scope() {
+            uint64_t t1 = now_ns();
+            Buffer& b = local();
+            size_t h = b.head.load(std::memory_order_relaxed);
+            b.events[h % TRACE_BUFFER_EVENTS] = {name, cat, t0/1000, t1-t0, arg};
+            b.head.store(h+1, std::memory_order_release);
+        }
+    };
+
+    // names the calling thread in the trace
+    static void setThreadName(const std::string& name) {
+        local().threadName = name;
+    }
+
+    /**
+     * @brief Appends the events of all threads to the trace file, the
+     * buffers are emptied.
+     *
+     * @return \c 0 on success, \c -1 otherwise (errno is set)
+     */
+    static int dump(const std::string& processName) {
+        const char* fname = std::getenv("MTCL_TRACE");
+        if (!fname) fname = "mtcl-trace.json";
+        const long pid = getpid();
+
+        std::string out;
+        auto append = [&out](const std::string& ev) {
+            out += ",\n";
+            out += ev;
+        };
+        std::string pname;
+        escape(pname, processName);
+        append("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+               ",\"args\":{\"name\":\"" + pname + "\"}}");
+        {
+            std::unique_lock lk(mtx);
+            for(auto& b : buffers) {
+                if (!b->threadName.empty()) {
+                    std::string tname;
+                    escape(tname, b->threadName);
+                    append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+                           ",\"tid\":" + std::to_string(b->tid) + ",\"args\":{\"name\":\"" + tname + "\"}}");
+                }
+                size_t h = b->head.load(std::memory_order_acquire);
+                size_t first = h > TRACE_BUFFER_EVENTS ? h - TRACE_BUFFER_EVENTS : 0;
+                char ev[512];
+                for(size_t i=first; i<h; ++i) {
+                    const Event& e = b->events[i % TRACE_BUFFER_EVENTS];
+                    int n = snprintf(ev, sizeof(ev),
+                             "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,"
+                             "\"ts\":%lu,\"dur\":%.3f",
+                             e.name, e.cat, pid, b->tid, (unsigned long)e.ts, e.dur/1000.0);
+                    if (e.arg >= 0)
+                        snprintf(ev+n, sizeof(ev)-n, ",\"args\":{\"bytes\":%ld}}", (long)e.arg);
+                    else
+                        snprintf(ev+n, sizeof(ev)-n, "}");
+                    append(ev);
+                }
+                b->head.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        int fd = open(fname, O_WRONLY|O_CREAT|O_APPEND, 0644);
+        if (fd == -1) return -1;
+        // other processes may be appending to the same file
+        if (flock(fd, LOCK_EX) == -1) { close(fd); return -1; }
+        struct stat st;
+        if (fstat(fd, &st) == -1) { close(fd); return -1; }
+        // the first writer opens the JSON array, the closing bracket is optional
+        out[0] = st.st_size == 0 ? '[' : ',';
+        const char* p = out.c_str();
+        size_t left = out.size();
+        while(left > 0) {
+            ssize_t r = write(fd, p, left);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                close(fd);
+                return -1;
+            }
+            p += r; left -= r;
+        }
+        close(fd);  // releases the lock
+        return 0;
+    }
+};
+
+#define MTCL_TRACE_CONCAT2(a,b) a##b
+#define MTCL_TRACE_CONCAT(a,b)  MTCL_TRACE_CONCAT2(a,b)
+// traces the rest of the enclosing scope: MTCL_TRACE(name, category[, bytes])
+#define MTCL_TRACE(...) Trace::Scope MTCL_TRACE_CONCAT(_mtcl_trace_, __LINE__)(__VA_ARGS__)
+#define MTCL_TRACE_THREAD(name) Trace::setThreadName(name)
+#define MTCL_TRACE_DUMP(pname) Trace::dump(pname)
+
+#else
+
+#define MTCL_TRACE(...)
+#define MTCL_TRACE_THREAD(name)
+#define MTCL_TRACE_DUMP(pname) 0
+
+#endif
+
+#endif
@@ -8,18 +8,33 @@
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <time.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <climits>
 #include <cstdarg>
+#include <cstddef>
 #include <cstdlib>
 #include <cstdio>
+#include <cstdint>
 #include <cstring>
 #include <thread>
+#include <vector>
 
 extern int mtcl_verbose;
 
@@ -123,62 +138,324 @@ static __always_inline void cpu_relax(void) {
 }
 
 
+// -------------------- event notification utility functions -------------------
+
+#if defined(__linux__)
+// Waits at most timeout_us microseconds (-1 means forever) for events on the
+// epoll descriptor epfd. Sub-millisecond timeouts use epoll_pwait2 when
+// available, otherwise we check the descriptors and then sleep.
+static inline int epoll_wait_us(int epfd, struct epoll_event* events, int maxevents, long timeout_us) {
+	if (timeout_us < 0)
+		return epoll_wait(epfd, events, maxevents, -1);
+	int r;
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+	struct timespec ts = { .tv_sec = timeout_us/1000000, .tv_nsec = (timeout_us%1000000)*1000 };
+	r = epoll_pwait2(epfd, events, maxevents, &ts, NULL);
+	if (r != -1 || errno != ENOSYS) return r;
+#endif
+	if (timeout_us >= 1000)
+		return epoll_wait(epfd, events, maxevents, (int)std::min(timeout_us/1000, (long)INT_MAX));
+	r = epoll_wait(epfd, events, maxevents, 0);
+	if (r == 0 && timeout_us > 0)
+		std::this_thread::sleep_for(std::chrono::microseconds(timeout_us));
+	return r;
+}
+#endif
+
+// Sleeps on addr while it contains val, for at most timeout_us microseconds
+// (-1 means forever). Spurious wakeups are possible. shared must be true if
+// addr is in memory shared with other processes.
+static inline void futex_wait(std::atomic<uint32_t>* addr, uint32_t val, long timeout_us, bool shared=false) {
+#if defined(__linux__)
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32bit");
+	struct timespec ts = { .tv_sec = timeout_us/1000000, .tv_nsec = (timeout_us%1000000)*1000 };
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val,
+			timeout_us < 0 ? NULL : &ts, NULL, 0);
+#else
+	if (addr->load() == val)
+		std::this_thread::sleep_for(std::chrono::microseconds(timeout_us < 0 || timeout_us > 100 ? 100 : timeout_us));
+#endif
+}
+
+// Wakes up at most n threads sleeping on addr
+static inline void futex_wake(std::atomic<uint32_t>* addr, int n, bool shared=false) {
+#if defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#endif
+}
+
+
+// -------------------- iovec utility functions ---------------------------------
+
+// total number of bytes described by the iovec array
+static inline size_t iov_length(const struct iovec* iov, int iovcnt) {
+	size_t len = 0;
+	for(int i=0; i<iovcnt; ++i) len += iov[i].iov_len;
+	return len;
+}
+
+// copies in dst the entries of iov covering the first len bytes (the last one
+// possibly shortened)
+static inline void iov_trim(std::vector<struct iovec>& dst, const struct iovec* iov, int iovcnt, size_t len) {
+	dst.clear();
+	for(int i=0; i<iovcnt && len > 0; ++i) {
+		size_t l = std::min(len, iov[i].iov_len);
+		dst.push_back({iov[i].iov_base, l});
+		len -= l;
+	}
+}
+
+// copies in dst the entries of iov covering the len bytes starting at off
+static inline void iov_slice(std::vector<struct iovec>& dst, const struct iovec* iov, int iovcnt, size_t off, size_t len) {
+	dst.clear();
+	for(int i=0; i<iovcnt && len > 0; ++i) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		size_t l = std::min(len, iov[i].iov_len - off);
+		dst.push_back({(char*)iov[i].iov_base + off, l});
+		len -= l;
+		off = 0;
+	}
+}
+
+// copies the data described by iov into the contiguous buffer dst
+static inline void iov_gather(char* dst, const struct iovec* iov, int iovcnt) {
+	for(int i=0; i<iovcnt; ++i) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+}
+
+// copies the contiguous buffer src into the buffers described by iov
+static inline void iov_scatter(const char* src, const struct iovec* iov, int iovcnt) {
+	for(int i=0; i<iovcnt; ++i) {
+		memcpy(iov[i].iov_base, src, iov[i].iov_len);
+		src += iov[i].iov_len;
+	}
+}
+
+
+// -------------------- file utility functions ----------------------------------
+
+// maps the len bytes of the file fd starting at off (any alignment), data is
+// nullptr if the file cannot be mapped (e.g., pipes and sockets)
+struct file_mapping {
+	void*  base = MAP_FAILED;
+	size_t maplen = 0;
+	char*  data = nullptr;
+
+	file_mapping(int fd, off_t off, size_t len, bool writable) {
+		if (len == 0) return;
+		off_t start = off - off % sysconf(_SC_PAGESIZE);
+		maplen = len + (off - start);
+		base = mmap(nullptr, maplen, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, start);
+		if (base == MAP_FAILED) return;
+		madvise(base, maplen, MADV_SEQUENTIAL);
+		data = (char*)base + (off - start);
+	}
+	~file_mapping() { if (base != MAP_FAILED) munmap(base, maplen); }
+	file_mapping(const file_mapping&) = delete;
+	file_mapping& operator=(const file_mapping&) = delete;
+};
+
+// anonymous temporary file of len bytes mapped in memory. The file
+// transfers whose descriptor cannot be mapped (e.g., pipes) are staged
+// here instead of in a heap buffer, its pages can be swapped out.
+struct staging_file {
+	int    fd = -1;
+	size_t len = 0;
+	char*  data = nullptr;
+
+	staging_file(size_t len) : len(len) {
+		if (len == 0 || (fd = memfd_create("mtcl-staging", MFD_CLOEXEC)) == -1) return;
+		if (ftruncate(fd, len) == -1) return;
+		void* p = mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) data = (char*)p;
+	}
+	~staging_file() {
+		if (data) munmap(data, len);
+		if (fd != -1) close(fd);
+	}
+	staging_file(const staging_file&) = delete;
+	staging_file& operator=(const staging_file&) = delete;
+};
+
+// reads exactly len bytes of fd, at off or at the current offset if off is -1
+static inline ssize_t read_all(int fd, char* buff, size_t len, off_t off = -1) {
+	for(size_t done = 0; done < len;) {
+		ssize_t r = off < 0 ? read(fd, buff + done, len - done) : pread(fd, buff + done, len - done, off + done);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) {
+			if (r == 0) errno = EIO; // the file is shorter than expected
+			return -1;
+		}
+		done += r;
+	}
+	return len;
+}
+
+// writes the len bytes of buff to fd
+static inline ssize_t write_all(int fd, const char* buff, size_t len) {
+	for(size_t done = 0; done < len;) {
+		ssize_t r = write(fd, buff + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += r;
+	}
+	return len;
+}
+
+
 // -------------------- TCP utilty functions -----------------------------------
 
 
-static inline int internal_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-	int saved_errno=0;
-    int rc = 0;
-    // Set O_NONBLOCK
-    int sockfd_flags_before;
-    if((sockfd_flags_before=fcntl(sockfd,F_GETFL,0)<0)) return -1;
-    if(fcntl(sockfd,F_SETFL,sockfd_flags_before | O_NONBLOCK)<0) return -1;
-    // Start connecting (asynchronously)
-    do {
-        if (connect(sockfd, addr, addrlen)<0) {
-            // Did connect return an error? If so, we'll fail.
-            if ((errno != EWOULDBLOCK) && (errno != EINPROGRESS)) {
-				rc = -1;
-				saved_errno=errno;
-            } else {  // Otherwise, we'll wait for it to complete.
-				saved_errno= EHOSTUNREACH;
-
-                // Set a deadline timestamp 'timeout' ms from now (needed b/c poll can be interrupted)
-                struct timespec now;
-                if(clock_gettime(CLOCK_MONOTONIC, &now)<0) { rc=-1; break; }
-                struct timespec deadline = { .tv_sec = now.tv_sec,
-                                             .tv_nsec = now.tv_nsec + (UNREACHABLE_ADDR_TIMOUT*1000000l)};
-                // Wait for the connection to complete.
-                do {
-                    // Calculate how long until the deadline
-                    if(clock_gettime(CLOCK_MONOTONIC, &now)<0) {rc=-1; break;}
-
-                    int ms_until_deadline = (int)(  (deadline.tv_sec  - now.tv_sec)*1000l
-													+ (deadline.tv_nsec - now.tv_nsec)/1000000l);
-                    if(ms_until_deadline<0) { rc=0;	break; }
-                    // Wait for connect to complete (or for the timeout deadline)
-                    struct pollfd pfds[] = { { .fd = sockfd, .events = POLLOUT } };
-					
-                    rc = poll(pfds, 1, ms_until_deadline);
-                    // If poll 'succeeded', make sure it *really* succeeded
-                    if(rc>0) {
-                        int error = 0; socklen_t len = sizeof(error);
-                        int retval = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-                        if(retval==0) saved_errno = error;
-                        if(error!=0)  rc=-1; 
-                    }
-                } while(rc==-1 && errno==EINTR); // If poll was interrupted, try again.
-                if(rc==0) rc=-1;                 // Did poll timeout? If so, fail.
-            }
-        }
-    } while(0);
-    // Restore original O_NONBLOCK state
-    if(fcntl(sockfd,F_SETFL,sockfd_flags_before)<0) return -1;
-	errno = saved_errno;
-    return rc;
+// Happy eyeballs (RFC 8305): a non-blocking connect is started on each
+// address of the list, CONNECT_ATTEMPT_DELAY ms after the previous one (or
+// as soon as the previous one fails). The first connection established is
+// returned in blocking mode, the other attempts are closed. Each attempt
+// lasts at most UNREACHABLE_ADDR_TIMOUT ms.
+static inline int connect_parallel(struct addrinfo* list) {
+	using clock = std::chrono::steady_clock;
+	struct attempt_t { int fd; clock::time_point expire; };
+	std::vector<attempt_t>     attempts;
+	std::vector<struct pollfd> pfds;
+	int saved_errno = EHOSTUNREACH;
+	int winner = -1;
+	struct addrinfo* next = list;
+	auto nextStart = clock::now();
+
+	auto drop = [&](size_t i) {
+		close(attempts[i].fd);
+		attempts.erase(attempts.begin()+i);
+	};
+
+	while(winner == -1) {
+		auto now = clock::now();
+		if (next && now >= nextStart) {
+			struct addrinfo* rp = next;
+			next = next->ai_next;
+			nextStart = now + std::chrono::milliseconds(CONNECT_ATTEMPT_DELAY);
+			int fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol);
+			if (fd == -1) {
+				MTCL_PRINT(100, "[MTCL]", "connect_parallel socket error, errno=%d\n", errno);
+				saved_errno = errno;
+				nextStart = now;
+				continue;
+			}
+			if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+				winner = fd;
+				break;
+			}
+			if (errno != EINPROGRESS && errno != EWOULDBLOCK) {
+				saved_errno = errno;
+				close(fd);
+				nextStart = now;
+				continue;
+			}
+			attempts.push_back({fd, now + std::chrono::milliseconds(UNREACHABLE_ADDR_TIMOUT)});
+		}
+		for(size_t i=0; i<attempts.size();)
+			if (attempts[i].expire <= now) { saved_errno = ETIMEDOUT; drop(i); }
+			else ++i;
+		if (attempts.empty()) {
+			if (!next) break;
+			nextStart = now;
+			continue;
+		}
+
+		auto until = attempts[0].expire;
+		for(auto& a : attempts) until = std::min(until, a.expire);
+		if (next) until = std::min(until, nextStart);
+		int ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count();
+
+		pfds.resize(attempts.size());
+		for(size_t i=0; i<attempts.size(); ++i)
+			pfds[i] = { attempts[i].fd, POLLOUT, 0 };
+		int rc = poll(pfds.data(), pfds.size(), std::max(ms, 0));
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			saved_errno = errno;
+			break;
+		}
+		for(size_t i=pfds.size(); i-- > 0;) {
+			if (!pfds[i].revents) continue;
+			int error = 0;
+			socklen_t len = sizeof(error);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0) {
+				winner = pfds[i].fd;
+				attempts.erase(attempts.begin()+i);
+				break;
+			}
+			saved_errno = error ? error : errno;
+			drop(i);
+			nextStart = now; // a failure starts the next attempt right away
+		}
+	}
+	for(auto& a : attempts) close(a.fd);
+	if (winner == -1) {
+		errno = saved_errno;
+		return -1;
+	}
+	if (fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, 0) & ~O_NONBLOCK) < 0) {
+		close(winner);
+		return -1;
+	}
+	return winner;
 }
 
 
+// creates a TCP socket listening on address:port, -1 on error (errno is set)
+static inline int internal_listen(const std::string& address, int port, int backlog) {
+	int fd;
+	if ((fd=socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		MTCL_PRINT(100, "[MTCL]", "internal_listen socket errno=%d\n", errno);
+		return -1;
+	}
+	int enable = 1;
+	// enable the reuse of the address
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+		MTCL_PRINT(100, "[MTCL]", "internal_listen setsockopt errno=%d\n", errno);
+		close(fd);
+		return -1;
+	}
+
+	struct addrinfo hints;
+	struct addrinfo *result, *rp;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
+	hints.ai_socktype = SOCK_STREAM;  /* Stream socket */
+	hints.ai_flags    = AI_PASSIVE;
+	hints.ai_protocol = IPPROTO_TCP;  /* Allow only TCP */
+	if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+		MTCL_PRINT(100, "[MTCL]", "internal_listen getaddrinfo errno=%d\n", errno);
+		close(fd);
+		return -1;
+	}
+
+	bool ok = false;
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		if (bind(fd, rp->ai_addr, (int)rp->ai_addrlen) < 0){
+			MTCL_PRINT(100, "[MTCL]", "internal_listen bind errno=%d, continue\n", errno);
+			continue;
+		}
+		ok = true;
+		break;
+	}
+	freeaddrinfo(result);
+	if (!ok || ::listen(fd, backlog) < 0) {
+		MTCL_PRINT(100, "[MTCL]", "internal_listen bind/listen errno=%d\n", errno);
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	return fd;
+}
+
 static inline int internal_connect(const std::string& address, int retry, unsigned timeout_ms) {
 	const std::string host = address.substr(0, address.find(":"));
 	const std::string svc  = address.substr(host.length()+1);
@@ -187,7 +464,7 @@ static inline int internal_connect(const std::string& address, int retry, unsign
 	
 	int fd=-1;	
 	struct addrinfo hints;
-	struct addrinfo *result, *rp;
+	struct addrinfo *result;
 	
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family   = AF_UNSPEC;              /* Allow IPv4 or IPv6 */
@@ -201,38 +478,89 @@ static inline int internal_connect(const std::string& address, int retry, unsign
 		return -1;
 	}
 
-	bool connected=false;
 	do {			
-		// try to connect to a possible one of the resolution results
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			fd = socket(rp->ai_family, rp->ai_socktype,
-						rp->ai_protocol);
-			if (fd == -1) {
-				MTCL_PRINT(100, "[MTCL]", "internal_connect socket error, errno=%d\n", errno);
-				continue;
-			}
-						
-			if (internal_connect(fd, rp->ai_addr, rp->ai_addrlen) != -1) {			   
-				retry=0;     
-				connected=true;
-				break;                  /* Success */
-			} 
-			close(fd);
-		}
-		if (!connected) {
-			--retry;		
+		// all the resolution results are tried concurrently
+		if ((fd = connect_parallel(result)) != -1) break;
+		if (--retry > 0) {
 			std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
 			MTCL_PRINT(100, "MTCL", "retry to connect to %s:%s\n", host.c_str(), svc.c_str());
 		}
 	} while(retry>0);
 	
-	free(result);
-    
-	if (rp == NULL) /* No address succeeded */
+	freeaddrinfo(result);
+	return fd;
+}
+
+// Unix domain socket address of path, a leading '@' means the abstract
+// namespace. -1 if the path does not fit (errno is set).
+static inline int unix_address(const std::string& path, struct sockaddr_un& sa, socklen_t& len) {
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+		errno = path.empty() ? EINVAL : ENAMETOOLONG;
 		return -1;
+	}
+	memcpy(sa.sun_path, path.c_str(), path.size());
+	if (path[0] == '@') sa.sun_path[0] = '\0';
+	len = offsetof(struct sockaddr_un, sun_path) + path.size() + (path[0] != '@');
+	return 0;
+}
+
+// creates a Unix domain socket listening on path, -1 on error (errno is set).
+// A socket file left by a listener that is gone is replaced.
+static inline int internal_listen_unix(const std::string& path, int backlog) {
+	struct sockaddr_un sa;
+	socklen_t len;
+	if (unix_address(path, sa, len) == -1) return -1;
+	int fd;
+	if ((fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0) {
+		MTCL_PRINT(100, "[MTCL]", "internal_listen_unix socket errno=%d\n", errno);
+		return -1;
+	}
+	int r = bind(fd, (struct sockaddr*)&sa, len);
+	if (r == -1 && errno == EADDRINUSE && path[0] != '@') {
+		// stale if nobody accepts on it
+		int probe = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (probe != -1 && ::connect(probe, (struct sockaddr*)&sa, len) == -1 && errno == ECONNREFUSED) {
+			MTCL_PRINT(100, "[MTCL]", "internal_listen_unix removing stale %s\n", path.c_str());
+			unlink(path.c_str());
+			r = bind(fd, (struct sockaddr*)&sa, len);
+		} else errno = EADDRINUSE;
+		if (probe != -1) close(probe);
+	}
+	if (r == -1 || ::listen(fd, backlog) < 0) {
+		int e = errno;
+		MTCL_PRINT(100, "[MTCL]", "internal_listen_unix bind/listen errno=%d\n", e);
+		close(fd);
+		errno = e;
+		return -1;
+	}
 	return fd;
 }
 
+static inline int internal_connect_unix(const std::string& path, int retry, unsigned timeout_ms) {
+	struct sockaddr_un sa;
+	socklen_t len;
+	if (unix_address(path, sa, len) == -1) return -1;
+
+	MTCL_PRINT(100, "[MTCL]", "connecting to %s\n", path.c_str());
+	do {
+		int fd;
+		if ((fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0) {
+			MTCL_PRINT(100, "[MTCL]", "internal_connect_unix socket errno=%d\n", errno);
+			return -1;
+		}
+		if (::connect(fd, (struct sockaddr*)&sa, len) == 0) return fd;
+		int e = errno;
+		close(fd);
+		errno = e;
+		if (--retry > 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+			MTCL_PRINT(100, "[MTCL]", "retry to connect to %s\n", path.c_str());
+		}
+	} while(retry>0);
+	return -1;
+}
 
 
 
@@ -0,0 +1,37 @@
+#ifndef ECHO_SERVER_HPP
+#define ECHO_SERVER_HPP
+
+/*
+ * Server of the tests whose clients only need their messages echoed back.
+ * It listens on addr, sends every message back on the handle it came from
+ * until the clients close, and succeeds (0) only if the last message of
+ * sizeof(int) bytes was 42, that the clients send at the end to check that
+ * nothing was lost. onNew is called with every new connection.
+ */
+#include <functional>
+#include <vector>
+#include "mtcl.hpp"
+
+static inline int echoServer(const std::string& addr, const std::function<void(HandleUser&)>& onNew = {}) {
+	Manager::init("server");
+	if (Manager::listen(addr) == -1) return -1;
+	std::vector<char> v;
+	int lastval = -1;
+	while(true) {
+		auto h = Manager::getNext();
+		if (h.isNewConnection()) {
+			if (onNew) onNew(h);
+			continue;
+		}
+		size_t sz;
+		if (h.probe(sz) <= 0) break;
+		v.resize(sz);
+		if (h.receive(v.data(), sz) != (ssize_t)sz) break;
+		if (sz == sizeof(int)) lastval = *(int*)v.data();
+		h.send(v.data(), sz);
+	}
+	Manager::finalize();
+	return lastval == 42 ? 0 : -1;
+}
+
+#endif
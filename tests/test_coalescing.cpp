@@ -0,0 +1,106 @@
+/*
+ * Coalesced sends. The client enables the coalescing on its handle and sends
+ * bursts of small messages mixed with messages larger than the buffer and
+ * isends, the server echoes them. The replies are waited for with
+ * non-blocking probes, thus the messages must be written either at the
+ * deadline (by the IO thread) or by an explicit flush. The last messages are
+ * written by close.
+ *
+ *   $> ./test_coalescing [nrounds]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+#include "echo_server.hpp"
+
+const int    burst = 100;
+const size_t bufsize = 4096;
+
+// waits for the message with non-blocking probes only, the progress engine
+// runs meanwhile (it is the calling thread with SINGLE_IO_THREAD)
+static bool receiveNB(HandleUser& h, std::vector<int>& v) {
+	size_t sz;
+	auto t0 = std::chrono::steady_clock::now();
+	while(h.probe(sz, false) == -1 && errno == EWOULDBLOCK) {
+		if (std::chrono::steady_clock::now() - t0 > std::chrono::seconds(5)) {
+			MTCL_ERROR("[Client]:\t", "reply not received, messages not flushed?\n");
+			return false;
+		}
+		Manager::getNext(std::chrono::microseconds(10));
+	}
+	v.resize(sz/sizeof(int));
+	return h.receive(v.data(), sz) == (ssize_t)sz;
+}
+
+int main(int argc, char** argv){
+	int nrounds = 20;
+	if (argc>1) nrounds = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		return echoServer("TCP:localhost:13000");
+	}
+	Manager::init("client");
+	auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	int nerrors = 0;
+	auto check = [&](const std::vector<int>& v, size_t n, int first) {
+		if (v.size() != n) { ++nerrors; return; }
+		for(size_t i=0; i<n; ++i)
+			if (v[i] != first+(int)i) { ++nerrors; return; }
+	};
+	std::vector<int> large(bufsize);  // larger than the buffer with the header
+	std::vector<int> reply;
+	for(int r=0; r<nrounds; ++r) {
+		// at the deadline
+		if (h.setCoalescing(bufsize, 100) == -1) { ++nerrors; break; }
+		for(int i=0; i<burst; ++i) h.send(&i, sizeof(i));
+		for(int i=0; i<burst; ++i) {
+			if (!receiveNB(h, reply)) { ++nerrors; break; }
+			check(reply, 1, i);
+		}
+		// by flush and when the buffer is full, with large messages and isends
+		if (h.setCoalescing(bufsize, -1) == -1) { ++nerrors; break; }
+		for(size_t i=0; i<large.size(); ++i) large[i] = r+i;
+		int x = -1;
+		h.send(&x, sizeof(x));
+		h.send(large.data(), large.size()*sizeof(int));
+		auto req = h.isend(&r, sizeof(r));
+		h.send(&x, sizeof(x));
+		req.wait();
+		if (h.flush() == -1) ++nerrors;
+		if (!receiveNB(h, reply)) { ++nerrors; break; }
+		check(reply, 1, -1);
+		if (!receiveNB(h, reply)) { ++nerrors; break; }
+		check(reply, large.size(), r);
+		if (!receiveNB(h, reply)) { ++nerrors; break; }
+		check(reply, 1, r);
+		if (!receiveNB(h, reply)) { ++nerrors; break; }
+		check(reply, 1, -1);
+		// before a blocking receive
+		h.send(&r, sizeof(r));
+		if (h.receive(&x, sizeof(x)) != sizeof(x) || x != r) ++nerrors;
+	}
+	// the last message is written by close
+	int last = 42;
+	h.setCoalescing(bufsize, -1);
+	h.send(&last, sizeof(last));
+	h.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_coalescing]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_coalescing]:\t", "OK!\n");
+	return 0;
+}
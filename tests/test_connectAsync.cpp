@@ -0,0 +1,62 @@
+/*
+ * Many concurrent Manager::connectAsync, plus one towards an endpoint where
+ * nobody is listening, which must fail.
+ *
+ *   $> ./test_connectAsync [nconn]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+int main(int argc, char** argv){
+	int nconn = 64;
+	if (argc>1) nconn = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("TCP:localhost:13000");
+		int nclosed = 0;
+		while(nclosed < nconn) {
+			auto handle = Manager::getNext();
+			if (handle.isNewConnection()) continue;
+			int x;
+			if (handle.receive(&x, sizeof(x)) == 0) { ++nclosed; continue; }
+			handle.send(&x, sizeof(x));
+		}
+		Manager::finalize();
+		return 0;
+	}
+	Manager::init("client");
+	int nerrors = 0;
+	auto nobody = Manager::connectAsync("TCP:localhost:13999");
+	std::vector<std::future<HandleUser>> futures;
+	for(int i=0; i<nconn; ++i)
+		futures.push_back(Manager::connectAsync("TCP:localhost:13000", 10, 200));
+	for(int i=0; i<nconn; ++i) {
+		auto h = futures[i].get();
+		if (!h.isValid()) {
+			MTCL_ERROR("[Client]:\t", "cannot connect to server (connection %d)\n", i);
+			kill(pid, SIGKILL);
+			return -1;
+		}
+		int x;
+		if (h.send(&i, sizeof(i)) != sizeof(i) ||
+			h.receive(&x, sizeof(x)) != sizeof(x) || x != i) ++nerrors;
+		h.close();
+	}
+	if (nobody.get().isValid()) ++nerrors;
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_connectAsync]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_connectAsync]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Coroutine front-end: the server accepts the connections with
+ * Manager::next and serves each of them in a separate task on a thread pool,
+ * the clients are tasks running on a single thread and connecting with
+ * Manager::connectAsync. Each client then opens a second connection and
+ * floods it, the server task closes it and returns after the first messages
+ * while the others are still arriving. The last connection, opened when all
+ * the clients are done, lets the server terminate.
+ *
+ *   $> g++ -std=c++20 ...
+ *   $> ./test_coroutines [nconn] [nmsgs]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include "mtcl.hpp"
+
+#if !defined(__cpp_impl_coroutine) || defined(SINGLE_IO_THREAD)
+int main() {
+	MTCL_ERROR("[test_coroutines]:\t", "coroutines not available, skipped\n");
+	return 0;
+}
+#else
+
+std::atomic<int> nerrors{0};
+const int FLOOD = -1; // first message of the flooding connections
+const int nflood = 1000;
+
+Task<void> serve(AsyncHandle h) {
+	int x;
+	ssize_t r;
+	if ((r = co_await h.receive(&x, sizeof(x))) == sizeof(x) && x == FLOOD) {
+		for(int i=0; i<3; ++i)
+			if (co_await h.receive(&x, sizeof(x)) != sizeof(x)) ++nerrors;
+		h.close();
+		co_return;
+	}
+	while(r > 0) {
+		x = -x;
+		co_await h.send(&x, sizeof(x));
+		r = co_await h.receive(&x, sizeof(x));
+	}
+	if (r < 0) ++nerrors;
+	h.close();
+}
+
+Task<int> accept(Executor& ex, int nconn) {
+	int n = 0;
+	while(n < nconn) {
+		auto h = co_await Manager::next();
+		if (!h.isNewConnection()) {
+			++nerrors;
+			continue;
+		}
+		ex.spawn(serve(AsyncHandle(std::move(h))));
+		++n;
+	}
+	co_return n;
+}
+
+Task<void> acceptor(Executor& ex, int nconn) {
+	int n = co_await accept(ex, nconn);
+	if (n != nconn) ++nerrors;
+}
+
+Task<void> client(int id, int nmsgs) {
+	AsyncHandle h(co_await Manager::connectAsync("TCP:localhost:13000", 10, 200));
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server (client %d)\n", id);
+		++nerrors;
+		co_return;
+	}
+	for(int i=0; i<nmsgs; ++i) {
+		int x = id*nmsgs + i;
+		co_await h.send(&x, sizeof(x));
+		if (co_await h.receive(&x, sizeof(x)) != sizeof(x) || x != -(id*nmsgs + i)) ++nerrors;
+	}
+	h.close();
+	int x;
+	if (co_await h.receive(&x, sizeof(x)) != 0) ++nerrors;  // EOS from the server
+
+	AsyncHandle f(co_await Manager::connectAsync("TCP:localhost:13000", 10, 200));
+	x = FLOOD;
+	if (co_await f.send(&x, sizeof(x)) != sizeof(x)) ++nerrors;
+	for(int i=0; i<nflood; ++i)
+		if (co_await f.send(&i, sizeof(i)) != sizeof(i)) ++nerrors;
+	if (co_await f.receive(&x, sizeof(x)) != 0) ++nerrors;  // closed by the server
+	f.close();
+}
+
+int main(int argc, char** argv){
+	int nconn = 32;
+	int nmsgs = 100;
+	if (argc>1) nconn = std::stoi(argv[1]);
+	if (argc>2) nmsgs = std::stoi(argv[2]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("TCP:localhost:13000");
+		ThreadPoolExecutor ex(4);
+		ex.spawn(acceptor(ex, 2*nconn+1));
+		ex.run();
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	SingleThreadExecutor ex;
+	for(int i=0; i<nconn; ++i)
+		ex.spawn(client(i, nmsgs));
+	ex.run();
+	// the server waits for the flooding connections to be done
+	auto last = Manager::connect("TCP:localhost:13000", 10, 200);
+	last.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_coroutines]:\t", "ERROR! (%d errors)\n", nerrors.load());
+		return -1;
+	}
+	MTCL_ERROR("[test_coroutines]:\t", "OK!\n");
+	return 0;
+}
+#endif
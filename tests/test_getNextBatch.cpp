@@ -0,0 +1,85 @@
+/*
+ * The server collects the ready handles in batches using Manager::getNextBatch.
+ *
+ *   $> ./test_getNextBatch [nconn]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+const size_t BATCH = 16;
+
+int main(int argc, char** argv){
+	int nconn = 64;
+	if (argc>1) nconn = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("TCP:localhost:13000");
+
+		int nclosed = 0;
+		size_t maxbatch = 0;
+		std::vector<HandleUser> batch;
+		batch.reserve(BATCH);
+		while(nclosed < nconn) {
+			batch.clear();
+			size_t n = Manager::getNextBatch(batch, BATCH);
+			if (n != batch.size() || n == 0 || n > BATCH) {
+				MTCL_ERROR("[Server]:\t", "wrong batch size %ld (%ld)\n", n, batch.size());
+				return -1;
+			}
+			maxbatch = std::max(maxbatch, n);
+			for(auto& handle : batch) {
+				if (handle.isNewConnection()) continue;
+				int x;
+				ssize_t r = handle.receive(&x, sizeof(x));
+				if (r == 0) { ++nclosed; continue; }
+				if (r < 0) {
+					MTCL_ERROR("[Server]:\t", "receive error, errno=%d\n", errno);
+					return -1;
+				}
+				x = -x;
+				handle.send(&x, sizeof(x));
+			}
+		}
+		MTCL_PRINT(0, "[Server]:\t", "largest batch: %ld\n", maxbatch);
+		Manager::finalize();
+		return 0;
+	}
+	Manager::init("client");
+	std::vector<HandleUser> handles;
+	for(int i=0; i<nconn; ++i) {
+		auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+		if (!h.isValid()) {
+			MTCL_ERROR("[Client]:\t", "cannot connect to server (connection %d), exit\n", i);
+			kill(pid, SIGKILL);
+			return -1;
+		}
+		handles.push_back(std::move(h));
+	}
+	int nerrors = 0;
+	for(int iter=0; iter<10; ++iter) {
+		for(int i=0; i<nconn; ++i)
+			handles[i].send(&i, sizeof(i));
+		for(int i=0; i<nconn; ++i) {
+			int x;
+			if (handles[i].receive(&x, sizeof(x)) != sizeof(x) || x != -i) ++nerrors;
+		}
+	}
+	for(auto& h : handles) h.close();
+	handles.clear();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_getNextBatch]:\t", "ERROR! (%d wrong replies)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_getNextBatch]:\t", "OK!\n");
+	return 0;
+}
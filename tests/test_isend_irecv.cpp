@@ -0,0 +1,103 @@
+/*
+ * Non-blocking isend/irecv. The client posts many large isends (more than
+ * the socket buffer can hold) and completes them with waitany, the server
+ * receives them with irecv and replies with isend.
+ *
+ *   $> ./test_isend_irecv [TCP:localhost:13000|SHM:/test_isend] [nmsgs] [msgsize]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+int main(int argc, char** argv){
+	std::string addr = "TCP:localhost:13000";
+	int nmsgs = 32;
+	size_t msgsize = 1<<20;
+	if (argc>1) addr = argv[1];
+	if (argc>2) nmsgs = std::stoi(argv[2]);
+	if (argc>3) msgsize = std::stol(argv[3]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen(addr);
+		auto handle = Manager::getNext();
+		if (!handle.isNewConnection()) return -1;
+
+		int nerrors = 0;
+		std::vector<char> buff(msgsize);
+		// too small, the message is received later with receive
+		{
+			char c;
+			auto r = handle.irecv(&c, 1);
+			if (r.wait() != -1 || errno != ENOMEM) ++nerrors;
+			if (handle.receive(buff.data(), msgsize) != (ssize_t)msgsize || buff[0] != 0) ++nerrors;
+		}
+		for(int i=1; i<nmsgs; ++i) {
+			auto r = handle.irecv(buff.data(), msgsize);
+			while(!r.test()) std::this_thread::yield();
+			if (r.wait() != (ssize_t)msgsize) ++nerrors;
+			else if (buff[0] != (char)i || buff[msgsize-1] != (char)i) ++nerrors;
+		}
+		std::vector<int> replies(nmsgs);
+		std::vector<Request> reqs;
+		for(int i=0; i<nmsgs; ++i) {
+			replies[i] = -i;
+			reqs.push_back(handle.isend(&replies[i], sizeof(int)));
+		}
+		ssize_t res;
+		while(Request::waitany(reqs, &res) != -1)
+			if (res != sizeof(int)) ++nerrors;
+		// EOS
+		char c;
+		if (handle.irecv(&c, 1).wait() != 0) ++nerrors;
+		handle.close();
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	auto h = Manager::connect(addr, 10, 200);
+	for(int i=0; i<10 && !h.isValid(); ++i) { // SHM does not retry
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		h = Manager::connect(addr, 10, 200);
+	}
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	int nerrors = 0;
+	std::vector<std::vector<char>> msgs(nmsgs);
+	std::vector<Request> reqs;
+	for(int i=0; i<nmsgs; ++i) {
+		msgs[i].assign(msgsize, (char)i);
+		reqs.push_back(h.isend(msgs[i].data(), msgsize));
+	}
+	int ncompleted = 0;
+	ssize_t res;
+	int idx;
+	while((idx = Request::waitany(reqs, &res)) != -1) {
+		if (res != (ssize_t)msgsize) ++nerrors;
+		++ncompleted;
+	}
+	if (ncompleted != nmsgs) ++nerrors;
+	for(int i=0; i<nmsgs; ++i) {
+		int x;
+		auto r = h.irecv(&x, sizeof(x));
+		if (r.wait() != sizeof(x) || x != -i) ++nerrors;
+	}
+	h.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_isend_irecv]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_isend_irecv]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * The server has to handle more connections than FD_SETSIZE.
+ *
+ *   $> ./test_many_connections [nconn]
+ *
+ * NOTE: the limit of open files (ulimit -n) must be greater than nconn.
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+int main(int argc, char** argv){
+	int nconn = 2000;
+	if (argc>1) nconn = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("TCP:localhost:13000");
+
+		int nclosed = 0;
+		while(nclosed < nconn) {
+			auto handle = Manager::getNext();
+			if (handle.isNewConnection()) continue;
+			int x;
+			ssize_t r = handle.receive(&x, sizeof(x));
+			if (r == 0) { ++nclosed; continue; }
+			if (r < 0) {
+				MTCL_ERROR("[Server]:\t", "receive error, errno=%d\n", errno);
+				break;
+			}
+			x = -x;
+			handle.send(&x, sizeof(x));
+		}
+		Manager::finalize();
+		return 0;
+	}
+	Manager::init("client");
+	std::vector<HandleUser> handles;
+	for(int i=0; i<nconn; ++i) {
+		auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+		if (!h.isValid()) {
+			MTCL_ERROR("[Client]:\t", "cannot connect to server (connection %d), exit\n", i);
+			kill(pid, SIGKILL);
+			return -1;
+		}
+		handles.push_back(std::move(h));
+	}
+	for(int i=0; i<nconn; ++i)
+		handles[i].send(&i, sizeof(i));
+	int nerrors = 0;
+	for(int i=0; i<nconn; ++i) {
+		int x;
+		if (handles[i].receive(&x, sizeof(x)) != sizeof(x) || x != -i) ++nerrors;
+		handles[i].close();
+	}
+	handles.clear();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_many_connections]:\t", "ERROR! (%d wrong replies)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_many_connections]:\t", "OK!\n");
+	return 0;
+}
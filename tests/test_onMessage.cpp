@@ -0,0 +1,87 @@
+/*
+ * The server serves the connections in reactor mode: messages are delivered
+ * to the handler registered with Manager::onMessage, getNext only returns
+ * new connections.
+ *
+ *   $> ./test_onMessage [nconn] [nmsgs]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+int main(int argc, char** argv){
+	int nconn = 16;
+	int nmsgs = 1000;
+	if (argc>1) nconn = std::stoi(argv[1]);
+	if (argc>2) nmsgs = std::stoi(argv[2]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("TCP:localhost:13000");
+
+		std::atomic<int> nclosed{0};
+		std::atomic<int> nerrors{0};
+		auto echo = [&](HandleUser& h, const void* buff, size_t size) {
+			if (size == 0) {
+				h.close();
+				++nclosed;
+				return;
+			}
+			if (size != sizeof(int)) ++nerrors;
+			int x = -*(const int*)buff;
+			h.send(&x, sizeof(x));
+		};
+
+		while(nclosed < nconn) {
+			// in the SINGLE_IO_THREAD case getNext also runs the handlers
+			auto handle = Manager::getNext(std::chrono::milliseconds(10));
+			if (!handle.isValid()) continue;
+			if (!handle.isNewConnection()) {
+				MTCL_ERROR("[Server]:\t", "message delivered through getNext\n");
+				++nerrors;
+				continue;
+			}
+			Manager::onMessage(handle, echo);
+		}
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	std::vector<HandleUser> handles;
+	for(int i=0; i<nconn; ++i) {
+		auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+		if (!h.isValid()) {
+			MTCL_ERROR("[Client]:\t", "cannot connect to server (connection %d), exit\n", i);
+			kill(pid, SIGKILL);
+			return -1;
+		}
+		handles.push_back(std::move(h));
+	}
+	int nerrors = 0;
+	for(int j=0; j<nmsgs; ++j) {
+		for(int i=0; i<nconn; ++i) {
+			int v = i*nmsgs+j;
+			handles[i].send(&v, sizeof(v));
+		}
+		for(int i=0; i<nconn; ++i) {
+			int x;
+			if (handles[i].receive(&x, sizeof(x)) != sizeof(x) || x != -(i*nmsgs+j)) ++nerrors;
+		}
+	}
+	for(auto& h : handles) h.close();
+	handles.clear();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_onMessage]:\t", "ERROR! (%d wrong replies)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_onMessage]:\t", "OK!\n");
+	return 0;
+}
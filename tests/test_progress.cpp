@@ -0,0 +1,90 @@
+/*
+ * The progress engine has to busy-poll while messages keep coming and to
+ * block after the spin and yield periods without events.
+ *
+ *   $> ./test_progress [nmsgs]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include "mtcl.hpp"
+
+int main(int argc, char** argv){
+	int nmsgs = 1000;
+	if (argc>1) nmsgs = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		// 100ms of spinning and 100ms of yielding
+		Manager::setProgressPolicy(100000, 100000);
+		Manager::listen("TCP:localhost:13000");
+
+		int nerrors = 0;
+		auto handle = Manager::getNext();
+		if (!handle.isNewConnection()) return -1;
+		handle.yield(); // it is kept to send the last message
+		for(int i=0; i<nmsgs; ++i) {
+			auto h = Manager::getNext();
+			int x;
+			if (h.receive(&x, sizeof(x)) != sizeof(x)) { ++nerrors; break; }
+			x = -x;
+			h.send(&x, sizeof(x));
+		}
+		if (Manager::getProgressState() != ProgressPolicy::SPIN) {
+			MTCL_ERROR("[Server]:\t", "not spinning under traffic (%s)\n",
+					   ProgressPolicy::toString(Manager::getProgressState()));
+			++nerrors;
+		}
+		// no events for longer than spin+yield
+		Manager::getNext(std::chrono::milliseconds(400));
+		if (Manager::getProgressState() != ProgressPolicy::BLOCK) {
+			MTCL_ERROR("[Server]:\t", "not blocked when idle (%s)\n",
+					   ProgressPolicy::toString(Manager::getProgressState()));
+			++nerrors;
+		}
+		// busy-polling forever
+		Manager::setProgressPolicy(-1, 0);
+		Manager::getNext(std::chrono::milliseconds(10));
+		if (Manager::getProgressState() != ProgressPolicy::SPIN) {
+			MTCL_ERROR("[Server]:\t", "not spinning with a negative spin time (%s)\n",
+					   ProgressPolicy::toString(Manager::getProgressState()));
+			++nerrors;
+		}
+		int end = 0;
+		handle.send(&end, sizeof(end));
+		while(true) {
+			auto h = Manager::getNext();
+			if (h.receive(&end, sizeof(end)) == 0) break;
+		}
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	int nerrors = 0;
+	for(int i=1; i<=nmsgs; ++i) {
+		int x = i;
+		h.send(&x, sizeof(x));
+		if (h.receive(&x, sizeof(x)) != sizeof(x) || x != -i) ++nerrors;
+	}
+	int end;
+	h.receive(&end, sizeof(end));
+	h.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_progress]:\t", "ERROR! (%d wrong replies)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_progress]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * The client sends bursts of small messages without waiting, so that many
+ * of them are read at once by the server. The server gets one message for
+ * each getNext, alternating receive, non-blocking probe and irecv, and it
+ * has to get all of them.
+ *
+ *   $> ./test_readahead [nbursts] [burst size]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+int main(int argc, char** argv){
+	int nbursts = 50;
+	int burst = 200;
+	if (argc>1) nbursts = std::stoi(argv[1]);
+	if (argc>2) burst = std::stoi(argv[2]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("TCP:localhost:13000");
+
+		int nerrors = 0;
+		int expected = 0;
+		while(true) {
+			auto h = Manager::getNext();
+			if (h.isNewConnection()) continue;
+			int x = -1;
+			ssize_t r;
+			switch(expected % 3) {
+			case 0: r = h.receive(&x, sizeof(x)); break;
+			case 1: {
+				size_t sz;
+				while((r = h.probe(sz, false)) == -1 && errno == EWOULDBLOCK);
+				if (r > 0) r = h.receive(&x, sizeof(x));
+			} break;
+			default: r = h.irecv(&x, sizeof(x)).wait();
+			}
+			if (r == 0) break;
+			if (r != sizeof(x) || x != expected) {
+				MTCL_ERROR("[Server]:\t", "received %d, expected %d\n", x, expected);
+				++nerrors;
+				break;
+			}
+			// the acknowledgement of the end of the burst
+			if (++expected % burst == 0) h.send(&expected, sizeof(expected));
+		}
+		if (expected != nbursts*burst) ++nerrors;
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	int nerrors = 0;
+	for(int b=0, i=0; b<nbursts; ++b) {
+		for(int j=0; j<burst; ++j, ++i)
+			h.send(&i, sizeof(i));
+		int ack;
+		if (h.receive(&ack, sizeof(ack)) != sizeof(ack) || ack != i) ++nerrors;
+	}
+	h.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_readahead]:\t", "ERROR!\n");
+		return -1;
+	}
+	MTCL_ERROR("[test_readahead]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * File transfer with sendFile and receiveToFile. The client sends regions
+ * of a temporary file (smaller than the read-ahead buffer and larger than
+ * the zero-copy/striping thresholds, at unaligned offsets), the server
+ * appends them to its own file with receiveToFile and sends them back from
+ * that file with sendFile. The client receives the replies with receive.
+ * At the end it sends from a pipe, that cannot be mapped.
+ *
+ *   $> ./test_sendfile [TCP:localhost:13000|SHM:/test_sendfile|STCP:localhost:13000] [nrounds]
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "mtcl.hpp"
+
+const size_t sizes[] = {100, (3<<20)+7};
+const off_t  offsets[] = {4097, 12345};
+
+static int tempfile(const char* prefix) {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/%s-XXXXXX", prefix);
+	int fd = mkstemp(path);
+	if (fd != -1) unlink(path);
+	return fd;
+}
+
+int main(int argc, char** argv){
+	std::string addr = "TCP:localhost:13000";
+	int nrounds = 4;
+	if (argc>1) addr = argv[1];
+	if (argc>2) nrounds = std::stoi(argv[2]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen(addr);
+		auto h = Manager::getNext();
+		if (!h.isNewConnection()) return -1;
+		int fd = tempfile("mtcl_test_sendfile_srv");
+		int nerrors = 0;
+		while(true) {
+			size_t sz;
+			if (h.probe(sz) <= 0) break;
+			off_t off = lseek(fd, 0, SEEK_CUR);
+			if (h.receiveToFile(fd, sz) != (ssize_t)sz || lseek(fd, 0, SEEK_CUR) != off + (off_t)sz) ++nerrors;
+			if (h.sendFile(fd, off, sz) != (ssize_t)sz) ++nerrors;
+		}
+		h.close();
+		close(fd);
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	std::this_thread::sleep_for(std::chrono::milliseconds(200)); // SHM does not retry
+	auto h = Manager::connect(addr, 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[test_sendfile]:\t", "cannot connect to server\n");
+		return -1;
+	}
+	int fd = tempfile("mtcl_test_sendfile");
+	size_t fsize = offsets[1] + sizes[1];
+	std::vector<char> data(fsize), reply;
+	for(size_t i=0; i<fsize; ++i) data[i] = (char)(i*7+i/4096);
+	if (fd == -1 || write_all(fd, data.data(), fsize) == -1) {
+		MTCL_ERROR("[test_sendfile]:\t", "cannot create the file\n");
+		return -1;
+	}
+
+	int nerrors = 0;
+	if (h.sendFile(fd, 0, fsize+1) != -1 || errno != EINVAL) ++nerrors;
+	for(int r=0; r<nrounds; ++r) {
+		for(int i=0; i<2; ++i) {
+			off_t off = offsets[(r+i)%2] - r;
+			size_t size = sizes[i];
+			if (h.sendFile(fd, off, size) != (ssize_t)size) ++nerrors;
+			reply.assign(size, 0);
+			if (h.receive(reply.data(), size) != (ssize_t)size ||
+				!std::equal(reply.begin(), reply.end(), data.begin()+off))
+				++nerrors;
+		}
+	}
+	if (lseek(fd, 0, SEEK_CUR) != (off_t)fsize) ++nerrors; // not moved by sendFile
+	int p[2];
+	if (pipe(p) == 0) {
+		std::thread writer([&]{
+			write_all(p[1], data.data(), sizes[1]);
+			close(p[1]);
+		});
+		if (h.sendFile(p[0], 0, sizes[1]) != (ssize_t)sizes[1]) ++nerrors;
+		writer.join();
+		close(p[0]);
+		reply.assign(sizes[1], 0);
+		if (h.receive(reply.data(), sizes[1]) != (ssize_t)sizes[1] ||
+			!std::equal(reply.begin(), reply.end(), data.begin()))
+			++nerrors;
+	} else ++nerrors;
+	h.close();
+	close(fd);
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_sendfile]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_sendfile]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Scatter-gather send and receive. The client sends a header and a payload
+ * split in two buffers, the server receives them in differently split
+ * buffers and sends them back with a single send of two buffers, that the
+ * client receives contiguously.
+ *
+ *   $> ./test_sendv [TCP:localhost:13000|SHM:/test_sendv] [nmsgs] [payload size]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+struct header_t {
+	int    id;
+	size_t len;
+};
+
+static bool check(const char* p, size_t len, int id) {
+	for(size_t i=0; i<len; ++i)
+		if (p[i] != (char)(id+i)) return false;
+	return true;
+}
+
+int main(int argc, char** argv){
+	std::string addr = "TCP:localhost:13000";
+	int nmsgs = 8;
+	size_t size = 5<<20; // larger than SHM_SMALL_MSG_SIZE
+	if (argc>1) addr = argv[1];
+	if (argc>2) nmsgs = std::stoi(argv[2]);
+	if (argc>3) size = std::stol(argv[3]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen(addr);
+		auto handle = Manager::getNext();
+		if (!handle.isNewConnection()) return -1;
+
+		int nerrors = 0;
+		header_t hdr;
+		std::vector<char> a(size/3), b(size);  // b larger than needed
+		for(int i=0; i<nmsgs; ++i) {
+			struct iovec iov[3] = {{&hdr, sizeof(hdr)}, {a.data(), a.size()}, {b.data(), b.size()}};
+			ssize_t r = handle.receive(iov, 3);
+			if (r != (ssize_t)(sizeof(hdr)+size) || hdr.id != i || hdr.len != size) { ++nerrors; continue; }
+			if (!check(a.data(), a.size(), i) || !check(b.data(), size-a.size(), i+a.size())) ++nerrors;
+			// send back header and the reassembled payload
+			std::vector<char> payload(a.begin(), a.end());
+			payload.insert(payload.end(), b.begin(), b.begin()+(size-a.size()));
+			struct iovec out[2] = {{&hdr, sizeof(hdr)}, {payload.data(), payload.size()}};
+			if (handle.send(out, 2) != (ssize_t)(sizeof(hdr)+size)) ++nerrors;
+		}
+		// EOS
+		struct iovec iov = {&hdr, sizeof(hdr)};
+		if (handle.receive(&iov, 1) != 0) ++nerrors;
+		handle.close();
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	auto h = Manager::connect(addr, 10, 200);
+	for(int i=0; i<10 && !h.isValid(); ++i) { // SHM does not retry
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		h = Manager::connect(addr, 10, 200);
+	}
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	int nerrors = 0;
+	std::vector<char> payload(size), reply(sizeof(header_t)+size);
+	for(int i=0; i<nmsgs; ++i) {
+		header_t hdr = {i, size};
+		for(size_t j=0; j<size; ++j) payload[j] = (char)(i+j);
+		size_t half = size/2;
+		struct iovec iov[3] = {{&hdr, sizeof(hdr)}, {payload.data(), half}, {payload.data()+half, size-half}};
+		if (h.send(iov, 3) != (ssize_t)(sizeof(hdr)+size)) ++nerrors;
+		if (h.receive(reply.data(), reply.size()) != (ssize_t)reply.size()) { ++nerrors; continue; }
+		header_t* rh = (header_t*)reply.data();
+		if (rh->id != i || rh->len != size || !check(reply.data()+sizeof(header_t), size, i)) ++nerrors;
+	}
+	h.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_sendv]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_sendv]:\t", "OK!\n");
+	return 0;
+}
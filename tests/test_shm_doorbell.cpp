@@ -0,0 +1,120 @@
+/*
+ * Doorbell of the SHM connections. The server accepts many connections and
+ * yields them to the IO thread, then the client stays idle: the server
+ * process must not use the CPU while it waits in getNext. Then the client
+ * sends a message on each connection (in a random order) and the server has
+ * to get every one of them from getNext. The second round is a burst that
+ * overflows the doorbell (more rings than net.unix.max_dgram_qlen), the
+ * server finds the missed rings in the segments. A producer ringing a
+ * doorbell nobody listens on must not block.
+ *
+ *   $> ./test_shm_doorbell [nconnections] [sleep ms]
+ */
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include "mtcl.hpp"
+
+static double cputime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec/1e6; // ms
+}
+
+int main(int argc, char** argv){
+	int n  = 32;
+	int ms = 500;
+	if (argc>1) n  = std::stoi(argv[1]);
+	if (argc>2) ms = std::stoi(argv[2]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("SHM:/test_shm_doorbell");
+		int nerrors = 0;
+		for(int i=0; i<n; ++i) {
+			auto h = Manager::getNext();
+			if (!h.isNewConnection()) return -1;
+			h.yield();
+		}
+		double t = cputime();
+		std::vector<bool> got(2*n, false);
+		for(int i=0; i<2*n; ) {
+			auto h = Manager::getNext();
+			if (i == 0) { // the first message comes after the idle time
+				t = cputime() - t;
+				if (t > ms/5.) {
+					MTCL_ERROR("[Server]:\t", "%.1f ms of CPU while idle\n", t);
+					++nerrors;
+				}
+			}
+			int x;
+			if (h.receive(&x, sizeof(x)) != sizeof(x) || x<0 || x>=2*n || got[x]) {
+				++nerrors;
+				break;
+			}
+			got[x] = true;
+			++i;
+			h.send(&x, sizeof(x));
+			h.yield();
+		}
+		for(int i=0; i<n; ++i) { // EOS
+			auto h = Manager::getNext();
+			int x;
+			if (h.receive(&x, sizeof(x)) != 0) ++nerrors;
+			h.close();
+		}
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	int nerrors = 0;
+	shmBuffer b;
+	int x = 1;
+	if (b.create("/test_shm_doorbell_nobody") == 0) {
+		b.park("@mtcl-test-nobody", 1);
+		if (b.put(&x, sizeof(x)) != sizeof(x) || !b.overflowed()) ++nerrors;
+		b.close(true);
+	}
+
+	Manager::init("client");
+	std::this_thread::sleep_for(std::chrono::milliseconds(200)); // the server is listening
+	std::vector<HandleUser> hs;
+	for(int i=0; i<n; ++i) {
+		hs.push_back(Manager::connect("SHM:/test_shm_doorbell", 100, 200));
+		if (!hs.back().isValid()) {
+			MTCL_ERROR("[test_shm_doorbell]:\t", "cannot connect to server\n");
+			return -1;
+		}
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+	std::vector<int> order(n);
+	for(int i=0; i<n; ++i) order[i] = i;
+	std::shuffle(order.begin(), order.end(), std::mt19937(n));
+	for(int r=0; r<2; ++r) {
+		for(int i : order) {
+			int v = r*n+i;
+			if (hs[i].send(&v, sizeof(v)) != sizeof(v)) ++nerrors;
+			if (r == 0 && i % 2) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		for(int i=0; i<n; ++i) {
+			int v = -1;
+			if (hs[i].receive(&v, sizeof(v)) != sizeof(v) || v != r*n+i) ++nerrors;
+		}
+	}
+	for(auto& h : hs) h.close();
+	Manager::finalize();
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_shm_doorbell]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_shm_doorbell]:\t", "OK!\n");
+	return 0;
+}
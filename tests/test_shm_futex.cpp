@@ -0,0 +1,81 @@
+/*
+ * Blocking SHM waits. The server waits in receive while the client sleeps,
+ * then the client waits in send (the ring is full) while the server
+ * sleeps. Both must sleep on the futex instead of spinning: the CPU time of
+ * the blocked thread has to be a small fraction of the time it waited.
+ *
+ *   $> ./test_shm_futex [sleep ms]
+ */
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+static double cputime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec/1e6; // ms
+}
+
+int main(int argc, char** argv){
+	int ms = 500;
+	if (argc>1) ms = std::stoi(argv[1]);
+	const size_t large = SHM_SMALL_MSG_SIZE/2;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("SHM:/test_shm_futex");
+		auto h = Manager::getNext();
+		if (!h.isNewConnection()) return -1;
+		int x = 0;
+		double t = cputime();
+		if (h.receive(&x, sizeof(x)) != sizeof(x) || x != 1) return -1;
+		t = cputime() - t;
+		if (t > ms/5.) {
+			MTCL_ERROR("[Server]:\t", "%.1f ms of CPU while blocked in receive\n", t);
+			return -1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+		std::vector<char> v(large);
+		for(int i=0; i<4; ++i)
+			if (h.receive(v.data(), large) != (ssize_t)large) return -1;
+		h.close();
+		Manager::finalize();
+		return 0;
+	}
+	Manager::init("client");
+	std::this_thread::sleep_for(std::chrono::milliseconds(200)); // the server is listening
+	auto h = Manager::connect("SHM:/test_shm_futex", 100, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[test_shm_futex]:\t", "cannot connect to server\n");
+		return -1;
+	}
+	int nerrors = 0;
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+	int x = 1;
+	if (h.send(&x, sizeof(x)) != sizeof(x)) ++nerrors;
+	std::vector<char> v(large, 'a');
+	double t = cputime();
+	for(int i=0; i<4; ++i) // the last ones wait for the server
+		if (h.send(v.data(), large) != (ssize_t)large) ++nerrors;
+	t = cputime() - t;
+	if (t > ms/5.) {
+		MTCL_ERROR("[test_shm_futex]:\t", "%.1f ms of CPU while blocked in send\n", t);
+		++nerrors;
+	}
+	h.close();
+	Manager::finalize();
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_shm_futex]:\t", "ERROR!\n");
+		return -1;
+	}
+	MTCL_ERROR("[test_shm_futex]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Messages built and read in place in the SHM segment. The client builds
+ * the messages in the buffers returned by acquireSendBuffer, the server
+ * reads them with receiveView (after a probe, or not) and builds the reply
+ * in place as well, that the client gets with receive. A message too large
+ * to be read in place is received with receive after EMSGSIZE. TCP handles
+ * do not support it (ENOTSUP).
+ *
+ *   $> ./test_shm_inplace [nrounds]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+const size_t sizes[] = {1, 1000, 100000, SHM_SMALL_MSG_SIZE/3};
+
+static bool check(const char* p, size_t len, int id) {
+	for(size_t i=0; i<len; ++i)
+		if (p[i] != (char)(id+i)) return false;
+	return true;
+}
+
+int main(int argc, char** argv){
+	int nrounds = 50;
+	if (argc>1) nrounds = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("SHM:/test_shm_inplace");
+		auto h = Manager::getNext();
+		if (!h.isNewConnection()) return -1;
+		int nerrors = 0;
+		std::vector<char> large;
+		for(int r=0; ; ++r) {
+			size_t sz;
+			if (r % 2 && h.probe(sz) <= 0) break;
+			const void* in;
+			ssize_t n = h.receiveView(in);
+			if (n == 0) break;
+			if (n < 0) { // too large to be read in place
+				if (errno != EMSGSIZE || h.probe(sz) <= 0) { ++nerrors; break; }
+				large.resize(sz);
+				if (h.receive(large.data(), sz) != (ssize_t)sz) ++nerrors;
+				h.send(large.data(), sz);
+				continue;
+			}
+			char* out = (char*)h.acquireSendBuffer(n);
+			if (!out) { ++nerrors; break; }
+			memcpy(out, in, n);
+			h.release();
+			if (h.commit() != n) ++nerrors;
+		}
+		h.close();
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	Manager::listen("TCP:localhost:13000");
+	std::this_thread::sleep_for(std::chrono::milliseconds(100)); // the server is listening
+	auto h = Manager::connect("SHM:/test_shm_inplace", 100, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[test_shm_inplace]:\t", "cannot connect to server\n");
+		return -1;
+	}
+	int nerrors = 0;
+	std::vector<char> reply;
+	if (h.acquireSendBuffer(SHM_SMALL_MSG_SIZE) || errno != EMSGSIZE) ++nerrors;
+	for(int r=0; r<nrounds; ++r) {
+		for(size_t size : sizes) {
+			char* p = (char*)h.acquireSendBuffer(size);
+			if (!p) { ++nerrors; continue; }
+			for(size_t i=0; i<size; ++i) p[i] = (char)(r+i);
+			if (h.commit() != (ssize_t)size) ++nerrors;
+			reply.assign(size, 0);
+			if (h.receive(reply.data(), size) != (ssize_t)size || !check(reply.data(), size, r)) ++nerrors;
+		}
+	}
+	// split in several records by send
+	reply.resize(SHM_SMALL_MSG_SIZE + 10);
+	for(size_t i=0; i<reply.size(); ++i) reply[i] = (char)(7+i);
+	h.send(reply.data(), reply.size());
+	if (h.receive(reply.data(), reply.size()) != (ssize_t)reply.size() || !check(reply.data(), reply.size(), 7)) ++nerrors;
+	h.close();
+
+	// not supported by TCP
+	auto t = Manager::connect("TCP:localhost:13000", 10, 200);
+	const void* v;
+	if (!t.isValid() || t.acquireSendBuffer(10) || errno != ENOTSUP ||
+		t.receiveView(v) != -1 || errno != ENOTSUP)
+		++nerrors;
+	t.close();
+	Manager::finalize();
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_shm_inplace]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_shm_inplace]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * SHM ring buffer. Two processes connect at the same time to the server
+ * (both write the connection requests in the listener buffer), then each
+ * one sends a stream of messages of varying sizes without waiting for the
+ * replies (the ring wraps around many times, the large ones are split into
+ * several records) and checks the echoes at the end. A producer of a shared
+ * buffer that dies holding its lock must not block the others, unless it
+ * left a message in part (the buffer is broken).
+ *
+ *   $> ./test_shm_ring [nmsgs]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+static size_t msgsize(int i) {
+	if (i % 50 == 49) return SHM_SMALL_MSG_SIZE + 12345; // larger than the ring
+	return 1 + (i*7919) % 5000;
+}
+
+static void fill(std::vector<char>& v, int id, int i) {
+	for(size_t j=0; j<v.size(); ++j) v[j] = (char)(id*31+i+j);
+}
+
+static int client(int id, int nmsgs) {
+	Manager::init("client" + std::to_string(id));
+	auto h = Manager::connect("SHM:/test_shm_ring", 100, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server\n");
+		return 1;
+	}
+	int nerrors = 0;
+	std::vector<char> buf, reply;
+	// the server echoes a message while we are sending the next ones
+	for(int i=0; i<nmsgs; ++i) {
+		buf.resize(msgsize(i));
+		fill(buf, id, i);
+		if (h.send(buf.data(), buf.size()) != (ssize_t)buf.size()) ++nerrors;
+		if (i % 8 != 7 && i != nmsgs-1) continue;
+		for(int k=i-(i%8); k<=i; ++k) {
+			buf.resize(msgsize(k));
+			fill(buf, id, k);
+			reply.assign(buf.size(), 0);
+			if (h.receive(reply.data(), reply.size()) != (ssize_t)reply.size() || reply != buf) ++nerrors;
+		}
+	}
+	h.close();
+	Manager::finalize();
+	return nerrors;
+}
+
+// a producer of a shared buffer that dies in the middle of a message
+struct deadProducer : shmBuffer {
+	void die(bool partial) {
+		lockProducers();
+		if (partial) { // some records of the message have been published
+			shmp->wstart = shmp->head.load() + 1;
+			shmp->wpartial = 1;
+		}
+		_exit(0);
+	}
+};
+
+// the next producer takes the lock over, errno is EOWNERDEAD if the dead
+// one left a message in part
+static int deadProducerCheck(bool partial) {
+	deadProducer b;
+	if (b.create("/test_shm_ring_dead", true, true) == -1) return 1;
+	pid_t pid = fork();
+	if (pid == 0) b.die(partial);
+	waitpid(pid, nullptr, 0);
+	int x = 42, y = 0, nerrors = 0;
+	ssize_t r = b.put(&x, sizeof(x));
+	if (partial) {
+		if (r != -1 || errno != EOWNERDEAD) ++nerrors;
+	} else if (r != sizeof(x) || b.get(&y, sizeof(y)) != sizeof(y) || y != x) ++nerrors;
+	b.close(true);
+	return nerrors;
+}
+
+int main(int argc, char** argv){
+	int nmsgs = 400;
+	if (argc>1) nmsgs = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		if (Manager::listen("SHM:/test_shm_ring") == -1) return -1;
+		std::vector<char> v;
+		int nclosed = 0;
+		while(nclosed < 2) {
+			auto h = Manager::getNext();
+			if (h.isNewConnection()) continue;
+			size_t sz;
+			if (h.probe(sz) <= 0) {
+				++nclosed;
+				h.close();
+				continue;
+			}
+			v.resize(sz);
+			if (h.receive(v.data(), sz) != (ssize_t)sz) break;
+			h.send(v.data(), sz);
+		}
+		Manager::finalize();
+		return nclosed == 2 ? 0 : -1;
+	}
+	usleep(100000); // the listener buffer is created
+	pid_t pids[2];
+	for(int id=0; id<2; ++id)
+		if ((pids[id] = fork()) == 0) return client(id, nmsgs);
+
+	int nerrors = deadProducerCheck(false) + deadProducerCheck(true);
+	for(pid_t p : {pids[0], pids[1], pid}) {
+		int status;
+		waitpid(p, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) ++nerrors;
+	}
+	if (nerrors) {
+		MTCL_ERROR("[test_shm_ring]:\t", "ERROR!\n");
+		return -1;
+	}
+	MTCL_ERROR("[test_shm_ring]:\t", "OK!\n");
+	return 0;
+}
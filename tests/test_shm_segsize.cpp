@@ -0,0 +1,108 @@
+/*
+ * Size of the SHM rings chosen by who connects ("?size=" in the address).
+ * A connection with small rings has small segments and a small in-place
+ * limit, one with large rings (on huge pages if there are any) accepts
+ * in-place messages larger than the default ring. Messages larger than the
+ * rings go through all of them, and invalid sizes are refused.
+ *
+ *   $> ./test_shm_segsize
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+const char* sizes[] = {"?size=64K", "?size=32M", ""};
+
+// sends a message of sz bytes, in place if inplace, and checks the echo
+static int roundtrip(HandleUser& h, size_t sz, bool inplace) {
+	std::vector<char> v(sz);
+	for(size_t i=0; i<sz; ++i) v[i] = (char)(i*7);
+	if (inplace) {
+		char* p = (char*)h.acquireSendBuffer(sz);
+		if (!p) return 1;
+		memcpy(p, v.data(), sz);
+		if (h.commit() != (ssize_t)sz) return 1;
+	} else if (h.send(v.data(), sz) != (ssize_t)sz) return 1;
+	std::vector<char> r(sz);
+	if (h.receive(r.data(), sz) != (ssize_t)sz || r != v) return 1;
+	return 0;
+}
+
+// size of the segment of the input ring of the n-th connection, 0 if it is
+// not in /dev/shm
+static off_t segsize(int n) {
+	struct stat sb;
+	std::string name = "/dev/shm/client_in_" + std::to_string(n);
+	return stat(name.c_str(), &sb) == 0 ? sb.st_size : 0;
+}
+
+int main(int argc, char** argv){
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("SHM:/test_shm_segsize");
+		for(size_t c=0; c<sizeof(sizes)/sizeof(sizes[0]); ++c) {
+			auto h = Manager::getNext();
+			if (!h.isNewConnection()) return -1;
+			size_t sz;
+			while(h.probe(sz) > 0 && sz > 0) {
+				std::vector<char> v(sz);
+				if (h.receive(v.data(), sz) != (ssize_t)sz) return -1;
+				h.send(v.data(), sz);
+			}
+			h.close();
+		}
+		Manager::finalize();
+		return 0;
+	}
+	Manager::init("client");
+	int nerrors = 0;
+	const size_t large = 10<<20;
+	for(int c=0; c<3; ++c) {
+		auto h = Manager::connect(std::string("SHM:/test_shm_segsize")+sizes[c], 10, 100);
+		if (!h.isValid()) {
+			MTCL_ERROR("[test_shm_segsize]:\t", "cannot connect to server\n");
+			return -1;
+		}
+		off_t s = segsize(c);
+		switch(c) {
+		case 0:
+			if (s < (64<<10) || s > (64<<10)+4096) ++nerrors;
+			if (h.acquireSendBuffer(40000) || errno != EMSGSIZE) ++nerrors;
+			nerrors += roundtrip(h, 20000, true);
+			break;
+		case 1: // not in /dev/shm if it is on huge pages
+			if (s && s < (32<<20)) ++nerrors;
+			nerrors += roundtrip(h, large, true);
+			break;
+		default:
+			if (s < SHM_SMALL_MSG_SIZE || s > SHM_SMALL_MSG_SIZE+4096) ++nerrors;
+			if (h.acquireSendBuffer(large) || errno != EMSGSIZE) ++nerrors;
+		}
+		nerrors += roundtrip(h, 1, false);
+		nerrors += roundtrip(h, large + 12345, false); // larger than the rings
+		if (nerrors) MTCL_ERROR("[test_shm_segsize]:\t", "errors with %s\n", sizes[c]);
+		h.close();
+	}
+	for(auto p : {"?size=12x", "?len=1M", "?size=100", "?size=4G", "?size=100000000000G"}) {
+		auto h = Manager::connect(std::string("SHM:/test_shm_segsize")+p, 10, 100);
+		if (h.isValid()) {
+			MTCL_ERROR("[test_shm_segsize]:\t", "%s accepted\n", p);
+			++nerrors;
+		}
+	}
+	Manager::finalize();
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_shm_segsize]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_shm_segsize]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Same-host upgrade of TCP connections to shared memory. The client connects
+ * to a server with the upgrade enabled and to one with the upgrade disabled,
+ * only the first connection must use the shared buffers (they are mapped by
+ * the process). Messages larger than the shared buffer, isend, irecv and
+ * scattered sends are echoed back by the servers, that get the handles with
+ * getNext (i.e., through the IO thread) and receive the EOS at the end.
+ *
+ *   $> ./test_shm_upgrade [nrounds]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+#include "echo_server.hpp"
+
+const size_t largesize = SHM_SMALL_MSG_SIZE + SHM_SMALL_MSG_SIZE/2;
+
+// shared buffers of upgraded connections mapped by this process
+static int upgradedBuffers() {
+	std::ifstream maps("/proc/self/maps");
+	std::string line;
+	int n = 0;
+	while(std::getline(maps, line))
+		if (line.find("/mtcl-up-") != std::string::npos) ++n;
+	return n;
+}
+
+static int server(const std::string& addr, bool upgrade) {
+	Manager::setShmUpgrade(upgrade);
+	bool mapped = false;
+	int r = echoServer(addr, [&](HandleUser&) { mapped = upgradedBuffers() > 0; });
+	return r == 0 && mapped == upgrade ? 0 : -1;
+}
+
+static int client(const std::string& addr, int nrounds, bool upgraded) {
+	int before = upgradedBuffers();
+	auto h = Manager::connect(addr, 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to %s\n", addr.c_str());
+		return -1;
+	}
+	int nerrors = 0;
+	if ((upgradedBuffers() > before) != upgraded) {
+		MTCL_ERROR("[Client]:\t", "connection to %s %supgraded\n", addr.c_str(), upgraded ? "not " : "");
+		++nerrors;
+	}
+	std::vector<char> large(largesize), reply(largesize);
+	for(int r=0; r<nrounds; ++r) {
+		int x = r, y = -1;
+		auto req = h.isend(&x, sizeof(x));
+		if (req.wait() != sizeof(x)) ++nerrors;
+		auto rreq = h.irecv(&y, sizeof(y));
+		if (rreq.wait() != sizeof(y) || y != r) ++nerrors;
+
+		for(size_t i=0; i<largesize; ++i) large[i] = (char)(r+i);
+		struct iovec iov[2] = {{large.data(), 10}, {large.data()+10, largesize-10}};
+		if (h.send(iov, 2) != (ssize_t)largesize) ++nerrors;
+		size_t sz;
+		if (h.probe(sz) != sizeof(size_t) || sz != largesize) { ++nerrors; continue; }
+		struct iovec riov[2] = {{reply.data(), 100}, {reply.data()+100, largesize-100}};
+		if (h.receive(riov, 2) != (ssize_t)largesize || reply != large) ++nerrors;
+	}
+	int last = 42;
+	h.send(&last, sizeof(last));
+	if (h.receive(&last, sizeof(last)) != sizeof(last) || last != 42) ++nerrors;
+	h.close();
+	return nerrors;
+}
+
+int main(int argc, char** argv){
+	int nrounds = 10;
+	if (argc>1) nrounds = std::stoi(argv[1]);
+
+	const std::string servers[2] = {"TCP:localhost:13000", "TCP:localhost:13001"};
+	pid_t pids[2];
+	for(int i=0; i<2; ++i)
+		if ((pids[i] = fork()) == 0) return server(servers[i], i == 0);
+
+	Manager::setShmUpgrade(true);
+	Manager::init("client");
+	int nerrors = 0;
+	for(int i=0; i<2; ++i) {
+		int e = client(servers[i], nrounds, i == 0);
+		if (e) {
+			MTCL_ERROR("[test_shm_upgrade]:\t", "ERROR with server %s (%d errors)\n", servers[i].c_str(), e);
+			if (e < 0) kill(pids[i], SIGKILL);
+			++nerrors;
+		}
+	}
+	Manager::finalize();
+	for(int i=0; i<2; ++i) {
+		int status;
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) ++nerrors;
+	}
+	if (nerrors) {
+		MTCL_ERROR("[test_shm_upgrade]:\t", "ERROR!\n");
+		return -1;
+	}
+	MTCL_ERROR("[test_shm_upgrade]:\t", "OK!\n");
+	return 0;
+}
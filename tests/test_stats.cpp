@@ -0,0 +1,97 @@
+/*
+ * The counters of the handles, of the protocols and of the Manager have to
+ * account for the messages exchanged in a ping-pong. If the test is compiled
+ * with MTCL_DISABLE_STATS they all have to be zero.
+ *
+ *   $> ./test_stats [nmsgs]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include "mtcl.hpp"
+
+#if defined(MTCL_DISABLE_STATS)
+#define EXPECTED(X) 0
+#else
+#define EXPECTED(X) (X)
+#endif
+
+static int check(const char* what, uint64_t value, uint64_t expected) {
+	if (value == expected) return 0;
+	MTCL_ERROR("[test_stats]:\t", "%s is %lu, expected %lu\n", what, value, expected);
+	return 1;
+}
+
+int main(int argc, char** argv){
+	int nmsgs = 1000;
+	if (argc>1) nmsgs = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("TCP:localhost:13000");
+
+		int nerrors = 0;
+		uint64_t received = 0;
+		while(true) {
+			auto h = Manager::getNext();
+			if (h.isNewConnection()) continue;
+			int x;
+			ssize_t r = h.receive(&x, sizeof(x));
+			if (r <= 0) break;
+			++received;
+			h.send(&x, sizeof(x));
+		}
+		auto s = Manager::stats();
+		auto& tcp = s.protocols["TCP"];
+		nerrors += check("server TCP msgs_recv", tcp.msgs_recv, EXPECTED(received));
+		nerrors += check("server TCP msgs_sent", tcp.msgs_sent, EXPECTED(received));
+		nerrors += check("server TCP bytes_recv", tcp.bytes_recv, EXPECTED(received*sizeof(int)));
+		// the new connection, the messages and the close
+		nerrors += check("server ready_picked", s.ready_picked, EXPECTED(received+2));
+		if (EXPECTED(1) && s.loop_iterations == 0) {
+			MTCL_ERROR("[test_stats]:\t", "no progress engine iterations\n");
+			++nerrors;
+		}
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::init("client");
+	auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	int nerrors = 0;
+	for(int i=0; i<nmsgs; ++i) {
+		int x = i;
+		h.send(&x, sizeof(x));
+		if (h.receive(&x, sizeof(x)) != sizeof(x) || x != i) ++nerrors;
+	}
+	size_t sz;
+	errno = 0;
+	if (h.probe(sz, false) != -1 || errno != EWOULDBLOCK) ++nerrors;
+
+	auto hs = h.stats();
+	nerrors += check("client msgs_sent", hs.msgs_sent, EXPECTED(nmsgs));
+	nerrors += check("client bytes_sent", hs.bytes_sent, EXPECTED(nmsgs*sizeof(int)));
+	nerrors += check("client msgs_recv", hs.msgs_recv, EXPECTED(nmsgs));
+	nerrors += check("client bytes_recv", hs.bytes_recv, EXPECTED(nmsgs*sizeof(int)));
+	nerrors += check("client probes", hs.probes, EXPECTED(nmsgs+1));
+	nerrors += check("client would_block", hs.would_block, EXPECTED(1));
+	auto tcp = Manager::stats().protocols["TCP"];
+	nerrors += check("client TCP msgs_sent", tcp.msgs_sent, EXPECTED(nmsgs));
+	h.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_stats]:\t", "ERROR!\n");
+		return -1;
+	}
+	MTCL_ERROR("[test_stats]:\t", "OK!\n");
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Multi-rail TCP (STCP). Two clients connect at the same time, so the
+ * sockets of the two connections are accepted interleaved. They send messages
+ * around STCP_THRESHOLD (striped or not, sizes not multiple of the number of
+ * sockets), contiguous and scattered, mixed with small isends, and the server
+ * echoes them back. The replies are received into scattered buffers.
+ * Before them, a peer connects without sending its Hello: it must not stop
+ * the server and its socket is closed after STCP_HELLO_TIMEOUT.
+ *
+ *   $> ./test_striped [nrounds]
+ */
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "mtcl.hpp"
+
+const size_t sizes[] = {1, STCP_THRESHOLD-1, STCP_THRESHOLD, STCP_THRESHOLD+STCP_RAILS+1, 5*STCP_THRESHOLD+3};
+
+static int client(int id, int nrounds) {
+	auto h = Manager::connect("STCP:localhost:13000", 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server\n");
+		return 1;
+	}
+	int nerrors = 0;
+	std::vector<char> buf, reply;
+	for(int r=0; r<nrounds; ++r) {
+		for(size_t size : sizes) {
+			buf.resize(size);
+			reply.assign(size, 0);
+			for(size_t i=0; i<size; ++i) buf[i] = (char)(id+r+i);
+			int x = r;
+			auto req = h.isend(&x, sizeof(x));
+			if (r % 2) {
+				struct iovec iov[3] = {{buf.data(), size/3}, {buf.data()+size/3, 7*size/12-size/3},
+									   {buf.data()+7*size/12, size-7*size/12}};
+				if (h.send(iov, 3) != (ssize_t)size) ++nerrors;
+			} else if (h.send(buf.data(), size) != (ssize_t)size) ++nerrors;
+			if (req.wait() != sizeof(x)) ++nerrors;
+
+			int y = -1;
+			if (h.receive(&y, sizeof(y)) != sizeof(y) || y != r) ++nerrors;
+			size_t sz;
+			if (h.probe(sz) != sizeof(size_t) || sz != size) { ++nerrors; continue; }
+			struct iovec riov[2] = {{reply.data(), size/2}, {reply.data()+size/2, size-size/2}};
+			if (h.receive(riov, 2) != (ssize_t)size || reply != buf) ++nerrors;
+		}
+	}
+	int last = 42;
+	h.send(&last, sizeof(last));
+	if (h.receive(&last, sizeof(last)) != sizeof(last) || last != 42) ++nerrors;
+	h.close();
+	return nerrors;
+}
+
+int main(int argc, char** argv){
+	int nrounds = 4;
+	if (argc>1) nrounds = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("server");
+		Manager::listen("STCP:localhost:13000");
+
+		std::vector<char> v;
+		int nclosed = 0, nlast = 0;
+		while(nclosed < 2) {
+			auto h = Manager::getNext();
+			if (h.isNewConnection()) continue;
+			size_t sz;
+			if (h.probe(sz) <= 0) {
+				++nclosed;
+				continue;
+			}
+			v.resize(sz);
+			if (h.receive(v.data(), sz) != (ssize_t)sz) break;
+			if (sz == sizeof(int) && *(int*)v.data() == 42) ++nlast;
+			h.send(v.data(), sz);
+		}
+		Manager::finalize();
+		return nlast == 2 ? 0 : -1;
+	}
+	// the peer without a Hello
+	int silent = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sa = {};
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(13000);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for(int i=0; i<50 && connect(silent, (struct sockaddr*)&sa, sizeof(sa)) == -1; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	std::this_thread::sleep_for(std::chrono::milliseconds(STCP_HELLO_TIMEOUT+500));
+	char c;
+	int expired = recv(silent, &c, 1, MSG_DONTWAIT) == 0;
+	close(silent);
+
+	Manager::init("client");
+	int nerrors[2] = {!expired, 0};
+	std::thread th([&]{ nerrors[1] = client(1, nrounds); });
+	nerrors[0] = client(0, nrounds);
+	th.join();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors[0] || nerrors[1] || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		if (!expired) MTCL_ERROR("[test_striped]:\t", "the socket without a Hello is still open\n");
+		MTCL_ERROR("[test_striped]:\t", "ERROR! (%d %d errors)\n", nerrors[0], nerrors[1]);
+		return -1;
+	}
+	MTCL_ERROR("[test_striped]:\t", "OK!\n");
+	return 0;
+}
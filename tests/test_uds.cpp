@@ -0,0 +1,98 @@
+/*
+ * Unix domain sockets. Two servers listen on a path, replacing the stale
+ * socket file left there, and on a name in the abstract namespace. The
+ * client connects to both, sends messages with send, isend and a scattered
+ * send, and the server echoes them back. The path is removed by finalize.
+ *
+ *   $> ./test_uds [nrounds]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+#include "echo_server.hpp"
+
+const std::string sockpath = "/tmp/mtcl_test_uds.sock";
+const size_t largesize = 1<<20;
+
+static int client(const std::string& addr, int nrounds) {
+	auto h = Manager::connect(addr, 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to %s\n", addr.c_str());
+		return -1;
+	}
+	int nerrors = 0;
+	std::vector<char> large(largesize), reply(largesize);
+	for(int r=0; r<nrounds; ++r) {
+		int x = r, y = -1;
+		auto req = h.isend(&x, sizeof(x));
+		if (req.wait() != sizeof(x)) ++nerrors;
+		if (h.receive(&y, sizeof(y)) != sizeof(y) || y != r) ++nerrors;
+
+		for(size_t i=0; i<largesize; ++i) large[i] = (char)(r+i);
+		struct iovec iov[2] = {{large.data(), 10}, {large.data()+10, largesize-10}};
+		if (h.send(iov, 2) != (ssize_t)largesize) ++nerrors;
+		size_t sz;
+		if (h.probe(sz) != sizeof(size_t) || sz != largesize ||
+			h.receive(reply.data(), sz) != (ssize_t)sz || reply != large)
+			++nerrors;
+	}
+	int last = 42;
+	h.send(&last, sizeof(last));
+	if (h.receive(&last, sizeof(last)) != sizeof(last) || last != 42) ++nerrors;
+	h.close();
+	return nerrors;
+}
+
+int main(int argc, char** argv){
+	int nrounds = 20;
+	if (argc>1) nrounds = std::stoi(argv[1]);
+
+	// a socket file nobody listens on
+	unlink(sockpath.c_str());
+	struct sockaddr_un sa;
+	socklen_t len;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || unix_address(sockpath, sa, len) == -1 ||
+		bind(fd, (struct sockaddr*)&sa, len) == -1) {
+		MTCL_ERROR("[test_uds]:\t", "cannot create the stale socket file\n");
+		return -1;
+	}
+	close(fd);
+
+	const std::string servers[2] = {"UDS:" + sockpath, "UDS:@mtcl_test_uds"};
+	pid_t pids[2];
+	for(int i=0; i<2; ++i)
+		if ((pids[i] = fork()) == 0) return echoServer(servers[i]);
+
+	Manager::init("client");
+	int nerrors = 0;
+	for(int i=0; i<2; ++i) {
+		int e = client(servers[i], nrounds);
+		if (e) {
+			MTCL_ERROR("[test_uds]:\t", "ERROR with server %s (%d errors)\n", servers[i].c_str(), e);
+			if (e < 0) kill(pids[i], SIGKILL);
+			++nerrors;
+		}
+	}
+	Manager::finalize();
+	for(int i=0; i<2; ++i) {
+		int status;
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) ++nerrors;
+	}
+	struct stat st;
+	if (stat(sockpath.c_str(), &st) == 0) {
+		MTCL_ERROR("[test_uds]:\t", "%s not removed\n", sockpath.c_str());
+		++nerrors;
+	}
+	if (nerrors) {
+		MTCL_ERROR("[test_uds]:\t", "ERROR!\n");
+		return -1;
+	}
+	MTCL_ERROR("[test_uds]:\t", "OK!\n");
+	return 0;
+}
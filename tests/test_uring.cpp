@@ -0,0 +1,137 @@
+/*
+ * TCP over io_uring. The client connects with URING to a server listening
+ * with URING and to a server listening with TCP (same wire format). It sends bursts of
+ * isends, that are written in batches, mixed with blocking sends, a message
+ * larger than the receive buffers of the ring and an irecv. The server
+ * echoes everything back. At the end the client does not read the replies
+ * of a burst of large messages for a while: the receive must be paused
+ * instead of buffering all of them.
+ *
+ *   $> g++ -std=c++17 -I ../include -DENABLE_URING test_uring.cpp -o test_uring -pthread
+ *   $> ./test_uring [nrounds]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+#include "echo_server.hpp"
+
+#if defined(ENABLE_URING)
+
+const int    burst = 300;
+const size_t largesize = 4*URING_BUFFER_SIZE + 123;
+const int    nbig = 16;
+
+// resident memory of the process (KiB)
+static inline long vmrss() {
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while(std::getline(status, line))
+		if (line.compare(0, 6, "VmRSS:") == 0) return std::stol(line.substr(6));
+	return 0;
+}
+
+static int client(const std::string& addr, int nrounds) {
+	auto h = Manager::connect(addr, 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to %s\n", addr.c_str());
+		return -1;
+	}
+	int nerrors = 0;
+	std::vector<int> vals(burst);
+	std::vector<char> large(largesize), reply(largesize);
+	for(int r=0; r<nrounds; ++r) {
+		// isends, one blocking send in the middle
+		std::vector<Request> reqs;
+		for(int i=0; i<burst; ++i) {
+			vals[i] = r*burst+i;
+			if (i == burst/2) h.send(&vals[i], sizeof(int));
+			else reqs.push_back(h.isend(&vals[i], sizeof(int)));
+		}
+		for(auto& req : reqs)
+			if (req.wait() != sizeof(int)) ++nerrors;
+		for(int i=0; i<burst; ++i) {
+			int x = -1;
+			if (h.receive(&x, sizeof(x)) != sizeof(x) || x != r*burst+i) { ++nerrors; break; }
+		}
+		// larger than the buffers provided to the ring
+		for(size_t i=0; i<largesize; ++i) large[i] = (char)(r+i);
+		if (h.send(large.data(), large.size()) != (ssize_t)large.size()) ++nerrors;
+		size_t sz;
+		if (h.probe(sz) != sizeof(size_t) || sz != largesize ||
+			h.receive(reply.data(), sz) != (ssize_t)sz || reply != large)
+			++nerrors;
+		// irecv posted before the message is sent
+		int x = -1;
+		auto rreq = h.irecv(&x, sizeof(x));
+		h.send(&r, sizeof(r));
+		if (rreq.wait() != sizeof(x) || x != r) ++nerrors;
+	}
+	std::vector<char> big(URING_RBUF_MAX, 'b'), bigreply(URING_RBUF_MAX);
+	std::vector<Request> reqs;
+	for(int i=0; i<nbig; ++i) reqs.push_back(h.isend(big.data(), big.size()));
+#if !defined(SINGLE_IO_THREAD) // nobody receives meanwhile otherwise
+	long rss = vmrss();
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	if (vmrss() - rss > 4*URING_RBUF_MAX/1024) {
+		MTCL_ERROR("[Client]:\t", "%ld KiB buffered by a slow receiver\n", vmrss() - rss);
+		++nerrors;
+	}
+#endif
+	for(int i=0; i<nbig; ++i)
+		if (h.receive(bigreply.data(), bigreply.size()) != (ssize_t)bigreply.size() || bigreply != big) ++nerrors;
+	for(auto& req : reqs)
+		if (req.wait() != (ssize_t)big.size()) ++nerrors;
+
+	int last = 42;
+	auto req = h.isend(&last, sizeof(last));
+	if (req.wait() != sizeof(last)) ++nerrors;
+	if (h.receive(&last, sizeof(last)) != sizeof(last) || last != 42) ++nerrors;
+	h.close();
+	return nerrors;
+}
+
+int main(int argc, char** argv){
+	int nrounds = 20;
+	if (argc>1) nrounds = std::stoi(argv[1]);
+
+	const std::string servers[2] = {"URING:localhost:13000", "TCP:localhost:13001"};
+	pid_t pids[2];
+	for(int i=0; i<2; ++i)
+		if ((pids[i] = fork()) == 0) return echoServer(servers[i]);
+
+	Manager::init("client");
+	int nerrors = 0;
+	for(int i=0; i<2; ++i) {
+		int e = client("URING" + servers[i].substr(servers[i].find(':')), nrounds);
+		if (e) {
+			MTCL_ERROR("[test_uring]:\t", "ERROR with server %s (%d errors)\n", servers[i].c_str(), e);
+			if (e < 0) kill(pids[i], SIGKILL);
+			++nerrors;
+		}
+	}
+	Manager::finalize();
+	for(int i=0; i<2; ++i) {
+		int status;
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) ++nerrors;
+	}
+	if (nerrors) {
+		MTCL_ERROR("[test_uring]:\t", "ERROR!\n");
+		return -1;
+	}
+	MTCL_ERROR("[test_uring]:\t", "OK!\n");
+	return 0;
+}
+
+#else
+
+int main() {
+	MTCL_ERROR("[test_uring]:\t", "compile with -DENABLE_URING, skipped\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Large TCP sends (above TCP_ZEROCOPY_THRESHOLD), contiguous, scattered and
+ * isend. The client overwrites the buffer as soon as the send completes, the
+ * server echoes every message back and the client checks that the content
+ * is the one at the time of the send. Small isends are mixed in between.
+ *
+ *   $> ./test_zerocopy [nrounds]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+#include "echo_server.hpp"
+
+const size_t largesize = 2*TCP_ZEROCOPY_THRESHOLD + 123;
+
+static void fill(std::vector<char>& v, int seed) {
+	for(size_t i=0; i<v.size(); ++i) v[i] = (char)(seed+i);
+}
+
+int main(int argc, char** argv){
+	int nrounds = 10;
+	if (argc>1) nrounds = std::stoi(argv[1]);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		return echoServer("TCP:localhost:13000");
+	}
+	Manager::init("client");
+	auto h = Manager::connect("TCP:localhost:13000", 10, 200);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	int nerrors = 0;
+	std::vector<char> buf(largesize), expected(largesize), reply(largesize);
+	auto check = [&](int seed) {
+		size_t sz;
+		fill(expected, seed);
+		if (h.probe(sz) != sizeof(size_t) || sz != largesize ||
+			h.receive(reply.data(), sz) != (ssize_t)sz || reply != expected)
+			++nerrors;
+	};
+	for(int r=0; r<nrounds; ++r) {
+		fill(buf, 3*r);
+		if (h.send(buf.data(), buf.size()) != (ssize_t)buf.size()) ++nerrors;
+		fill(buf, -1);
+		check(3*r);
+
+		fill(buf, 3*r+1);
+		struct iovec iov[2] = {{buf.data(), 1000}, {buf.data()+1000, buf.size()-1000}};
+		if (h.send(iov, 2) != (ssize_t)buf.size()) ++nerrors;
+		fill(buf, -1);
+		check(3*r+1);
+
+		int x = r;
+		fill(buf, 3*r+2);
+		auto req1 = h.isend(&x, sizeof(x));
+		auto req2 = h.isend(buf.data(), buf.size());
+		if (req1.wait() != sizeof(x) || req2.wait() != (ssize_t)buf.size()) ++nerrors;
+		fill(buf, -1);
+		x = -1;
+		if (h.receive(&x, sizeof(x)) != sizeof(x) || x != r) ++nerrors;
+		check(3*r+2);
+	}
+	int last = 42;
+	h.send(&last, sizeof(last));
+	if (h.receive(&last, sizeof(last)) != sizeof(last) || last != 42) ++nerrors;
+	h.close();
+	Manager::finalize();
+
+	int status;
+	wait(&status);
+	if (nerrors || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		MTCL_ERROR("[test_zerocopy]:\t", "ERROR! (%d errors)\n", nerrors);
+		return -1;
+	}
+	MTCL_ERROR("[test_zerocopy]:\t", "OK!\n");
+	return 0;
+}